@@ -51,11 +51,22 @@
 #include <sys/rwlock.h>
 #include <sys/lock.h>
 #include <sys/mutex.h>
+#include <sys/sx.h>
+#include <machine/atomic.h>
+#include <machine/cpufunc.h>
 
 #include <sys/fcntl.h>
+#include <sys/ioccom.h>
+#include <sys/domainset.h>
 #include <sys/proc.h>
+#include <sys/refcount.h>
 #include <sys/sched.h>
 #include <sys/selinfo.h>
+#include <sys/smp.h>
+#include <sys/mman.h>
+#include <sys/sysctl.h>
+#include <sys/taskqueue.h>
+#include <sys/ucred.h>
 
 #include <vm/vm.h>
 #include <vm/pmap.h>
@@ -65,6 +76,7 @@
 #include <vm/vm_pager.h>
 #include <vm/vm_map.h>
 #include <vm/vm_kern.h>
+#include <vm/vm_phys.h>
 #include <vm/uma.h>
 
 #include "kup_dev.h"
@@ -79,25 +91,218 @@
 #define DEBUG_PRINT(...) do{ } while (0)
 #endif
 
+// Length of the message last sent on the channel, in either direction.
+#define LEN_OFFSET(a)  ((uint32_t*)(a + 4))
 #define CMD_OFFSET(a)  ((int*)(a + 8))
+// Messages of up to KUP_INLINE_SIZE bytes are stored here instead of in the
+// data pages, in the same cache line as the turn, so that passing one over
+// moves a single cache line. KUP_LEN_INLINE is set in the length then.
+#define INLINE_OFFSET(a)  ((void*)(a + 16))
+#define KUP_INLINE_SIZE		48
+#define KUP_LEN_INLINE		0x80000000u
+// The NUMA domain the channel pages were allocated from, reported back to
+// the user space daemon. Kept off the first cache line of the control page
+// which is reserved for the fields touched on every transaction.
+#define DOMAIN_OFFSET(a)  ((int*)(a + 64))
+// The CPU the channel is bound to, or KUP_CPU_NONE, so that the daemon
+// thread serving the channel can run next to the kernel producer.
+#define CPU_OFFSET(a)  ((int*)(a + 68))
+// The index of the channel in its device, so that a daemon attached to any
+// free channel, or one the channel was handed off to, can tell which it is.
+#define INDEX_OFFSET(a)  ((int*)(a + 72))
+
+// The mmap offset used by the user space library to attach a channel may
+// carry the preferred NUMA domain of the channel memory in these bits. The
+// encoded value is (domain + 1), so 0 means no preference.
+#define KUP_OFF_DOMAIN_SHIFT	48
+#define KUP_OFF_DOMAIN_MASK		((vm_ooffset_t)0xff << KUP_OFF_DOMAIN_SHIFT)
+// Set in the mmap offset to attach to any free channel. Otherwise the rest
+// of the offset selects the channel, see kup_mmap_single().
+#define KUP_OFF_ANY				((vm_ooffset_t)1 << 56)
+// Set in the mmap offset to map channels already attached through the same
+// open file, handed off by another process. See kup_mmap_single().
+#define KUP_OFF_ADOPT			((vm_ooffset_t)1 << 57)
+// Set in the mmap offset to map the statistics of the channels instead of
+// channels, see map_stats().
+#define KUP_OFF_STATS			((vm_ooffset_t)1 << 58)
+
+// Version of the interface between the KUP device and the user space
+// library, reported by KUPIOC_GEOMETRY. Bumped whenever the channel layout
+// or the meaning of the mmap offset changes.
+#define KUP_ABI_VERSION		5
+
+/**
+ * Reply to the KUPIOC_GEOMETRY ioctl. Mirrored in kuplib/kup_private.h.
+ */
+struct kup_geometry {
+	uint32_t	kg_version;
+	uint32_t	kg_page_size;
+	// Number of channels of the device.
+	uint64_t	kg_channels;
+	// Size of the kernel to user space area of each channel in pages.
+	uint64_t	kg_size;
+	// Number of channels no daemon is attached to.
+	uint64_t	kg_free;
+	// Size of the user space to kernel area of each channel in pages, 0 if
+	// it is the end of the control page.
+	uint64_t	kg_rsize;
+};
+
+/**
+ * Counters of a channel. The statistics of a device are an array of these,
+ * one per channel, that user space maps read-only with KUP_OFF_STATS and
+ * that the dev.kup.<name>.stats sysctl returns. Mirrored in
+ * kuplib/kup_stats.h.
+ */
+struct kup_chan_stats {
+	// Messages and bytes sent to the daemon and received from it. Updated by
+	// the kernel thread that has the turn, so they share its cache line.
+	uint64_t	ks_msgs_out;
+	uint64_t	ks_bytes_out;
+	uint64_t	ks_msgs_in;
+	uint64_t	ks_bytes_in;
+	// Time the kernel side waited for the turn spinning and sleeping, in
+	// nanoseconds, and the number of sleeps. See wait_for_turn().
+	uint64_t	ks_spin_ns;
+	uint64_t	ks_sleep_ns;
+	uint64_t	ks_sleeps;
+	// Uptime in nanoseconds when the kernel side started the wait for the
+	// turn it is in, 0 if it is not waiting.
+	uint64_t	ks_wait_start;
+	// Number of times a daemon attached to the channel and detached from it.
+	uint64_t	ks_attaches;
+	uint64_t	ks_detaches;
+	// Process of the daemon attached to the channel, 0 if there is none.
+	int32_t		ks_pid;
+	uint32_t	ks_reserved1;
+	uint64_t	ks_reserved[5];
+};
+CTASSERT(sizeof(struct kup_chan_stats) == 128);
+
+#define KUPIOC_GEOMETRY		_IOR('k', 1, struct kup_geometry)
+// Makes the calling process the owner of the channels attached through the
+// file, and returns their count.
+#define KUPIOC_CLAIM		_IOR('k', 2, uint64_t)
+// Detaches the daemon from the channel with the given index, which must have
+// been attached through the file, without waiting for the file to be closed.
+#define KUPIOC_DETACH		_IOW('k', 3, uint32_t)
+
+// Size of the memory segment backing each channel of 'sc'.
+#define CHAN_BYTES(sc)	\
+		((vm_ooffset_t)(1 + (sc)->size + (sc)->rsize) * PAGE_SIZE)
 
 #define DATA_SEND_OFFSET(c,i)				\
-		((void*)(c->comm_channels[i].mem +  \
+		((void*)(get_channel(c, i)->kva +   \
 				PAGE_SIZE))
 
+// Devices without pages for the user space to kernel direction use the end
+// of the control page for it.
 #define DATA_RECV_OFFSET(c,i) 				\
-		((void*)(c->comm_channels[i].mem +  \
-				(c->size + 1) * PAGE_SIZE))
+		((void*)(get_channel(c, i)->kva +   \
+				((c)->rsize ? ((c)->size + 1) * PAGE_SIZE : \
+				PAGE_SIZE - KUP_SMALL_RETURN_SIZE)))
+
+struct kup_file;
+
+/**
+ * Memory of the channels attached with a single mmap(2). Each attach that
+ * cannot reuse memory gets a segment of its own, backed by an object of its
+ * own, so that a daemon that keeps its mapping after it detaches cannot see
+ * the memory of a later daemon. See warm_channels().
+ */
+typedef struct kup_segment {
+	// Backs the channels of the segment, one after the other. Its NUMA
+	// policy is set once, when it is allocated, so that pages faulted in
+	// later come from the same domain.
+	vm_object_t		obj;
+	// Kernel mapping of the whole object. The parts of the channels that
+	// have left the segment are unmapped.
+	vm_offset_t		kva;
+	vm_size_t		size;
+	int				domain;
+	// Number of channels still using memory of the segment. The segment is
+	// freed with the last of them, see cool_channel().
+	u_int			users;
+} kup_segment_t;
 
 typedef struct comm_channel {
+	// Fields used on every transaction.
 	_Alignas(CACHE_LINE_SIZE)
+	// Only taken to attach a daemon to the channel, detach it, and change
+	// the status of the channel. Sending and receiving go by the turn word
+	// in the control page alone, see enter_channel().
 	struct mtx 					lock;
+	// Kernel mapping of the memory of this channel while a daemon is
+	// attached, 0 otherwise.
 	volatile vm_offset_t		mem;
-	pid_t						pid;
+	// Kernel mapping of the memory of this channel. It is kept, wired, after
+	// the daemon detaches, so that the next daemon may find it ready. The
+	// data path uses this one, as it stays valid until the channel is
+	// drained.
+	vm_offset_t					kva;
 	volatile int				status;
-	SLIST_ENTRY(comm_channel)	next;
+	// Number of threads in kupdev_send() or kupdev_receive() on the channel,
+	// plus one for an outstanding lease. The memory of the channel is not
+	// released while there are any.
+	volatile u_int				users;
+	// Counters of the channel, in the statistics of its device.
+	struct kup_chan_stats*		stats;
+	// Set while the data received on the channel is leased, see
+	// kupdev_receive_lease().
+	volatile u_int				leased;
+	// Value of 'ticks' when the data path last entered the channel, see
+	// reclaim_idle_channels().
+	volatile int				last_used;
+	// Serializes the kernel threads sending and receiving on the channel,
+	// which may pick the same channel without knowing of each other, see
+	// channel_send(). Not held while a lease is outstanding, 'leased' keeps
+	// senders off then.
+	struct sx					io_lock;
+
+	// Fields only used when a daemon attaches to or detaches from the
+	// channel, kept off the cache line of the fields above.
+	_Alignas(CACHE_LINE_SIZE)
+	// The open file of the KUP device through which the daemon attached to
+	// the channel. The channel is released when that file is closed.
+	struct kup_file*			owner;
+	TAILQ_ENTRY(comm_channel)	owner_link;
+	pid_t						pid;
+	// NUMA domain of the memory backing this channel.
+	int							domain;
+	// Segment holding the memory of this channel while 'kva' is set, and
+	// the offset of the channel in it.
+	kup_segment_t*				seg;
+	vm_ooffset_t				seg_off;
+	// CPU whose kupdev_send_local() calls go to this channel, or
+	// KUP_CPU_NONE. Changed with the resize lock of the device held.
+	int							cpu;
+	// Index of this channel in its KUP device.
+	size_t						index;
+	// 'last_used' as of the last time the data pages of the channel were
+	// reclaimed, so that an idle channel is only reclaimed once.
+	int							reclaimed;
+	// Whether the channel is on the free list of its KUP device.
+	int							free;
+	// Links the channel into either the free list or the pending list of
+	// its KUP device. See reserve_channel().
+	TAILQ_ENTRY(comm_channel)	link;
 } comm_channel_t;
 
+TAILQ_HEAD(channel_list, comm_channel);
+
+/**
+ * Per open() state of a KUP device, stored as the cdevpriv of the file.
+ */
+typedef struct kup_file {
+	struct kupdev_softc*	sc;
+	// Channels attached through this file. Protected by the list lock of
+	// the device.
+	struct channel_list		channels;
+	// Set if the file was opened read-only, which is only good for mapping
+	// the statistics of the device.
+	int						readonly;
+} kup_file_t;
+
 typedef struct {
 		size_t i;
 		comm_channel_t *chan;
@@ -105,10 +310,24 @@ typedef struct {
 #define channel 		loop.chan
 #define channel_index	loop.i
 #define FOR_EACH_CHANNEL(d) 								\
-	for (channel_it_t loop = {0, &d->comm_channels[0]};		\
-					loop.i < d->channel_cnt;				\
-					loop.i++,								\
-					loop.chan = &d->comm_channels[loop.i])
+	for (channel_it_t loop = {0, NULL};						\
+					loop.i < d->channel_cnt &&				\
+					(loop.chan = get_channel(d, loop.i));	\
+					loop.i++)
+
+// Channels are allocated in chunks of KUP_CHUNK_CHANNELS, so that the
+// channel count of a device can change without moving the channels in use.
+#define KUP_CHUNK_SHIFT		6
+#define KUP_CHUNK_CHANNELS	(1 << KUP_CHUNK_SHIFT)
+#define KUP_MAX_CHUNKS		(KUP_MAX_CHANNELS / KUP_CHUNK_CHANNELS)
+// Size of the statistics of a chunk of channels. Those of chunk k start at
+// offset k * KUP_CHUNK_STATS_BYTES of the statistics object of the device.
+#define KUP_CHUNK_STATS_BYTES	\
+		round_page(KUP_CHUNK_CHANNELS * sizeof(struct kup_chan_stats))
+
+// Number of rounds kupdev_send_any() polls the channels for one that is our
+// turn before it starts sleeping between rounds.
+#define KUP_ANY_SPIN		1024
 
 typedef enum {
 		CMD_ACTIVE,
@@ -128,24 +347,84 @@ typedef enum {
 static MALLOC_DEFINE(M_STUBDEV, "kup_dev",
 		     "character device for kern-user proxy");
 
+// Each KUP device adds a node named after it under this one.
+static SYSCTL_NODE(_dev, OID_AUTO, kup, CTLFLAG_RD | CTLFLAG_MPSAFE, 0,
+		"KUP devices");
+
 typedef struct kupdev_softc {
 	struct cdev*		cdev;
+	// Number of usable channels. Changed with the list lock held, and read
+	// without it by the data path, see valid_channel().
 	size_t				channel_cnt;
-	// The size of each communication channel in count of pages.
+	// Number of allocated chunks of channels. Chunks are only freed with the
+	// device, as the data path may still look up a channel retired by
+	// kupdev_resize(), see shrink_channels().
+	size_t				chunk_cnt;
+	// Serializes changes to the channel count, see kupdev_resize().
+	struct sx			resize_lock;
+	// Charged for the memory of the channels.
+	struct ucred*		cred;
+	// Shared while channels are given memory, so that kupdev_set_lazy() can
+	// tell that none has been.
+	struct sx			mem_lock;
+	// The size of each communication channel in count of pages, in the
+	// kernel to user space direction and the other way round. An 'rsize' of
+	// 0 leaves KUP_SMALL_RETURN_SIZE bytes for the latter.
 	size_t				size;
+	size_t				rsize;
+	// Set by kupdev_set_lazy(). Only the control pages of the channels of a
+	// lazy device are wired, and their data pages are populated on first
+	// touch, and reclaimed once a channel has been idle for 'idle_ticks'.
+	int					lazy;
+	int					idle_ticks;
+	struct timeout_task	reclaim_task;
+	// Messages of at least this many bytes are copied with non-temporal
+	// stores, see copy_to_channel().
+	size_t				copy_threshold;
+	// Preferred NUMA domain declared by the kernel side, or KUP_DOMAIN_ANY.
+	int					domain;
 	struct cv			condvar;
 	struct mtx			lock;
+	// Protects the free and pending lists below, and the transitions of
+	// channels out of CHAN_PENDING. Acquired after channel locks.
+	struct mtx			list_lock;
+	// Channels no daemon is attached to.
+	struct channel_list	free_list;
+	size_t				free_cnt;
+	// Number of channels a daemon is attached to.
+	size_t				attached_cnt;
+	// Channels a daemon has attached to, that have not yet been taken up by
+	// kupdev_wait_channel(). 'condvar' is signalled when one is added.
+	struct channel_list	pending_list;
+	// Threads blocked in kupdev_wait_channel(), which kupdev_disable() lets
+	// out.
+	int					waiters;
+	// Indexes of the channels that have been taken up, in ascending order,
+	// and the room allocated for them. See kupdev_send_flow().
+	int*				ready;
+	size_t				ready_cnt;
+	size_t				ready_max;
+	// Where kupdev_send_any() starts looking in 'ready'.
+	size_t				any_next;
 	struct selinfo		rsel;
 	struct selinfo		wsel;
 	volatile int		disabled;
-	struct proc			monitor_proc;
+	// The channel each CPU feeds through kupdev_send_local(), or -1.
+	// Changed with the resize lock held.
+	volatile int		cpu_channel[MAXCPU];
 	// Communications channels in this device. There should be at least one.
-	comm_channel_t	comm_channels[0];
-	eventhandler_tag	monitor_cookie;
+	comm_channel_t*		chunks[KUP_MAX_CHUNKS];
+	// Backs the statistics of the channels, see struct kup_chan_stats, and
+	// the kernel mapping of those of each chunk of channels.
+	vm_object_t			stats_obj;
+	struct kup_chan_stats*	stats[KUP_MAX_CHUNKS];
+	// The dev.kup.<name> sysctl node of the device.
+	struct sysctl_ctx_list	sysctl_ctx;
 } kup_softc_t;
 
 static int	kupdev_kqevent(struct knote*, long);
 static void	kupdev_kqdetach(struct knote*);
+static void	release_channel(struct kupdev_softc*, comm_channel_t*);
 
 static struct filterops kupdev_filterops = {
 	.f_isfd =	1,
@@ -153,18 +432,23 @@ static struct filterops kupdev_filterops = {
 	.f_event =	kupdev_kqevent,
 };
 
-inline static void lock_channel_by_id(kup_softc_t* sc, size_t chan_id);
 inline static void lock_channel(comm_channel_t* chan);
-inline static void unlock_channel_by_id(kup_softc_t* sc, size_t chan_id);
 inline static void unlock_channel(comm_channel_t* chan);
 
 // A dummy wait channel used by various thread in KUP devices;
 static int kup_wait_chan;
 
-static void
-kup_freeup(void *mem)
+/**
+ *	Returns whether 'chan_id' is the index of a channel of 'sc'. Pairs with
+ *	the release of the channel count by grow_channels(), so that the chunk of
+ *	the channel is seen too. The channel may be retired right after, but its
+ *	chunk stays.
+ */
+static int
+valid_channel(kup_softc_t* sc, int chan_id)
 {
-	vm_object_deallocate((vm_object_t)mem);
+	return (chan_id >= 0 && (size_t)chan_id <
+			atomic_load_acq_long((volatile u_long*)&sc->channel_cnt));
 }
 
 /**
@@ -173,7 +457,8 @@ kup_freeup(void *mem)
 static comm_channel_t*
 get_channel(kup_softc_t* sc, int chan_id)
 {
-	return &sc->comm_channels[chan_id];
+	return &sc->chunks[chan_id >> KUP_CHUNK_SHIFT]
+			[chan_id & (KUP_CHUNK_CHANNELS - 1)];
 }
 
 /**
@@ -198,64 +483,99 @@ lock_channel(comm_channel_t* chan)
 
 inline
 static void
-lock_channel_by_id(kup_softc_t* sc, size_t chan_id)
+unlock_channel(comm_channel_t* chan)
 {
-	comm_channel_t* chan = get_channel(sc, chan_id);
-	// XXX do we have a race condition here?
-	lock_channel(chan);
+	mtx_unlock(&chan->lock);
 }
 
 inline
 static void
-unlock_channel(comm_channel_t* chan)
+lock_kupdev(kup_softc_t* sc)
 {
-	mtx_unlock(&chan->lock);
+	mtx_lock(&sc->lock);
 }
 
-/**
- *
- */
 inline
 static void
-unlock_channel_by_id(kup_softc_t* sc, size_t chan_id)
+unlock_kupdev(kup_softc_t* sc)
 {
-	comm_channel_t* chan = get_channel(sc, chan_id);
-	unlock_channel(chan);
+	mtx_unlock(&sc->lock);
 }
 
 inline
 static void
-lock_kupdev(kup_softc_t* sc)
+lock_lists(kup_softc_t* sc)
 {
-	mtx_lock(&sc->lock);
+	mtx_lock(&sc->list_lock);
 }
 
 inline
 static void
-unlock_kupdev(kup_softc_t* sc)
+unlock_lists(kup_softc_t* sc)
 {
-	mtx_unlock(&sc->lock);
+	mtx_unlock(&sc->list_lock);
 }
 
 inline
 static int*
 get_channel_turn(comm_channel_t* chan)
 {
-	return (int*)(chan->mem);
+	return (int*)(chan->kva);
 }
 
 /**
  *	Sets the turn status of channel 'chan' to 'turn_id'. See enum
- *
- *	Assumes the channel is already locked by the current thread.
+ *	Everything written to the channel before is visible to the side that
+ *	sees the new turn.
  */
 static void
 set_turn(comm_channel_t* chan, turn_t turn_id)
 {
-	// The first 8 bytes in each channel is used as the 'turn' indicator
-	volatile int* turn = get_channel_turn(chan);
-	*turn = turn_id;
-	unlock_channel(chan);
+	// The first 4 bytes in each channel are used as the 'turn' indicator
+	atomic_store_rel_int((volatile u_int*)get_channel_turn(chan), turn_id);
+}
+
+/**
+ *	Enters the data path of channel 'chan_id' of 'sc'. Until the matching
+ *	leave_channel() the memory of the channel stays mapped, even if the
+ *	daemon detaches in the meantime.
+ *
+ *	Returns NULL if no daemon is attached to the channel or it has not been
+ *	taken up by kupdev_wait_channel() yet.
+ */
+static comm_channel_t*
+enter_channel(kup_softc_t* sc, int chan_id)
+{
+	comm_channel_t* chan = get_channel(sc, chan_id);
+
+	atomic_add_int(&chan->users, 1);
+	// Pairs with the fence in drain_channel(): either it sees us, or we see
+	// that the channel has been detached.
+	atomic_thread_fence_seq_cst();
+	if (atomic_load_acq_int((volatile u_int*)&chan->status) != CHAN_READY) {
+		atomic_subtract_rel_int(&chan->users, 1);
+		return (NULL);
+	}
+	chan->last_used = ticks;
+	return (chan);
+}
+
+static void
+leave_channel(comm_channel_t* chan)
+{
+	atomic_subtract_rel_int(&chan->users, 1);
+}
+
+/**
+ *	Waits until no thread is left in the data path of channel 'chan', which
+ *	no daemon is attached to anymore.
+ */
+static void
+drain_channel(comm_channel_t* chan)
+{
+	atomic_thread_fence_seq_cst();
+	while (atomic_load_acq_int(&chan->users) != 0)
+		pause("kupdrain", 1);
 }
 
 /*
@@ -264,47 +584,62 @@ set_turn(comm_channel_t* chan, turn_t turn_id)
  * The new communication channel objet is returned in locked state.
  */
 static void
-init_comm_channel(comm_channel_t* chan)
+init_comm_channel(comm_channel_t* chan, size_t index)
 {
 	mtx_init(&chan->lock, "comm_channel", NULL, MTX_DEF);
+	sx_init(&chan->io_lock, "kup_io");
 	chan->status = 0;
 	chan->mem = (vm_offset_t) NULL;
+	chan->owner = NULL;
 	chan->pid = -1;
+	chan->domain = KUP_DOMAIN_ANY;
+	chan->cpu = KUP_CPU_NONE;
+	chan->index = index;
 }
 
 /**
- * Verifies that a process with pid `pid` is running.
+ * Adds 'chan', just taken up, to the ready channels of 'sc', keeping them
+ * in index order so that the flows hashed onto them do not depend on the
+ * order the channels were taken up in.
  *
- * Returns 1 if such a process exists, 0 otherwise.
+ * Assumes the list lock is held.
  */
-static int
-process_exists(pid_t pid)
-{
-	struct proc *p;
-	int found = 0;
-	sx_slock(&allproc_lock);
-	LIST_FOREACH(p, PIDHASH(pid), p_hash) {
-		PROC_LOCK(p);
-		if (!p->p_vmspace || (p->p_flag & P_WEXIT)) {
-			PROC_UNLOCK(p);
-			continue;
-		}
-		if (p->p_pid == pid && p->p_state != PRS_NEW) {
-			found = 1;
-			PROC_UNLOCK(p);
-			break;
-		}
-		PROC_UNLOCK(p);
+static void
+add_ready(kup_softc_t* sc, comm_channel_t* chan)
+{
+	size_t i = sc->ready_cnt;
+
+	while (i > 0 && sc->ready[i - 1] > (int)chan->index) {
+		sc->ready[i] = sc->ready[i - 1];
+		i--;
 	}
-	sx_sunlock(&allproc_lock);
-	return (found);
+	sc->ready[i] = chan->index;
+	sc->ready_cnt++;
+}
+
+/**
+ * Removes 'chan' from the ready channels of 'sc'.
+ *
+ * Assumes the list lock is held.
+ */
+static void
+remove_ready(kup_softc_t* sc, comm_channel_t* chan)
+{
+	size_t i = 0;
+
+	while (i < sc->ready_cnt && sc->ready[i] != (int)chan->index)
+		i++;
+	if (i == sc->ready_cnt)
+		return;
+	sc->ready_cnt--;
+	memmove(&sc->ready[i], &sc->ready[i + 1],
+			(sc->ready_cnt - i) * sizeof(sc->ready[0]));
 }
 
 /**
- * This method blocks on a kup software context 'sc', until it finds a free
- * and usable channel that has been mapped to a memory segment via a
- * userspace daemon. This method polls the set of defined channels in the
- * context 10 times per second until it is done.
+ * This method blocks on a kup software context 'sc', until a userspace
+ * daemon has mapped a memory segment to one of its channels, and takes
+ * that channel up. Channels are taken up in the order they were attached.
  *
  * Returns the channel index of the selected channel in 'sc'.
  */
@@ -312,45 +647,34 @@ KUP_API
 int
 kupdev_wait_channel(kup_softc_t* sc)
 {
+	comm_channel_t* chan;
+
 	if (!sc)
 		return -2;
 
-	lock_kupdev(sc);
+	lock_lists(sc);
+	sc->waiters++;
 	while (!sc->disabled) {
-		FOR_EACH_CHANNEL(sc) {
-			lock_channel(channel);
-			if (channel->mem && channel->status == CHAN_PENDING) {
-				DEBUG_PRINT("%s: New channel (id: %lu) attached.\n",
-								__FUNCTION__, channel_index);
-				channel->status = CHAN_READY;
-				unlock_channel(channel);
-				unlock_kupdev(sc);
-				return channel_index;
-			}
-			unlock_channel(channel);
+		chan = TAILQ_FIRST(&sc->pending_list);
+		if (chan != NULL) {
+			TAILQ_REMOVE(&sc->pending_list, chan, link);
+			atomic_store_rel_int((volatile u_int*)&chan->status, CHAN_READY);
+			add_ready(sc, chan);
+			sc->waiters--;
+			unlock_lists(sc);
+			DEBUG_PRINT("%s: New channel (id: %lu) attached.\n",
+							__FUNCTION__, chan->index);
+			return chan->index;
 		}
-		cv_wait(&sc->condvar, &sc->lock);
+		cv_wait(&sc->condvar, &sc->list_lock);
 	}
-	unlock_kupdev(sc);
+	// kupdev_disable() is waiting for the last of us to leave.
+	if (--sc->waiters == 0)
+		cv_broadcast(&sc->condvar);
+	unlock_lists(sc);
 	return -1;
 }
 
-/**
- *	Passes the turn on channel index 'chan_id' of software context 'sc' to the
- *  user space daemon.
- *
- *  Assumes the channel is already locked by this thread, and it will unlocked
- *  it before returning.
- */
-inline
-static void
-pass_turn(kup_softc_t* sc, int chan_id)
-{
-	comm_channel_t* chan = get_channel(sc, chan_id);
-	// This will unlock the channel
-	set_turn(chan, DAEMON);
-}
-
 /**
  * This method passes the turn to the user space daemon by queueing a NULL
  * message.
@@ -362,43 +686,140 @@ kupdev_pass(kup_softc_t* sc, int chan_id)
 }
 
 /**
- *	This method blocks until the user space daemon corresponding to channel
- *	'chan_id' of kup software context 'sc' passes the turn to kernel. This
- *	method check the status of the channel in a polling mode for a short
- *	period and then gives up the processor and checks the channel status
- *	10 times per second.
+ *	This method blocks until the user space daemon on channel 'chan' of kup
+ *	software context 'sc' passes the turn to kernel. This method check the
+ *	status of the channel in a polling mode for a short period and then
+ *	gives up the processor and checks the channel status 10 times per second.
+ *	The time spent waiting is added to the statistics of the channel, where a
+ *	wait that does not end shows too. The clock is only read when the turn
+ *	is not ours right away.
  *
- *	Assumes that the channel is already locked.
+ *	Assumes that we are in the data path of the channel, see enter_channel().
  */
 inline static int
-wait_for_turn(kup_softc_t* sc, int chan_id)
+wait_for_turn(kup_softc_t* sc, comm_channel_t* chan)
 {
-	comm_channel_t* chan = get_channel(sc, chan_id);
-	volatile int* turn = get_channel_turn(chan);
-	int cnt = 0;
-	while (*turn == DAEMON && !sc->disabled) {
+	volatile u_int* turn = (volatile u_int*)get_channel_turn(chan);
+	sbintime_t start = 0, slept = 0, t;
+	int cnt = 0, sleeps = 0;
+	while (atomic_load_acq_int(turn) == DAEMON &&
+			chan->status == CHAN_READY && !sc->disabled) {
+		if (start == 0) {
+			start = sbinuptime();
+			chan->stats->ks_wait_start = sbttons(start);
+		}
 		if (cnt < 2000000) {
 			cnt++;
 			cpu_spinwait();
 		} else {
-			unlock_channel(chan);
-			DEBUG_PRINT("turn == %d\n", *turn);
+			t = sbinuptime();
 			tsleep(&kup_wait_chan, 0, "waiting for channel to ready",
 					100 * hz / 1000);
-			DEBUG_PRINT("before lock chanel\n");
-			lock_channel(chan);
-			DEBUG_PRINT("after lock chanel\n");
-			if (chan->status != CHAN_READY) {
-				DEBUG_PRINT("breaking\n");
-				break;
-			}
-			DEBUG_PRINT("before get turn\n");
-			turn = get_channel_turn(chan);
-			DEBUG_PRINT("after get turn\n");
+			slept += sbinuptime() - t;
+			sleeps++;
 		}
 	}
+	if (start != 0)
+		chan->stats->ks_wait_start = 0;
 	if (chan->status != CHAN_READY || sc->disabled)
 		return (1);
+	if (start != 0) {
+		// The turn is ours, so nobody else updates these meanwhile.
+		chan->stats->ks_spin_ns += sbttons(sbinuptime() - start - slept);
+		chan->stats->ks_sleep_ns += sbttons(slept);
+		chan->stats->ks_sleeps += sleeps;
+	}
+	return (0);
+}
+
+/**
+ *	Copies a message of 'len' bytes at 'src' into the memory of a channel of
+ *	'sc' at 'dst'. Large messages are written with non-temporal stores,
+ *	which go around the caches of the sending CPU, as only the daemon reads
+ *	them. movnti works on general purpose registers, so unlike the SIMD
+ *	streaming stores it does not require saving the FPU state.
+ */
+static void
+copy_to_channel(kup_softc_t* sc, void* dst, const void* src, size_t len)
+{
+#if defined(__amd64__)
+	uint8_t* d = dst;
+	const uint8_t* s = src;
+	uint64_t w0, w1, w2, w3;
+	size_t head;
+
+	if (len < sc->copy_threshold) {
+		memcpy(dst, src, len);
+		return;
+	}
+	head = MIN(-(uintptr_t)d & 7, len);
+	memcpy(d, s, head);
+	d += head;
+	s += head;
+	len -= head;
+	for (; len >= 32; len -= 32, d += 32, s += 32) {
+		memcpy(&w0, s, 8);
+		memcpy(&w1, s + 8, 8);
+		memcpy(&w2, s + 16, 8);
+		memcpy(&w3, s + 24, 8);
+		__asm __volatile("movnti %1, %0" : "=m" (*(uint64_t*)d) : "r" (w0));
+		__asm __volatile("movnti %1, %0" : "=m" (*(uint64_t*)(d + 8))
+				: "r" (w1));
+		__asm __volatile("movnti %1, %0" : "=m" (*(uint64_t*)(d + 16))
+				: "r" (w2));
+		__asm __volatile("movnti %1, %0" : "=m" (*(uint64_t*)(d + 24))
+				: "r" (w3));
+	}
+	// Orders the streaming stores before the store of the turn.
+	sfence();
+	memcpy(d, s, len);
+#else
+	memcpy(dst, src, len);
+#endif
+}
+
+/**
+ *	Sends a message on channel 'chan_id' of 'sc', for kupdev_send() and
+ *	friends. Only one kernel thread at a time may wait for the turn of a
+ *	channel and fill it in, or two of them could see the turn at once, so
+ *	this assumes the I/O lock of the channel is held.
+ */
+static int
+channel_send(kup_softc_t* sc, void *data, size_t len, int chan_id)
+{
+	int error;
+	sx_assert(&get_channel(sc, chan_id)->io_lock, SA_XLOCKED);
+	// Longer messages would run over the reply area into the next channel,
+	// or be taken for an inline one.
+	if (len > sc->size * PAGE_SIZE || len >= KUP_LEN_INLINE)
+		return (-1);
+	comm_channel_t* chan = enter_channel(sc, chan_id);
+	if (chan == NULL)
+		return (-1);
+	if (chan->leased) {
+		// Passing the turn would let the daemon overwrite the leased data.
+		leave_channel(chan);
+		return (-3);
+	}
+	error = wait_for_turn(sc, chan);
+	if (error) {
+		// Something has gone wrong, probably the KUP device is being closed
+		// and no longer can be used.
+		leave_channel(chan);
+		return (-2);
+	}
+	if (len <= KUP_INLINE_SIZE) {
+		// 'data' may be the message just received inline.
+		memmove(INLINE_OFFSET(chan->kva), data, len);
+		*LEN_OFFSET(chan->kva) = len | KUP_LEN_INLINE;
+	} else {
+		copy_to_channel(sc, DATA_SEND_OFFSET(sc, chan_id), data, len);
+		*LEN_OFFSET(chan->kva) = len;
+	}
+	chan->stats->ks_msgs_out++;
+	chan->stats->ks_bytes_out += len;
+	set_turn(chan, DAEMON);
+	leave_channel(chan);
 	return (0);
 }
 
@@ -406,72 +827,336 @@ wait_for_turn(kup_softc_t* sc, int chan_id)
  *	Send 'len' bytes from buffer pointed to by 'data' over channel 'chan_id'
  *	of kup software context sc.
  *	This method automatically blocks and waits until turn is passed to kernel
- *	before starting a transaction.
+ *	before starting a transaction. Kernel threads sending or receiving on
+ *	the same channel wait for each other.
+ *
+ *	Returns 0 on success, -1 if there is no such channel, it is not ready, or
+ *	'len' is more than the 'size' pages of the channels of 'sc', -2 if the
+ *	device is going away, and -3 while the data received on the channel is
+ *	leased.
  */
 KUP_API
 int
 kupdev_send(kup_softc_t* sc, void *data, size_t len, int chan_id)
 {
+	comm_channel_t* chan;
 	int error;
-	KASSERT(chan_id < sc->channel_cnt,
-			("kup device received 'send' request for a "
-			"non-existent channel: %d", chan_id));
-	comm_channel_t* chan = get_channel_locked(sc, chan_id);
-	if (chan->status != CHAN_READY) {
-		unlock_channel(chan);
+
+	if (!valid_channel(sc, chan_id) || len > sc->size * PAGE_SIZE)
 		return (-1);
+	chan = get_channel(sc, chan_id);
+	sx_xlock(&chan->io_lock);
+	error = channel_send(sc, data, len, chan_id);
+	sx_xunlock(&chan->io_lock);
+	return (error);
+}
+
+/**
+ *	Same as kupdev_send(), on the channel bound to the CPU we are running on
+ *	with kupdev_bind_cpu(). The thread is not pinned, so it may be moved to
+ *	another CPU meanwhile, which only costs locality. Other threads calling
+ *	kupdev_send_local() on the same CPU are kept off the channel while the
+ *	message is in flight.
+ *
+ *	Returns the same as kupdev_send(), -4 if no channel is bound to the
+ *	current CPU, and -5 if another thread is sending or receiving on it.
+ */
+KUP_API
+int
+kupdev_send_local(kup_softc_t* sc, void *data, size_t len)
+{
+	comm_channel_t* chan;
+	int chan_id, error;
+
+	chan_id = atomic_load_acq_int((volatile u_int*)
+			&sc->cpu_channel[PCPU_GET(cpuid)]);
+	if (chan_id < 0)
+		return (-4);
+	// The channel may have been retired since, but its chunk is still there,
+	// and kupdev_send() finds it is not ready.
+	chan = get_channel(sc, chan_id);
+	if (!sx_try_xlock(&chan->io_lock))
+		return (-5);
+	error = channel_send(sc, data, len, chan_id);
+	sx_xunlock(&chan->io_lock);
+	return (error);
+}
+
+/**
+ *	Maps 'key' to one of 'buckets' buckets, moving only the keys that have to
+ *	move when the number of buckets changes. This is the jump consistent hash
+ *	of Lamping and Veach, done in integer arithmetic.
+ */
+static int
+jump_hash(uint64_t key, int buckets)
+{
+	int64_t b = -1, j = 0;
+
+	while (j < buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((int64_t)1 << 31) / (int64_t)((key >> 33) + 1);
 	}
-	error = wait_for_turn(sc, chan_id);
-	if (error) {
-		// Something has gone wrong, probably the KUP device is being closed
-		// and no longer can be used.
-		unlock_channel(chan);
-		return (-2);
+	return (b);
+}
+
+/**
+ *	Same as kupdev_send(), on a channel picked by hashing 'flow_key', so that
+ *	the messages of a flow go to one channel, in order, and the flows are
+ *	spread over the daemon threads. The flow is hashed over all channels of
+ *	the device first, and kept there while that channel is taken up. Only
+ *	the flows of channels that are not are hashed over the ready ones, so
+ *	a daemon attaching or detaching moves as few flows as possible. A flow
+ *	that moves may overtake its messages still queued on the old channel.
+ *	Threads using the same channel wait for each other.
+ *
+ *	Returns the same as kupdev_send(), and -4 if no channel has been taken
+ *	up.
+ */
+KUP_API
+int
+kupdev_send_flow(kup_softc_t* sc, uint64_t flow_key, void *data, size_t len)
+{
+	comm_channel_t* chan;
+	size_t chan_cnt;
+	int chan_id, error;
+
+	// A snapshot of the channel count. The channel it hashes to may be
+	// retired meanwhile, but its chunk stays, and it is not ready then.
+	chan_cnt = atomic_load_acq_long((volatile u_long*)&sc->channel_cnt);
+	chan_id = jump_hash(flow_key, chan_cnt);
+	chan = get_channel(sc, chan_id);
+	if (atomic_load_acq_int((volatile u_int*)&chan->status) != CHAN_READY) {
+		lock_lists(sc);
+		if (sc->ready_cnt == 0) {
+			unlock_lists(sc);
+			return (-4);
+		}
+		chan_id = sc->ready[jump_hash(flow_key, sc->ready_cnt)];
+		unlock_lists(sc);
+		chan = get_channel(sc, chan_id);
+	}
+	sx_xlock(&chan->io_lock);
+	error = channel_send(sc, data, len, chan_id);
+	sx_xunlock(&chan->io_lock);
+	return (error);
+}
+
+/**
+ *	Looks for a channel of 'sc' that has been taken up, is our turn, and is
+ *	not leased, going round robin over the ready channels.
+ *
+ *	Returns the index of the channel, -1 if none is idle, and -4 if no
+ *	channel has been taken up.
+ */
+static int
+find_idle_channel(kup_softc_t* sc)
+{
+	comm_channel_t* chan;
+	int chan_id = -4;
+	size_t k;
+
+	lock_lists(sc);
+	for (size_t i = 0; i < sc->ready_cnt; i++) {
+		k = (sc->any_next + i) % sc->ready_cnt;
+		chan = get_channel(sc, sc->ready[k]);
+		chan_id = -1;
+		// The memory of ready channels stays mapped while we hold the
+		// list lock, see release_channel().
+		if (atomic_load_acq_int((volatile u_int*)get_channel_turn(chan)) ==
+				KERNEL && !chan->leased) {
+			chan_id = sc->ready[k];
+			sc->any_next = k + 1;
+			break;
+		}
+	}
+	unlock_lists(sc);
+	return (chan_id);
+}
+
+/**
+ *	Same as kupdev_send(), on whichever ready channel is our turn, so that a
+ *	slow daemon thread does not hold up the producer while other channels
+ *	are idle. The channels are tried round robin. If none is our turn, all
+ *	of them are polled until one is, for a while and then with a short sleep
+ *	between rounds. Use it for messages that may be handled in any order,
+ *	and whose replies, if any, are not needed, as the channel may be picked
+ *	again as soon as the daemon passes the turn back.
+ *
+ *	Returns the index of the channel the message was sent on, -2 if the
+ *	device is going away, and -4 if no channel has been taken up.
+ */
+KUP_API
+int
+kupdev_send_any(kup_softc_t* sc, void *data, size_t len)
+{
+	comm_channel_t* chan;
+	int chan_id, error, rounds = 0;
+
+	for (;;) {
+		if (sc->disabled)
+			return (-2);
+		chan_id = find_idle_channel(sc);
+		if (chan_id == -4)
+			return (-4);
+		if (chan_id >= 0) {
+			chan = get_channel(sc, chan_id);
+			if (sx_try_xlock(&chan->io_lock)) {
+				error = channel_send(sc, data, len, chan_id);
+				sx_xunlock(&chan->io_lock);
+				if (error == 0)
+					return (chan_id);
+				if (error == -2)
+					return (-2);
+				// The channel was detached or leased meanwhile.
+				continue;
+			}
+		}
+		if (rounds < KUP_ANY_SPIN) {
+			rounds++;
+			cpu_spinwait();
+		} else
+			pause("kupany", 1);
 	}
-	memcpy(DATA_SEND_OFFSET(sc, chan_id), data, len);
-	pass_turn(sc, chan_id);
-	return (0);
 }
 
 /**
- * Unlock the channel chan_id on device sc. This is specifically used after
- * a kupdev_receive(...) call which returns with the channel locked.
+ * Used to unlock channel chan_id on device sc after kupdev_receive(). The
+ * data path does not lock channels anymore, so there is nothing left to do.
+ * Kept for existing callers.
  */
 KUP_API
 void
 kupdev_unlock_channel(kup_softc_t* sc, int chan_id)
 {
-	unlock_channel_by_id(sc, chan_id);
+}
+
+/**
+ *	Returns where the message the daemon has passed the turn with on channel
+ *	'chan' of 'sc' is, inline in the control page or in the data pages, and
+ *	stores its length in 'len' unless it is NULL. The length comes from the
+ *	daemon, so it is capped to the room for the message. The message is
+ *	counted in the statistics of the channel.
+ */
+static void*
+received_data(kup_softc_t* sc, comm_channel_t* chan, size_t* len)
+{
+	uint32_t word = *LEN_OFFSET(chan->kva);
+	size_t n;
+	void* data;
+
+	if (word & KUP_LEN_INLINE) {
+		n = MIN(word & ~KUP_LEN_INLINE, KUP_INLINE_SIZE);
+		data = INLINE_OFFSET(chan->kva);
+	} else {
+		n = MIN(word, sc->rsize ? sc->rsize * PAGE_SIZE :
+				KUP_SMALL_RETURN_SIZE);
+		data = DATA_RECV_OFFSET(sc, chan->index);
+	}
+	chan->stats->ks_msgs_in++;
+	chan->stats->ks_bytes_in += n;
+	if (len)
+		*len = n;
+	return (data);
 }
 
 /**
  *	Blocks on channel 'chan_id' of software context 'sc' util we get the turn
  *	and then returns a pointer to the data filled by the user space daemon.
- *	Returns with the channel locked.
+ *	The data stays there until the turn is passed back to the daemon, as long
+ *	as the daemon stays attached. Use kupdev_receive_lease() to keep it
+ *	regardless. Kernel threads sending or receiving on the same channel wait
+ *	for each other.
  */
 KUP_API
 void*
 kupdev_receive(kup_softc_t* sc, int chan_id)
 {
-	int error;
-	KASSERT(chan_id < sc->channel_cnt,
-			("kup device received 'receive' request for a "
-			"non-existent channel: %d", chan_id));
-	comm_channel_t* chan = get_channel_locked(sc, chan_id);
-	if (chan->status != CHAN_READY) {
-		unlock_channel(chan);
+	return (kupdev_receive_msg(sc, chan_id, NULL));
+}
+
+/**
+ *	Same as kupdev_receive(), and also stores the length of the message in
+ *	'len' unless it is NULL. Short messages live in the control page rather
+ *	than in the data pages, which the returned pointer accounts for.
+ */
+KUP_API
+void*
+kupdev_receive_msg(kup_softc_t* sc, int chan_id, size_t* len)
+{
+	comm_channel_t* chan;
+	void* result = NULL;
+
+	if (!valid_channel(sc, chan_id))
 		return (NULL);
+	sx_xlock(&get_channel(sc, chan_id)->io_lock);
+	chan = enter_channel(sc, chan_id);
+	if (chan != NULL) {
+		// wait_for_turn() fails if something has gone wrong, probably the
+		// KUP device is being closed and no longer can be used.
+		if (wait_for_turn(sc, chan) == 0)
+			result = received_data(sc, chan, len);
+		leave_channel(chan);
 	}
-	error = wait_for_turn(sc, chan_id);
-	if (error) {
-		// Something has gone wrong, probably the KUP device is being closed
-		// and no longer can be used.
-		unlock_channel(chan);
+	sx_xunlock(&get_channel(sc, chan_id)->io_lock);
+	return (result);
+}
+
+/**
+ *	Blocks on channel 'chan_id' of software context 'sc' until we get the
+ *	turn, and leases the data filled by the user space daemon to the caller,
+ *	storing a pointer to it in 'data'. The data can be used in place until
+ *	the lease is returned with kupdev_release(). No lock is held in between,
+ *	and the daemon may detach meanwhile, but the memory of the channel is
+ *	not reused until the lease is returned. kupdev_send() fails on the
+ *	channel while it is leased.
+ *
+ *	Returns NULL if the channel is not ready or already leased.
+ */
+KUP_API
+struct kupdev_lease*
+kupdev_receive_lease(kup_softc_t* sc, int chan_id, void** data)
+{
+	comm_channel_t* chan;
+
+	if (!valid_channel(sc, chan_id))
 		return (NULL);
+	// Senders check 'leased' with the I/O lock held, so none of them passes
+	// the turn once we have set it.
+	sx_xlock(&get_channel(sc, chan_id)->io_lock);
+	chan = enter_channel(sc, chan_id);
+	if (chan == NULL)
+		goto fail;
+	if (!atomic_cmpset_int(&chan->leased, 0, 1)) {
+		leave_channel(chan);
+		goto fail;
+	}
+	if (wait_for_turn(sc, chan)) {
+		atomic_store_rel_int(&chan->leased, 0);
+		leave_channel(chan);
+		goto fail;
 	}
-	void* result = DATA_RECV_OFFSET(sc, chan_id);
-	/* unlock_channel_by_id(sc, chan_id); */
-	return result;
+	*data = received_data(sc, chan, NULL);
+	sx_xunlock(&chan->io_lock);
+	// We stay in the data path of the channel until the lease is returned.
+	return ((struct kupdev_lease*)chan);
+
+fail:
+	sx_xunlock(&get_channel(sc, chan_id)->io_lock);
+	return (NULL);
+}
+
+/**
+ *	Returns a lease taken by kupdev_receive_lease().
+ */
+KUP_API
+void
+kupdev_release(struct kupdev_lease* lease)
+{
+	comm_channel_t* chan = (comm_channel_t*)lease;
+
+	atomic_store_rel_int(&chan->leased, 0);
+	leave_channel(chan);
 }
 
 static int
@@ -485,15 +1170,9 @@ kupdev_kqevent(struct knote *kn, long hint)
 		return (1);
 	}
 
-	int found = 0;
-	kup_softc_t* scx;
-	scx = kn->kn_hook;
-	FOR_EACH_CHANNEL(sc) {
-		if (channel->status == CHAN_PENDING)
-			found = 1;
-	}
-	kn->kn_data = 1;
-	return (found);
+	// Fire if there is a channel a daemon can attach to.
+	kn->kn_data = sc->free_cnt;
+	return (sc->free_cnt > 0);
 }
 
 static void
@@ -530,143 +1209,914 @@ kup_close(struct cdev *dev, int fflag, int devtype, struct thread *td)
 }
 
 static int
-kup_open(struct cdev *dev, int oflags, int devtype, struct thread *td)
+kup_ioctl(struct cdev *dev, u_long cmd, caddr_t data, int fflag,
+		struct thread *td)
 {
-	vm_object_t mem;
-	int error = 0;
-
-	// Do not allow read-only and write-only open()
-	if ((oflags & (FREAD | FWRITE)) != (FREAD | FWRITE))
-		return (EINVAL);
+	kup_softc_t* sc = dev->si_drv1;
+	struct kup_geometry* geo;
+	kup_file_t* file;
+	comm_channel_t* chan;
+	uint64_t count;
+	uint32_t index;
+	int error;
 
-	// A separate VM object will be used for all mmap()ings for each open()ed
-	// device instance. We will retreive this object in 'kup_mmap_single' when
-	// the user space process tries mmap() a new segment of memory.
-	mem = vm_pager_allocate(OBJT_DEFAULT, NULL, 0, VM_PROT_DEFAULT, 0,
-			curthread->td_ucred);
-	VM_OBJECT_WLOCK(mem);
-	vm_object_clear_flag(mem, OBJ_ONEMAPPING);
-	vm_object_set_flag(mem, OBJ_NOSPLIT);
-	VM_OBJECT_WUNLOCK(mem);
-	error = devfs_set_cdevpriv(mem, kup_freeup);
-	if (error)
-		vm_object_deallocate(mem);
-	return (error);
+	switch (cmd) {
+	case KUPIOC_GEOMETRY:
+		geo = (struct kup_geometry*)data;
+		geo->kg_version = KUP_ABI_VERSION;
+		geo->kg_page_size = PAGE_SIZE;
+		geo->kg_size = sc->size;
+		geo->kg_rsize = sc->rsize;
+		lock_lists(sc);
+		geo->kg_channels = sc->channel_cnt;
+		geo->kg_free = sc->free_cnt;
+		unlock_lists(sc);
+		return (0);
+	case KUPIOC_CLAIM:
+		error = devfs_get_cdevpriv((void **)&file);
+		if (error)
+			return (error);
+		count = 0;
+		// All channels of the file change hands at once.
+		lock_lists(sc);
+		TAILQ_FOREACH(chan, &file->channels, owner_link) {
+			chan->pid = td->td_proc->p_pid;
+			chan->stats->ks_pid = chan->pid;
+			count++;
+		}
+		unlock_lists(sc);
+		*(uint64_t*)data = count;
+		return (0);
+	case KUPIOC_DETACH:
+		error = devfs_get_cdevpriv((void **)&file);
+		if (error)
+			return (error);
+		index = *(uint32_t*)data;
+		// Keeps the channel from being retired meanwhile.
+		sx_slock(&sc->resize_lock);
+		if (index >= sc->channel_cnt) {
+			sx_sunlock(&sc->resize_lock);
+			return (EINVAL);
+		}
+		chan = get_channel_locked(sc, index);
+		if (chan->owner != file)
+			error = EINVAL;
+		else
+			release_channel(sc, chan);
+		unlock_channel(chan);
+		sx_sunlock(&sc->resize_lock);
+		// Let pending daemons know that the channel can be taken up.
+		if (error == 0)
+			KNOTE_UNLOCKED(&sc->rsel.si_note, 0);
+		return (error);
+	default:
+		return (ENOTTY);
+	}
 }
 
 /**
- * Determine if channel 'chan' is free to be assigned to a new process.
+ * Destructor of the per open() state of a KUP device. Called when the last
+ * reference to the file is dropped, which is when the owning daemon closes
+ * it or exits, or when the device is destroyed. Releases the channels
+ * attached through the file, so that they can be taken up by another
+ * daemon. This costs nothing to processes that are not KUP daemons.
  */
-static int
-channel_is_free(comm_channel_t* chan)
+static void
+kup_file_release(void *data)
 {
-	return (chan->status == CHAN_PENDING &&
-					chan->mem == (vm_offset_t) NULL);
+	kup_file_t* file = data;
+	kup_softc_t* sc = file->sc;
+	comm_channel_t* chan;
+	int released = 0;
+
+	for (;;) {
+		lock_lists(sc);
+		chan = TAILQ_FIRST(&file->channels);
+		unlock_lists(sc);
+		if (chan == NULL)
+			break;
+		lock_channel(chan);
+		// The channel may have been released by someone else while it was
+		// unlocked, which also removes it from our list.
+		if (chan->owner == file) {
+			DEBUG_PRINT("%s: Releasing channel %lu of pid %d.\n",
+					__FUNCTION__, chan->index, chan->pid);
+			release_channel(sc, chan);
+			released = 1;
+		}
+		unlock_channel(chan);
+	}
+	// Inform any pending user space daemons that a new channel is available
+	// to be taken up.
+	if (released)
+		KNOTE_UNLOCKED(&sc->rsel.si_note, 0);
+	free(file, M_STUBDEV);
 }
 
 static int
-channel_is_active(comm_channel_t* chan)
+kup_open(struct cdev *dev, int oflags, int devtype, struct thread *td)
 {
-	return (chan->mem && chan->status != CHAN_PENDING);
+	kup_file_t* file;
+	int error = 0;
+
+	// Do not allow write-only open(). Daemons need both, read-only is for
+	// reading the statistics, see map_stats().
+	if ((oflags & FREAD) == 0)
+		return (EINVAL);
+
+	file = malloc(sizeof(*file), M_STUBDEV, M_WAITOK | M_ZERO);
+	file->sc = dev->si_drv1;
+	file->readonly = (oflags & FWRITE) == 0;
+	TAILQ_INIT(&file->channels);
+	error = devfs_set_cdevpriv(file, kup_file_release);
+	if (error)
+		free(file, M_STUBDEV);
+	return (error);
 }
 
 /**
- * Try to assign a newly mapped memory segment to a free channel in sc.
- * This function assumes that the KUP device is already locked.
+ * Takes a free channel of 'sc' off the free list, to attach a new daemon to
+ * it. The channel is on neither list until it is passed to attach_channel()
+ * or unreserve_channels().
  *
- * Returns 0 on success and returns 1 if there are currently no free channels
- * in 'sc'.
+ * Returns NULL if there are currently no free channels in 'sc'.
+ */
+static comm_channel_t*
+reserve_channel(kup_softc_t* sc)
+{
+	comm_channel_t* chan;
+
+	lock_lists(sc);
+	chan = TAILQ_FIRST(&sc->free_list);
+	if (chan != NULL) {
+		TAILQ_REMOVE(&sc->free_list, chan, link);
+		chan->free = 0;
+		sc->free_cnt--;
+	}
+	unlock_lists(sc);
+	return (chan);
+}
+
+/**
+ * Same as reserve_channel(), but takes the 'count' channels of 'sc' starting
+ * at index 'first', or none of them.
+ *
+ * Returns 0 on success, or EBUSY if any of those channels is not free.
+ */
+static int
+reserve_channels(kup_softc_t* sc, size_t first, size_t count)
+{
+	size_t i;
+
+	lock_lists(sc);
+	// The channel count may have shrunk since the caller checked it.
+	if (first + count > sc->channel_cnt)
+		goto busy;
+	for (i = first; i < first + count; i++)
+		if (!get_channel(sc, i)->free)
+			goto busy;
+	for (i = first; i < first + count; i++) {
+		comm_channel_t* chan = get_channel(sc, i);
+		TAILQ_REMOVE(&sc->free_list, chan, link);
+		chan->free = 0;
+		sc->free_cnt--;
+	}
+	unlock_lists(sc);
+	return (0);
+
+busy:
+	unlock_lists(sc);
+	return (EBUSY);
+}
+
+/**
+ * Returns a channel taken by reserve_channel() to the free list.
+ * Assumes the lists of 'sc' are locked.
+ */
+static void
+unreserve_channel_locked(kup_softc_t* sc, comm_channel_t* chan)
+{
+	TAILQ_INSERT_HEAD(&sc->free_list, chan, link);
+	chan->free = 1;
+	sc->free_cnt++;
+}
+
+/**
+ * Returns the 'count' channels starting at index 'first' reserved by
+ * reserve_channels() to the free list.
+ */
+static void
+unreserve_channels(kup_softc_t* sc, size_t first, size_t count)
+{
+	lock_lists(sc);
+	for (size_t i = first + count; i > first; i--)
+		unreserve_channel_locked(sc, get_channel(sc, i - 1));
+	unlock_lists(sc);
+}
+
+/**
+ * Assigns a newly mapped memory segment to channel 'chan' reserved by
+ * reserve_channel(), and queues the channel to be taken up by a kernel
+ * thread blocked in kupdev_wait_channel().
+ *
+ * Returns 0 on success. If 'sc' has been disabled in the meantime, the
+ * channel is returned to the free list and EOPNOTSUPP is returned.
  */
 static int
-assign_to_channel(kup_softc_t* sc, vm_offset_t mem)
+attach_channel(kup_softc_t* sc, kup_file_t* file, comm_channel_t* chan,
+		vm_offset_t mem, int domain)
 {
 	DEBUG_PRINT("%s: Assigning mem: %x\n",
 			__FUNCTION__, (unsigned int)mem);
-	int assigned = 0;
-	FOR_EACH_CHANNEL(sc) {
-		lock_channel(channel);
-		if (channel_is_free(channel)) {
-				channel->mem = mem;
-				channel->pid = curproc->p_pid;
-				*CMD_OFFSET(channel->mem) = CMD_ACTIVE;
-				set_turn(channel, KERNEL);
-				// Allow a kernel thread blocked in 'wait_comm_channel' to
-				// take up this channel.
-				cv_signal(&sc->condvar);
-				assigned = 1;
-				break;
-		} else
-			unlock_channel(channel);
+	lock_channel(chan);
+	lock_lists(sc);
+	if (sc->disabled) {
+		unreserve_channel_locked(sc, chan);
+		unlock_lists(sc);
+		unlock_channel(chan);
+		return (EOPNOTSUPP);
+	}
+	chan->mem = mem;
+	chan->owner = file;
+	chan->pid = curproc->p_pid;
+	chan->domain = domain;
+	*CMD_OFFSET(chan->mem) = CMD_ACTIVE;
+	*DOMAIN_OFFSET(chan->mem) = domain;
+	*CPU_OFFSET(chan->mem) = chan->cpu;
+	*INDEX_OFFSET(chan->mem) = chan->index;
+	*get_channel_turn(chan) = KERNEL;
+	chan->last_used = ticks;
+	chan->stats->ks_attaches++;
+	chan->stats->ks_pid = chan->pid;
+	TAILQ_INSERT_TAIL(&sc->pending_list, chan, link);
+	TAILQ_INSERT_TAIL(&file->channels, chan, owner_link);
+	sc->attached_cnt++;
+	cv_signal(&sc->condvar);
+	unlock_lists(sc);
+	unlock_channel(chan);
+	return (0);
+}
+
+/**
+ * Detaches the daemon from channel 'chan', whether or not the channel has
+ * been taken up by the kernel side yet, and puts it back on the free list.
+ *
+ * Assumes the channel is locked and attached.
+ */
+static void
+release_channel(kup_softc_t* sc, comm_channel_t* chan)
+{
+	lock_lists(sc);
+	if (chan->status == CHAN_PENDING)
+		TAILQ_REMOVE(&sc->pending_list, chan, link);
+	else
+		remove_ready(sc, chan);
+	TAILQ_REMOVE(&chan->owner->channels, chan, owner_link);
+	sc->attached_cnt--;
+	chan->status = CHAN_PENDING;
+	chan->mem = 0;
+	chan->owner = NULL;
+	chan->pid = -1;
+	chan->last_used = ticks;
+	chan->stats->ks_detaches++;
+	chan->stats->ks_pid = 0;
+	unreserve_channel_locked(sc, chan);
+	unlock_lists(sc);
+}
+
+/**
+ * Selects the NUMA domain to allocate the memory of a new channel from.
+ * An explicit request from the attaching daemon takes precedence over the
+ * domain declared by the kernel side in kupdev_create_domain(), and if
+ * neither is given the domain of the CPU running the attaching thread
+ * is used.
+ */
+static int
+select_domain(kup_softc_t* sc, int requested)
+{
+	if (requested != KUP_DOMAIN_ANY)
+		return (requested);
+	if (sc->domain != KUP_DOMAIN_ANY)
+		return (sc->domain);
+	return (PCPU_GET(domain));
+}
+
+/**
+ * Releases the memory of channel 'chan', both its kernel mapping and its
+ * pages, and frees its segment once no other channel uses it. No daemon may
+ * be attached to the channel. A daemon that has kept the memory mapped after
+ * detaching finds fresh pages in its place.
+ */
+static void
+cool_channel(kup_softc_t* sc, comm_channel_t* chan)
+{
+	kup_segment_t* seg = chan->seg;
+	vm_pindex_t start = OFF_TO_IDX(chan->seg_off);
+
+	if (seg == NULL)
+		return;
+	drain_channel(chan);
+	vm_map_remove(kernel_map, chan->kva, chan->kva + CHAN_BYTES(sc));
+	chan->kva = 0;
+	chan->seg = NULL;
+	VM_OBJECT_WLOCK(seg->obj);
+	vm_object_page_remove(seg->obj, start,
+			start + OFF_TO_IDX(CHAN_BYTES(sc)), 0);
+	VM_OBJECT_WUNLOCK(seg->obj);
+	if (refcount_release(&seg->users)) {
+		vm_object_deallocate(seg->obj);
+		free(seg, M_STUBDEV);
+	}
+}
+
+/**
+ * Frees the data pages of channel 'chan' of lazy device 'sc', leaving its
+ * control page alone. They are refilled with zeroes on the next touch.
+ * No daemon may be attached to the channel.
+ */
+static void
+discard_data_pages(kup_softc_t* sc, comm_channel_t* chan)
+{
+	vm_pindex_t start = OFF_TO_IDX(chan->seg_off);
+
+	VM_OBJECT_WLOCK(chan->seg->obj);
+	vm_object_page_remove(chan->seg->obj, start + 1,
+			start + OFF_TO_IDX(CHAN_BYTES(sc)), 0);
+	VM_OBJECT_WUNLOCK(chan->seg->obj);
+}
+
+/**
+ * Returns whether anything but the kernel still references the object of
+ * segment 'seg', which is a user space mapping that a daemon has kept after
+ * detaching, or has passed on to a child. The kernel holds a reference for
+ * the segment, and one for each entry of its kernel mapping, of which there
+ * are more once parts of it are wired or unmapped. Nobody can map the
+ * channels of the caller meanwhile, as they are reserved, and references
+ * dropped meanwhile only make the answer err on the safe side.
+ */
+static int
+segment_mapped(kup_segment_t* seg)
+{
+	vm_map_entry_t entry;
+	u_int refs = 1;
+
+	vm_map_lock_read(kernel_map);
+	if (!vm_map_lookup_entry(kernel_map, seg->kva, &entry))
+		entry = vm_map_entry_succ(entry);
+	for (; entry->start < seg->kva + seg->size;
+			entry = vm_map_entry_succ(entry))
+		if (entry->object.vm_object == seg->obj)
+			refs++;
+	vm_map_unlock_read(kernel_map);
+	return (seg->obj->ref_count > refs);
+}
+
+/**
+ * Allocates a segment of memory for 'count' channels of 'sc', with pages
+ * from NUMA domain 'domain', and maps and wires it in the kernel. Only the
+ * control pages are wired on a lazy device. Assumes the memory lock is held.
+ *
+ * Returns the new segment, or NULL if there is not enough memory.
+ */
+static kup_segment_t*
+new_segment(kup_softc_t* sc, size_t count, int domain)
+{
+	vm_size_t size = count * CHAN_BYTES(sc);
+	kup_segment_t* seg;
+	vm_object_t obj;
+	vm_offset_t addr;
+	int rv;
+
+	// Fails if the swap space for the whole segment cannot be reserved.
+	obj = vm_pager_allocate(OBJT_DEFAULT, NULL, size, VM_PROT_DEFAULT, 0,
+			sc->cred);
+	if (obj == NULL)
+		return (NULL);
+	VM_OBJECT_WLOCK(obj);
+	vm_object_clear_flag(obj, OBJ_ONEMAPPING);
+	vm_object_set_flag(obj, OBJ_NOSPLIT);
+	// The pages are allocated when the range is wired below, and the data
+	// pages of a lazy device when they are first touched, or touched again
+	// after reclaim_idle_channels(). The object is never shared with other
+	// segments, so all of them come from the same domain.
+	obj->domain.dr_policy = DOMAINSET_PREF(domain);
+	// For the kernel mapping below.
+	vm_object_reference_locked(obj);
+	VM_OBJECT_WUNLOCK(obj);
+
+	addr = vm_map_min(kernel_map);
+	rv = vm_map_find(kernel_map, obj, 0, &addr, size, 0, VMFS_OPTIMAL_SPACE,
+			VM_PROT_READ | VM_PROT_WRITE, VM_PROT_READ | VM_PROT_WRITE, 0);
+	if (rv != KERN_SUCCESS) {
+		printf("%s: vm_map_find(%zx) failed\n", __FUNCTION__, (size_t)size);
+		vm_object_deallocate(obj);
+		vm_object_deallocate(obj);
+		return (NULL);
+	}
+	if (sc->lazy) {
+		rv = KERN_SUCCESS;
+		for (size_t k = 0; k < count && rv == KERN_SUCCESS; k++)
+			rv = vm_map_wire(kernel_map, addr + k * CHAN_BYTES(sc),
+					addr + k * CHAN_BYTES(sc) + PAGE_SIZE,
+					VM_MAP_WIRE_SYSTEM | VM_MAP_WIRE_NOHOLES);
+	} else
+		rv = vm_map_wire(kernel_map, addr, addr + size,
+				VM_MAP_WIRE_SYSTEM | VM_MAP_WIRE_NOHOLES);
+	if (rv != KERN_SUCCESS) {
+		printf("%s: vm_map_wire failed\n", __FUNCTION__);
+		vm_map_remove(kernel_map, addr, addr + size);
+		vm_object_deallocate(obj);
+		return (NULL);
 	}
-	return (1 - assigned);
+	seg = malloc(sizeof(*seg), M_STUBDEV, M_WAITOK | M_ZERO);
+	seg->obj = obj;
+	seg->kva = addr;
+	seg->size = size;
+	seg->domain = domain;
+	refcount_init(&seg->users, count);
+	return (seg);
+}
+
+/**
+ * Returns whether the memory left behind in channel 'chan' by a previous
+ * daemon can be handed to a daemon whose memory is to come from NUMA domain
+ * 'domain', as picked by select_domain().
+ */
+static int
+is_warm(comm_channel_t* chan, int domain)
+{
+	return (chan->seg != NULL && chan->domain == domain);
+}
+
+/**
+ * Makes sure the 'count' channels of 'sc' starting at 'first' have memory
+ * mapped and wired in the kernel, one after the other in a single segment,
+ * as user space maps them with a single object. Memory kept from previous
+ * daemons is scrubbed and reused if it is laid out that way and nothing in
+ * user space maps its segment anymore, and it comes from the domain selected
+ * for 'requested'. Otherwise the channels release the memory they have, and
+ * are given a new segment from that domain. Assumes the channels are
+ * reserved.
+ *
+ * Returns 0 on success, or ENOMEM.
+ */
+static int
+warm_channels(kup_softc_t* sc, size_t first, size_t count, int requested)
+{
+	comm_channel_t* chan = get_channel(sc, first);
+	kup_segment_t* seg = chan->seg;
+	vm_ooffset_t off = chan->seg_off;
+	// The domain declared by the kernel side, or the one of the attaching
+	// thread, applies to reused memory too.
+	int domain = select_domain(sc, requested);
+	int warm = is_warm(chan, domain);
+	size_t i;
+
+	for (i = 1; i < count && warm; i++) {
+		chan = get_channel(sc, first + i);
+		warm = chan->seg == seg &&
+				chan->seg_off == off + i * CHAN_BYTES(sc);
+	}
+	if (warm && !segment_mapped(seg)) {
+		for (i = 0; i < count; i++) {
+			chan = get_channel(sc, first + i);
+			// Kernel threads may still be on their way out of the data path
+			// of the previous daemon.
+			drain_channel(chan);
+			if (sc->lazy) {
+				bzero((void*)chan->kva, PAGE_SIZE);
+				discard_data_pages(sc, chan);
+			} else
+				bzero((void*)chan->kva, CHAN_BYTES(sc));
+		}
+		return (0);
+	}
+	for (i = 0; i < count; i++)
+		cool_channel(sc, get_channel(sc, first + i));
+
+	sx_slock(&sc->mem_lock);
+	seg = new_segment(sc, count, domain);
+	for (i = 0; seg != NULL && i < count; i++) {
+		chan = get_channel(sc, first + i);
+		chan->seg = seg;
+		chan->seg_off = i * CHAN_BYTES(sc);
+		chan->kva = seg->kva + chan->seg_off;
+		chan->domain = seg->domain;
+	}
+	sx_sunlock(&sc->mem_lock);
+	return (seg != NULL ? 0 : ENOMEM);
+}
+
+/**
+ * Hands the statistics of the channels of 'sc' out to user space, for the
+ * 'size' bytes at 'offset'. Daemons could make a mapping of the file they
+ * attach through writable later, so the statistics can only be mapped
+ * through a file opened read-only, and read-only.
+ */
+static int
+map_stats(kup_softc_t* sc, kup_file_t* file, vm_ooffset_t offset,
+		vm_size_t size, vm_object_t* object, int nprot)
+{
+	int error = 0;
+
+	if (!file->readonly || (nprot & VM_PROT_WRITE))
+		return (EACCES);
+	// Only the statistics of the chunks of channels in use so far.
+	sx_slock(&sc->resize_lock);
+	if (size == 0 || offset % PAGE_SIZE != 0 ||
+			offset + size > sc->chunk_cnt * KUP_CHUNK_STATS_BYTES)
+		error = EINVAL;
+	sx_sunlock(&sc->resize_lock);
+	if (error)
+		return (error);
+	vm_object_reference(sc->stats_obj);
+	*object = sc->stats_obj;
+	return (0);
 }
 
 static int
 kup_mmap_single(struct cdev* cdev, vm_ooffset_t* vmoffset, vm_size_t vmsize,
 		  vm_object_t* object, int nprot)
 {
-	vm_object_t vmobj;
-	vm_pindex_t vmobj_size;
+	kup_file_t* file;
 	kup_softc_t* sc;
-	vm_ooffset_t increment;
-	int error, res;
+	comm_channel_t* chan;
+	size_t first, count, i;
+	int error, domain, any, adopt;
 
-	error = devfs_get_cdevpriv((void **)&vmobj);
+	error = devfs_get_cdevpriv((void **)&file);
 	if (error)
 		return (error);
 
 	sc = cdev->si_drv1;
-	lock_kupdev(sc);
+	if (*vmoffset & KUP_OFF_STATS) {
+		*vmoffset &= ~KUP_OFF_STATS;
+		return (map_stats(sc, file, *vmoffset, vmsize, object, nprot));
+	}
+	// Daemons attach through files opened for writing too.
+	if (file->readonly)
+		return (EACCES);
+
+	domain = (int)((*vmoffset & KUP_OFF_DOMAIN_MASK) >>
+			KUP_OFF_DOMAIN_SHIFT) - 1;
+	any = (*vmoffset & KUP_OFF_ANY) != 0;
+	adopt = (*vmoffset & KUP_OFF_ADOPT) != 0;
+	*vmoffset &= ~(KUP_OFF_DOMAIN_MASK | KUP_OFF_ANY | KUP_OFF_ADOPT);
+	if (domain >= vm_ndomains)
+		return (EINVAL);
+
+	// Channels are addressed by their offset, and a mapping covers a range
+	// of whole channels of this device. Any free channel can only be asked
+	// for one at a time.
+	if (vmsize == 0 || vmsize % CHAN_BYTES(sc) != 0 ||
+			*vmoffset % CHAN_BYTES(sc) != 0)
+		return (EINVAL);
+	first = *vmoffset / CHAN_BYTES(sc);
+	count = vmsize / CHAN_BYTES(sc);
+	if (any ? count != 1 || adopt : first + count > sc->channel_cnt)
+		return (EINVAL);
 	if (sc->disabled) {
 		DEBUG_PRINT("%s, WARNING: attempted to mmap a kup device after it has "
 				"been disabled", __FUNCTION__);
-		unlock_kupdev(sc);
 		return (EOPNOTSUPP);
 	}
+	if (adopt) {
+		// A process the file has been passed to maps the channels attached
+		// through it, as they are, without going through attaching again.
+		// The channel count may have shrunk since it was checked above.
+		lock_lists(sc);
+		if (first + count > sc->channel_cnt) {
+			unlock_lists(sc);
+			return (EINVAL);
+		}
+		chan = get_channel(sc, first);
+		for (i = 0; i < count; i++) {
+			comm_channel_t* next = get_channel(sc, first + i);
+			if (next->owner != file)
+				error = EPERM;
+			// Only channels laid out one after the other in the same segment
+			// can be mapped at once, as when they were attached.
+			else if (next->seg != chan->seg ||
+					next->seg_off != chan->seg_off + i * CHAN_BYTES(sc))
+				error = EINVAL;
+			if (error) {
+				unlock_lists(sc);
+				return (error);
+			}
+		}
+		// The segment stays while the channels are attached.
+		vm_object_reference(chan->seg->obj);
+		*object = chan->seg->obj;
+		*vmoffset = chan->seg_off;
+		unlock_lists(sc);
+		return (0);
+	}
+	// Reserve the channels before doing any work, so that we can fail fast
+	// if they are taken. The device lock is not held while we set up the
+	// memory, so that daemons can attach to channels in parallel.
+	if (any) {
+		chan = reserve_channel(sc);
+		if (chan == NULL)
+			return (ENOSPC);
+		first = chan->index;
+	} else {
+		error = reserve_channels(sc, first, count);
+		if (error)
+			return (error);
+	}
 
-	vm_offset_t newsize = *vmoffset + vmsize;
-	vmobj_size = OFF_TO_IDX(newsize) + ((newsize & PAGE_MASK)? 1 : 0);
+	error = warm_channels(sc, first, count, domain);
+	if (error) {
+		unreserve_channels(sc, first, count);
+		return (error);
+	}
+	// The user space mapping covers the same pages of the segment as the
+	// kernel mappings of the channels. The reference is taken before the
+	// channels are attached, as they could be detached and their segment
+	// freed right after.
+	chan = get_channel(sc, first);
+	*object = chan->seg->obj;
+	*vmoffset = chan->seg_off;
+	vm_object_reference(*object);
+	for (i = 0; i < count; i++) {
+		chan = get_channel(sc, first + i);
+		error = attach_channel(sc, file, chan, chan->kva, chan->domain);
+		if (error)
+			goto error_detach;
+	}
+	return (0);
 
-	VM_OBJECT_WLOCK(vmobj);
-	if (vmobj_size > vmobj->size) {
-		increment = ptoa(vmobj_size - vmobj->size);
-		res = swap_reserve(increment);
-		if (0 == res) {
-			VM_OBJECT_WUNLOCK(vmobj);
-			unlock_kupdev(sc);
-			return (ENOMEM);
-		}
-		vmobj->charge += increment;
-		vmobj->size = vmobj_size;
+error_detach:
+	vm_object_deallocate(*object);
+	// attach_channel() has already returned channel 'first + i'.
+	unreserve_channels(sc, first + i + 1, count - i - 1);
+	while (i-- > 0) {
+		chan = get_channel(sc, first + i);
+		lock_channel(chan);
+		if (chan->owner == file)
+			release_channel(sc, chan);
+		unlock_channel(chan);
 	}
-	vm_object_reference_locked(vmobj);
-	*object = vmobj;
-	VM_OBJECT_WUNLOCK(vmobj);
+	return (error);
+}
 
+/**
+ * Maps and wires the statistics of chunk 'k' of the channels of 'sc' in the
+ * kernel. Their pages are allocated zeroed.
+ *
+ * Returns 0 on success, or ENOMEM.
+ */
+static int
+map_chunk_stats(kup_softc_t* sc, size_t k)
+{
 	vm_offset_t addr = vm_map_min(kernel_map);
-	int rv = vm_map_find(kernel_map, vmobj, *vmoffset, &addr, vmsize, 0,
-			VMFS_OPTIMAL_SPACE, VM_PROT_READ | VM_PROT_WRITE,
-			VM_PROT_READ | VM_PROT_WRITE, 0);
+	int rv;
+
+	vm_object_reference(sc->stats_obj);
+	rv = vm_map_find(kernel_map, sc->stats_obj, k * KUP_CHUNK_STATS_BYTES,
+			&addr, KUP_CHUNK_STATS_BYTES, 0, VMFS_OPTIMAL_SPACE,
+			VM_PROT_READ | VM_PROT_WRITE, VM_PROT_READ | VM_PROT_WRITE, 0);
 	if (rv != KERN_SUCCESS) {
-		printf("%s: vm_map_find(%zx) failed\n",
-						__FUNCTION__, (size_t)vmsize);
-		goto error_unlock;
+		vm_object_deallocate(sc->stats_obj);
+		return (ENOMEM);
 	}
-	rv = vm_map_wire(kernel_map, addr, addr + vmsize,
+	rv = vm_map_wire(kernel_map, addr, addr + KUP_CHUNK_STATS_BYTES,
 			VM_MAP_WIRE_SYSTEM | VM_MAP_WIRE_NOHOLES);
 	if (rv != KERN_SUCCESS) {
-		printf("%s: vm_map_wire failed\n", __FUNCTION__);
-		goto error_free;
+		vm_map_remove(kernel_map, addr, addr + KUP_CHUNK_STATS_BYTES);
+		return (ENOMEM);
 	}
-	error = assign_to_channel(sc, addr);
-	unlock_kupdev(sc);
+	sc->stats[k] = (struct kup_chan_stats*)addr;
+	return (0);
+}
+
+/**
+ * Undoes map_chunk_stats() and frees the pages, so that the statistics of
+ * the chunk start from zero if it is allocated again.
+ */
+static void
+unmap_chunk_stats(kup_softc_t* sc, size_t k)
+{
+	vm_offset_t addr = (vm_offset_t)sc->stats[k];
+	vm_pindex_t start = OFF_TO_IDX(k * KUP_CHUNK_STATS_BYTES);
+
+	vm_map_remove(kernel_map, addr, addr + KUP_CHUNK_STATS_BYTES);
+	sc->stats[k] = NULL;
+	VM_OBJECT_WLOCK(sc->stats_obj);
+	vm_object_page_remove(sc->stats_obj, start,
+			start + OFF_TO_IDX(KUP_CHUNK_STATS_BYTES), 0);
+	VM_OBJECT_WUNLOCK(sc->stats_obj);
+}
+
+/**
+ * Frees the chunks of channels of 'sc' starting at chunk 'first', when the
+ * device is destroyed. None of the channels in them may be in use.
+ */
+static void
+free_chunks(kup_softc_t* sc, size_t first)
+{
+	for (size_t k = first; k < sc->chunk_cnt; k++) {
+		for (size_t j = 0; j < KUP_CHUNK_CHANNELS; j++) {
+			cool_channel(sc, &sc->chunks[k][j]);
+			mtx_destroy(&sc->chunks[k][j].lock);
+			sx_destroy(&sc->chunks[k][j].io_lock);
+		}
+		free(sc->chunks[k], M_STUBDEV);
+		sc->chunks[k] = NULL;
+		unmap_chunk_stats(sc, k);
+	}
+	if (first < sc->chunk_cnt)
+		sc->chunk_cnt = first;
+}
+
+/**
+ * Raises the channel count of 'sc' to 'chan_cnt', allocating chunks of
+ * channels as needed, and puts the new channels on the free list in index
+ * order. Channels retired by shrink_channels() come back from the chunks
+ * kept for them. Assumes the resize lock is held or 'sc' is not yet visible.
+ *
+ * Returns 0 on success, or ENOMEM if the statistics of the new chunks could
+ * not be mapped, leaving the channel count alone.
+ */
+static int
+grow_channels(kup_softc_t* sc, size_t chan_cnt)
+{
+	size_t chunk_cnt = howmany(chan_cnt, KUP_CHUNK_CHANNELS);
+	size_t ready_max = chunk_cnt * KUP_CHUNK_CHANNELS;
+	int *ready = NULL, *old_ready = NULL;
+
+	for (size_t k = sc->chunk_cnt; k < chunk_cnt; k++) {
+		if (map_chunk_stats(sc, k) != 0) {
+			while (k-- > sc->chunk_cnt)
+				unmap_chunk_stats(sc, k);
+			return (ENOMEM);
+		}
+	}
+	if (ready_max > sc->ready_max)
+		ready = malloc(ready_max * sizeof(*ready), M_STUBDEV, M_WAITOK);
+	for (size_t k = sc->chunk_cnt; k < chunk_cnt; k++) {
+		sc->chunks[k] = malloc(KUP_CHUNK_CHANNELS * sizeof(comm_channel_t),
+						M_STUBDEV, M_WAITOK | M_ZERO);
+		for (size_t j = 0; j < KUP_CHUNK_CHANNELS; j++) {
+			init_comm_channel(&sc->chunks[k][j],
+					k * KUP_CHUNK_CHANNELS + j);
+			sc->chunks[k][j].stats = &sc->stats[k][j];
+		}
+	}
+	if (chunk_cnt > sc->chunk_cnt)
+		sc->chunk_cnt = chunk_cnt;
+	lock_lists(sc);
+	if (ready != NULL) {
+		if (sc->ready_cnt)
+			memcpy(ready, sc->ready, sc->ready_cnt * sizeof(*ready));
+		old_ready = sc->ready;
+		sc->ready = ready;
+		sc->ready_max = ready_max;
+	}
+	for (size_t i = sc->channel_cnt; i < chan_cnt; i++) {
+		comm_channel_t* chan = get_channel(sc, i);
+		TAILQ_INSERT_TAIL(&sc->free_list, chan, link);
+		chan->free = 1;
+		sc->free_cnt++;
+	}
+	atomic_store_rel_long((volatile u_long*)&sc->channel_cnt, chan_cnt);
+	unlock_lists(sc);
+	if (old_ready != NULL)
+		free(old_ready, M_STUBDEV);
+	return (0);
+}
+
+/**
+ * Lowers the channel count of 'sc' to 'chan_cnt', retiring the channels
+ * with higher indexes. Fails with EBUSY if any of them is in use. Their
+ * chunks are kept until the device is destroyed, as the data path does not
+ * take the resize lock and may still look a retired channel up, only to
+ * find that it is not ready.
+ */
+static int
+shrink_channels(kup_softc_t* sc, size_t chan_cnt)
+{
+	size_t i, old_cnt;
+
+	lock_lists(sc);
+	for (i = chan_cnt; i < sc->channel_cnt; i++) {
+		if (!get_channel(sc, i)->free) {
+			unlock_lists(sc);
+			return (EBUSY);
+		}
+	}
+	for (i = chan_cnt; i < sc->channel_cnt; i++) {
+		comm_channel_t* chan = get_channel(sc, i);
+		TAILQ_REMOVE(&sc->free_list, chan, link);
+		chan->free = 0;
+		sc->free_cnt--;
+		if (chan->cpu != KUP_CPU_NONE) {
+			atomic_store_rel_int((volatile u_int*)
+					&sc->cpu_channel[chan->cpu], -1);
+			chan->cpu = KUP_CPU_NONE;
+		}
+	}
+	old_cnt = sc->channel_cnt;
+	atomic_store_rel_long((volatile u_long*)&sc->channel_cnt, chan_cnt);
+	unlock_lists(sc);
+	// No daemon can attach to the retired channels anymore, so their memory
+	// can go. A channel that comes back starts with fresh statistics.
+	for (i = chan_cnt; i < old_cnt; i++) {
+		cool_channel(sc, get_channel(sc, i));
+		bzero(get_channel(sc, i)->stats, sizeof(struct kup_chan_stats));
+	}
+	return (0);
+}
+
+/**
+ * Handler of the dev.kup.<name>.stats sysctl, which returns the statistics
+ * of the channels of the device as an array of struct kup_chan_stats.
+ */
+static int
+sysctl_chan_stats(SYSCTL_HANDLER_ARGS)
+{
+	kup_softc_t* sc = arg1;
+	size_t cnt;
+	int error = 0;
+
+	sx_slock(&sc->resize_lock);
+	for (size_t k = 0; k * KUP_CHUNK_CHANNELS < sc->channel_cnt && !error;
+			k++) {
+		cnt = MIN(KUP_CHUNK_CHANNELS,
+				sc->channel_cnt - k * KUP_CHUNK_CHANNELS);
+		error = SYSCTL_OUT(req, sc->stats[k],
+				cnt * sizeof(struct kup_chan_stats));
+	}
+	sx_sunlock(&sc->resize_lock);
 	return (error);
+}
 
-error_free:
-	vm_map_remove(kernel_map, addr, addr + vmsize);
-error_unlock:
-	unlock_kupdev(sc);
-	return (ENOMEM);
+/**
+ * Handler of the sysctls of the device totals, which sums the counter at
+ * offset 'arg2' of struct kup_chan_stats over all channels of the device.
+ */
+static int
+sysctl_stat_total(SYSCTL_HANDLER_ARGS)
+{
+	kup_softc_t* sc = arg1;
+	uint64_t total = 0;
+
+	sx_slock(&sc->resize_lock);
+	FOR_EACH_CHANNEL(sc)
+		total += *(uint64_t*)((char*)channel->stats + arg2);
+	sx_sunlock(&sc->resize_lock);
+	return (sysctl_handle_64(oidp, &total, 0, req));
+}
+
+static const struct {
+	const char*	name;
+	size_t		offset;
+	const char*	descr;
+} kup_stat_totals[] = {
+	{ "msgs_out", offsetof(struct kup_chan_stats, ks_msgs_out),
+		"Messages sent to daemons" },
+	{ "bytes_out", offsetof(struct kup_chan_stats, ks_bytes_out),
+		"Bytes sent to daemons" },
+	{ "msgs_in", offsetof(struct kup_chan_stats, ks_msgs_in),
+		"Messages received from daemons" },
+	{ "bytes_in", offsetof(struct kup_chan_stats, ks_bytes_in),
+		"Bytes received from daemons" },
+	{ "spin_ns", offsetof(struct kup_chan_stats, ks_spin_ns),
+		"Nanoseconds spent spinning for the turn" },
+	{ "sleep_ns", offsetof(struct kup_chan_stats, ks_sleep_ns),
+		"Nanoseconds spent sleeping for the turn" },
+	{ "sleeps", offsetof(struct kup_chan_stats, ks_sleeps),
+		"Sleeps for the turn" },
+	{ "attaches", offsetof(struct kup_chan_stats, ks_attaches),
+		"Daemons attached to channels" },
+	{ "detaches", offsetof(struct kup_chan_stats, ks_detaches),
+		"Daemons detached from channels" },
+};
+
+/**
+ * Adds the dev.kup.<name> sysctl node of 'sc', with the statistics of each
+ * channel and their totals.
+ */
+static void
+add_sysctls(kup_softc_t* sc, const char* name)
+{
+	struct sysctl_oid* node;
+
+	sysctl_ctx_init(&sc->sysctl_ctx);
+	node = SYSCTL_ADD_NODE(&sc->sysctl_ctx, SYSCTL_STATIC_CHILDREN(_dev_kup),
+			OID_AUTO, name, CTLFLAG_RD | CTLFLAG_MPSAFE, NULL, "KUP device");
+	if (node == NULL)
+		return;
+	SYSCTL_ADD_PROC(&sc->sysctl_ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+			"stats", CTLTYPE_OPAQUE | CTLFLAG_RD | CTLFLAG_MPSAFE, sc, 0,
+			sysctl_chan_stats, "S,kup_chan_stats",
+			"Statistics of each channel");
+	for (size_t i = 0; i < nitems(kup_stat_totals); i++)
+		SYSCTL_ADD_PROC(&sc->sysctl_ctx, SYSCTL_CHILDREN(node), OID_AUTO,
+				kup_stat_totals[i].name,
+				CTLTYPE_U64 | CTLFLAG_RD | CTLFLAG_MPSAFE, sc,
+				kup_stat_totals[i].offset, sysctl_stat_total, "QU",
+				kup_stat_totals[i].descr);
 }
 
 static struct cdevsw*
@@ -677,6 +2127,7 @@ create_cdevsw(char const* name)
 	kupdev_cdevsw->d_version = D_VERSION;
 	kupdev_cdevsw->d_open = kup_open;
 	kupdev_cdevsw->d_close = kup_close;
+	kupdev_cdevsw->d_ioctl = kup_ioctl;
 	kupdev_cdevsw->d_mmap_single = kup_mmap_single;
 	kupdev_cdevsw->d_kqfilter = kupdev_kqfilter;
 	kupdev_cdevsw->d_name = name;
@@ -684,38 +2135,6 @@ create_cdevsw(char const* name)
 	return kupdev_cdevsw;
 }
 
-/**
- *	This method is the main loop ran by a background thread in kernel for
- *	each instance of KUP device created by each client kernel module.
- *	It monitors validity of each channel in the software context by verifying
- *	that the owning daemon in the user space is still running, and frees
- *	any dangling channels to be taken up by a new instance of the daemon.
- */
-static void
-channels_monitor(void *scp)
-{
-	kup_softc_t* sc = (kup_softc_t*)scp;
-
-	if (!sc->disabled) {
-		FOR_EACH_CHANNEL(sc) {
-			lock_channel(channel);
-			if (channel_is_active(channel) &&
-							!process_exists(channel->pid)) {
-					DEBUG_PRINT("%s: proc (%d) not found. Will "
-						"release the corresponding "
-						"channel.\n", __FUNCTION__, channel->pid);
-					channel->status = CHAN_PENDING;
-					channel->mem = 0;
-					channel->pid = -1;
-					// Inform any pending user space daemons that a new
-					// channel is available to be taken up.
-					KNOTE_UNLOCKED(&sc->rsel.si_note, 0);
-			}
-			unlock_channel(channel);
-		}
-	}
-}
-
 /**
  *	Create a new kup device named /dev/'name' with 'chan_cnt' number of
  *	communication channels with user space. The size of each channel
@@ -727,24 +2146,86 @@ channels_monitor(void *scp)
 KUP_API
 kup_softc_t*
 kupdev_create(const char *name, size_t size, size_t chan_cnt)
+{
+	return kupdev_create_domain(name, size, chan_cnt, KUP_DOMAIN_ANY);
+}
+
+/**
+ *	Same as kupdev_create(), but the memory of the channels is allocated from
+ *	NUMA domain 'domain' unless the attaching daemon explicitly asks for
+ *	another one. Pass KUP_DOMAIN_ANY to place each channel on the domain of
+ *	the attaching thread.
+ */
+KUP_API
+kup_softc_t*
+kupdev_create_domain(const char *name, size_t size, size_t chan_cnt,
+		int domain)
+{
+	return kupdev_create_asym(name, size, size, chan_cnt, domain);
+}
+
+/**
+ *	Same as kupdev_create_domain(), with 'size' pages for the messages the
+ *	kernel sends and 'rsize' pages for the ones the daemon sends back on each
+ *	channel. With an 'rsize' of 0 the daemon gets the last
+ *	KUP_SMALL_RETURN_SIZE bytes of the control page instead, which suits
+ *	short acknowledgements and saves wiring a page per channel for them.
+ */
+KUP_API
+kup_softc_t*
+kupdev_create_asym(const char *name, size_t size, size_t rsize,
+		size_t chan_cnt, int domain)
 {
 	kup_softc_t* sc;
 
+	if (domain != KUP_DOMAIN_ANY && (domain < 0 || domain >= vm_ndomains)) {
+		printf("[kup] %s: kupdev: Invalid NUMA domain %d\n",
+						__FUNCTION__, domain);
+		return (NULL);
+	}
+
+	if (chan_cnt == 0 || chan_cnt > KUP_MAX_CHANNELS) {
+		printf("[kup] %s: kupdev: Invalid channel count %zu\n",
+						__FUNCTION__, chan_cnt);
+		return (NULL);
+	}
+
 	struct cdevsw *cdevsw = create_cdevsw(name);
-	sc = malloc(sizeof(*sc) + chan_cnt * sizeof(comm_channel_t),
-					M_STUBDEV, M_WAITOK | M_ZERO);
+	sc = malloc(sizeof(*sc), M_STUBDEV, M_WAITOK | M_ZERO);
 	mtx_init(&sc->lock, name, NULL, MTX_DEF);
-	sc->channel_cnt = chan_cnt;
+	mtx_init(&sc->list_lock, "kup_lists", NULL, MTX_DEF);
+	sx_init(&sc->resize_lock, "kup_resize");
+	sx_init(&sc->mem_lock, "kup_mem");
+	sc->cred = crhold(curthread->td_ucred);
+	// Room for the statistics of the largest device. Pages are only
+	// allocated for the chunks of channels in use, and never paged out.
+	sc->stats_obj = vm_pager_allocate(OBJT_PHYS, NULL,
+			KUP_MAX_CHUNKS * KUP_CHUNK_STATS_BYTES, VM_PROT_DEFAULT, 0, NULL);
+	cv_init(&sc->condvar, "kup_wait_channel");
+	TAILQ_INIT(&sc->free_list);
+	TAILQ_INIT(&sc->pending_list);
 	sc->size = size;
-	FOR_EACH_CHANNEL(sc) {
-		init_comm_channel(channel);
-	}
+	sc->rsize = rsize;
+	sc->copy_threshold = KUP_COPY_THRESHOLD;
+	sc->domain = domain;
+	for (int cpu = 0; cpu < MAXCPU; cpu++)
+		sc->cpu_channel[cpu] = -1;
 	knlist_init_mtx(&sc->rsel.si_note, NULL);
 	knlist_init_mtx(&sc->wsel.si_note, NULL);
-	sc->cdev = make_dev(cdevsw, 0, UID_ROOT, GID_WHEEL, 0666, "%s", name);
+	if (grow_channels(sc, chan_cnt) == 0)
+		sc->cdev = make_dev(cdevsw, 0, UID_ROOT, GID_WHEEL, 0666, "%s",
+				name);
 	if (sc->cdev == NULL) {
 		knlist_destroy(&sc->rsel.si_note);
 		knlist_destroy(&sc->wsel.si_note);
+		free_chunks(sc, 0);
+		free(sc->ready, M_STUBDEV);
+		vm_object_deallocate(sc->stats_obj);
+		crfree(sc->cred);
+		cv_destroy(&sc->condvar);
+		sx_destroy(&sc->mem_lock);
+		sx_destroy(&sc->resize_lock);
+		mtx_destroy(&sc->list_lock);
 		mtx_destroy(&sc->lock);
 		free(sc, M_STUBDEV);
 		printf("[kup] %s: kupdev: Failed to create /dev/%s\n",
@@ -752,31 +2233,90 @@ kupdev_create(const char *name, size_t size, size_t chan_cnt)
 		return (NULL);
 	}
 	sc->cdev->si_drv1 = sc;
-	// Whenever a process exits, we check if it was attached to any of the
-	// cahnnels of this KUP device instance. This is implemented in
-	// 'cahnnels_monitor' function.
-	sc->monitor_cookie = EVENTHANDLER_REGISTER(process_exit, channels_monitor,
-					sc, EVENTHANDLER_PRI_ANY);
+	add_sysctls(sc, name);
 
 	return (sc);
 }
 
-static void
+/**
+ *	Frees the KUP device represented by 'sc', once it has been disabled with
+ *	kupdev_disable(). The kernel threads that used the device must be done
+ *	with it, as the handle is freed.
+ */
+KUP_API
+void
 kupdev_destroy(kup_softc_t* sc)
 {
-	EVENTHANDLER_DEREGISTER(process_exit, sc->monitor_cookie);
+	// Waits for the sysctl handlers still looking at the channels.
+	sysctl_ctx_free(&sc->sysctl_ctx);
+	// The device is disabled, so the task does not queue itself again.
+	if (sc->idle_ticks > 0)
+		taskqueue_drain_timeout(taskqueue_thread, &sc->reclaim_task);
+	// This also runs the destructors of the files still open on the device.
 	destroy_dev(sc->cdev);
 	knlist_destroy(&sc->rsel.si_note);
 	knlist_destroy(&sc->wsel.si_note);
 	seldrain(&sc->rsel);
 	seldrain(&sc->wsel);
+	free_chunks(sc, 0);
+	free(sc->ready, M_STUBDEV);
+	vm_object_deallocate(sc->stats_obj);
+	crfree(sc->cred);
+	cv_destroy(&sc->condvar);
+	sx_destroy(&sc->mem_lock);
+	sx_destroy(&sc->resize_lock);
+	mtx_destroy(&sc->list_lock);
 	mtx_destroy(&sc->lock);
 	free(sc, M_STUBDEV);
 }
 
+/**
+ *	Disables the KUP device represented by 'sc' without freeing it, so that
+ *	no daemon can attach to it anymore. The threads blocked in
+ *	kupdev_wait_channel() are let out, and the threads still using channels
+ *	of the device get errors from then on. The device is freed with
+ *	kupdev_destroy() once they are gone.
+ *
+ *	Returns 0 on success. If there is a user space daemon connected to this
+ *	device this method does nothing and returns 1 to signal failure.
+ */
+KUP_API
+int
+kupdev_disable(kup_softc_t* sc)
+{
+	sx_xlock(&sc->resize_lock);
+	lock_kupdev(sc);
+	// Taking the list lock makes sure that no daemon can complete attaching
+	// to a channel after this point, see attach_channel().
+	lock_lists(sc);
+	if (sc->attached_cnt > 0) {
+		// There is a user space process attached to this device, so we
+		// cannot allow unloading of this device.
+		unlock_lists(sc);
+		unlock_kupdev(sc);
+		sx_xunlock(&sc->resize_lock);
+		return 1;
+	}
+	sc->disabled = 1;
+	cv_broadcast(&sc->condvar);
+	unlock_lists(sc);
+	unlock_kupdev(sc);
+	sx_xunlock(&sc->resize_lock);
+	KNOTE_UNLOCKED(&sc->rsel.si_note, 0);
+	// Kernel threads blocked in kupdev_wait_channel() still use the lists
+	// and the condition variable on their way out.
+	lock_lists(sc);
+	while (sc->waiters > 0)
+		cv_wait(&sc->condvar, &sc->list_lock);
+	unlock_lists(sc);
+	return 0;
+}
+
 /*
  *	Unloads and destroys the KUP device represented by sc and frees all
- *	associated buffers and resources.
+ *	associated buffers and resources. Only for kernel sides whose threads
+ *	are all blocked in kupdev_wait_channel() or gone, use kupdev_disable()
+ *	and kupdev_destroy() otherwise.
  *
  *	@param sc  This is a device handle returned to the user by kupdev_create
  *	and is opaque to the users of this API.
@@ -789,41 +2329,231 @@ KUP_API
 int
 kupdev_unload(kup_softc_t* sc)
 {
-	lock_kupdev(sc);
-	FOR_EACH_CHANNEL(sc) {
-		/* lock_channel(channel); */
-		if (process_exists(channel->pid)) {
-			// There is a user space process attached to this channel, so we
-			// cannot allow unloading of this device.
-			/* unlock_channel(channel); */
-			unlock_kupdev(sc);
-			return 1;
+	if (kupdev_disable(sc))
+		return 1;
+	kupdev_destroy(sc);
+
+	return 0;
+}
+
+/**
+ * Returns the NUMA domain the memory of channel 'chan_id' was allocated from,
+ * or KUP_DOMAIN_ANY if no daemon is attached to it or there is no such
+ * channel. Kernel producers can use
+ * this to run close to the memory of the channel they feed.
+ */
+KUP_API
+int
+kupdev_channel_domain(kup_softc_t* sc, int chan_id)
+{
+	comm_channel_t* chan;
+	int domain;
+
+	if (!valid_channel(sc, chan_id))
+		return (KUP_DOMAIN_ANY);
+	chan = get_channel_locked(sc, chan_id);
+	domain = chan->mem ? chan->domain : KUP_DOMAIN_ANY;
+	unlock_channel(chan);
+	return (domain);
+}
+
+/**
+ * Binds channel 'chan_id' of 'sc' to CPU 'cpu', so that kupdev_send_local()
+ * calls made on that CPU go to the channel, or unbinds the channel if 'cpu'
+ * is KUP_CPU_NONE. A CPU is bound to at most one channel and the other way
+ * round, so earlier bindings of either are dropped. The CPU is published in
+ * the control page of the channel, where the daemon serving it can find it
+ * with kernproxy_channel_cpu() and pin itself next to the producer.
+ *
+ * Returns 0 on success, and EINVAL if 'chan_id' or 'cpu' are not valid.
+ */
+KUP_API
+int
+kupdev_bind_cpu(kup_softc_t* sc, int chan_id, int cpu)
+{
+	comm_channel_t *chan, *old;
+	int old_id;
+
+	if (cpu != KUP_CPU_NONE && (cpu < 0 || cpu > mp_maxid || CPU_ABSENT(cpu)))
+		return (EINVAL);
+	sx_xlock(&sc->resize_lock);
+	if (chan_id < 0 || chan_id >= sc->channel_cnt) {
+		sx_xunlock(&sc->resize_lock);
+		return (EINVAL);
+	}
+	chan = get_channel(sc, chan_id);
+	if (cpu != KUP_CPU_NONE) {
+		old_id = sc->cpu_channel[cpu];
+		if (old_id >= 0 && old_id != chan_id) {
+			old = get_channel_locked(sc, old_id);
+			old->cpu = KUP_CPU_NONE;
+			if (old->mem)
+				*CPU_OFFSET(old->mem) = KUP_CPU_NONE;
+			unlock_channel(old);
 		}
-		/* unlock_channel(channel); */
 	}
-	sc->disabled = 1;
-	unlock_kupdev(sc);
-	KNOTE_UNLOCKED(&sc->rsel.si_note, 0);
+	lock_channel(chan);
+	if (chan->cpu != KUP_CPU_NONE)
+		atomic_store_rel_int((volatile u_int*)&sc->cpu_channel[chan->cpu], -1);
+	chan->cpu = cpu;
+	if (chan->mem)
+		*CPU_OFFSET(chan->mem) = cpu;
+	unlock_channel(chan);
+	if (cpu != KUP_CPU_NONE)
+		atomic_store_rel_int((volatile u_int*)&sc->cpu_channel[cpu], chan_id);
+	sx_xunlock(&sc->resize_lock);
+	return (0);
+}
+
+/**
+ * Periodic task of a lazy device 'sc' that gives the data pages of the
+ * channels that have been idle for 'idle_ticks' back to the VM system. The
+ * pages of a free channel are discarded. Those of an attached channel may
+ * still hold a message that has not been read, so they are only deactivated,
+ * which lets the page daemon reclaim them first and page them back in if the
+ * channel is used again.
+ */
+static void
+reclaim_idle_channels(void* arg, int pending)
+{
+	kup_softc_t* sc = arg;
+	vm_object_t obj;
+	vm_pindex_t start = 0;
+	int used;
+
+	sx_slock(&sc->resize_lock);
+	if (sc->disabled) {
+		sx_sunlock(&sc->resize_lock);
+		return;
+	}
 	FOR_EACH_CHANNEL(sc) {
-		lock_channel(channel);
-		channel->status = CHAN_PENDING;
-		channel->pid = -1;
-		if (channel->mem) {
-			*CMD_OFFSET(channel->mem) = CMD_CLOSE;
-			// Pass turn to user space on this channel, so it receives the
-			// CMD_CLOSE command and starts shutting down.
-			// pass_turn will also unlock channel->lock
-			pass_turn(sc, channel_index);
-			// Setting channel->mem to zero after pass_turn which has already
-			// unlocked channel is OK, because its status is already set to
-			// CHAN_PENDING.
-			channel->mem = 0;
+		used = channel->last_used;
+		if (channel->kva == 0 || used == channel->reclaimed ||
+				ticks - used < sc->idle_ticks)
+			continue;
+		// Taking the channel off the free list keeps daemons away from it
+		// while its pages are discarded.
+		if (channel->free && reserve_channels(sc, channel_index, 1) == 0) {
+			discard_data_pages(sc, channel);
+			unreserve_channels(sc, channel_index, 1);
+		} else {
+			// The segment of an attached channel stays until the channel is
+			// detached, and its object as long as we hold on to it. Channels
+			// being attached are left for the next round.
+			obj = NULL;
+			lock_channel(channel);
+			if (channel->owner != NULL) {
+				obj = channel->seg->obj;
+				start = OFF_TO_IDX(channel->seg_off);
+				vm_object_reference(obj);
+			}
+			unlock_channel(channel);
+			if (obj == NULL)
+				continue;
+			vm_object_madvise(obj, start + 1,
+					start + OFF_TO_IDX(CHAN_BYTES(sc)), MADV_DONTNEED);
+			vm_object_deallocate(obj);
 		}
-		mtx_destroy(&channel->lock);
+		channel->reclaimed = used;
 	}
-	kupdev_destroy(sc);
+	sx_sunlock(&sc->resize_lock);
+	taskqueue_enqueue_timeout(taskqueue_thread, &sc->reclaim_task,
+			sc->idle_ticks);
+}
 
-	return 0;
+/**
+ * Makes 'sc' a lazy device. Only the control page of each channel is wired
+ * then, and the data pages are allocated as messages first reach them, up to
+ * the configured size. If 'idle_ms' is not 0, the data pages of channels
+ * nothing has been sent or received on for 'idle_ms' milliseconds are given
+ * back to the system, see reclaim_idle_channels(). Suits devices with many
+ * mostly idle channels.
+ *
+ * The data path of a lazy device may fault pages in, so kupdev_send() and
+ * friends, and reading the data returned by kupdev_receive(), must be done
+ * where sleeping is allowed. The NUMA domain of a channel is only a
+ * preference for its data pages then. Must be called before any daemon is
+ * notified of the device.
+ *
+ * Returns 0 on success, EINVAL if 'idle_ms' is negative, and EBUSY if 'sc'
+ * is already lazy or a daemon has already been given memory on it.
+ */
+KUP_API
+int
+kupdev_set_lazy(kup_softc_t* sc, int idle_ms)
+{
+	int error = 0;
+
+	if (idle_ms < 0)
+		return (EINVAL);
+	sx_xlock(&sc->resize_lock);
+	sx_xlock(&sc->mem_lock);
+	if (sc->lazy)
+		error = EBUSY;
+	FOR_EACH_CHANNEL(sc)
+		if (channel->kva != 0)
+			error = EBUSY;
+	if (error == 0) {
+		sc->lazy = 1;
+		if (idle_ms > 0) {
+			sc->idle_ticks = MAX(1, (int)((int64_t)idle_ms * hz / 1000));
+			TIMEOUT_TASK_INIT(taskqueue_thread, &sc->reclaim_task, 0,
+					reclaim_idle_channels, sc);
+			taskqueue_enqueue_timeout(taskqueue_thread, &sc->reclaim_task,
+					sc->idle_ticks);
+		}
+	}
+	sx_xunlock(&sc->mem_lock);
+	sx_xunlock(&sc->resize_lock);
+	return (error);
+}
+
+/**
+ * Makes kupdev_send() and friends on 'sc' copy messages of 'threshold' bytes
+ * or more with non-temporal stores, which keep payloads only the daemon
+ * reads out of the caches of the sending CPU. SIZE_MAX turns them off. The
+ * default is KUP_COPY_THRESHOLD. The copy_bench program of kuplib measures
+ * the crossover point on a given machine.
+ */
+KUP_API
+void
+kupdev_set_copy_threshold(kup_softc_t* sc, size_t threshold)
+{
+	sc->copy_threshold = threshold;
+}
+
+/**
+ * Changes the number of channels of 'sc' to 'chan_cnt', while daemons stay
+ * attached to the channels that are kept. New channels are free to be
+ * attached right away, and pending daemons are notified of them. Shrinking
+ * retires the channels with the highest indexes, and fails without changing
+ * anything if a daemon is attached to any of them.
+ *
+ * Returns 0 on success, EINVAL if 'chan_cnt' is 0 or above KUP_MAX_CHANNELS,
+ * EBUSY if a channel to be retired is in use, ENOMEM if the statistics of
+ * the new channels cannot be mapped, and EOPNOTSUPP if the device is being
+ * unloaded.
+ */
+KUP_API
+int
+kupdev_resize(kup_softc_t* sc, size_t chan_cnt)
+{
+	int error = 0;
+
+	if (chan_cnt == 0 || chan_cnt > KUP_MAX_CHANNELS)
+		return (EINVAL);
+	sx_xlock(&sc->resize_lock);
+	if (sc->disabled)
+		error = EOPNOTSUPP;
+	else if (chan_cnt > sc->channel_cnt) {
+		error = grow_channels(sc, chan_cnt);
+		// Inform any pending user space daemons of the new channels.
+		if (error == 0)
+			KNOTE_UNLOCKED(&sc->rsel.si_note, 0);
+	} else if (chan_cnt < sc->channel_cnt)
+		error = shrink_channels(sc, chan_cnt);
+	sx_xunlock(&sc->resize_lock);
+	return (error);
 }
 
 /**
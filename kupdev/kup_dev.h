@@ -32,27 +32,94 @@
 
 #pragma once
 
+// Let KUP pick the NUMA domain of the channel memory.
+enum { KUP_DOMAIN_ANY = -1 };
+
+// Room for the messages of the daemon on devices created with an 'rsize' of
+// 0, see kupdev_create_asym().
+enum { KUP_SMALL_RETURN_SIZE = 2048 };
+
+// No CPU, see kupdev_bind_cpu().
+enum { KUP_CPU_NONE = -1 };
+
+// Default size from which messages are copied with non-temporal stores, see
+// kupdev_set_copy_threshold().
+enum { KUP_COPY_THRESHOLD = 1 << 20 };
+
+// Upper bound on the channel count of a KUP device.
+enum { KUP_MAX_CHANNELS = 1 << 16 };
+
 extern struct kupdev_softc *
 kupdev_create(const char *name, size_t size, size_t chan_cnt);
 
+extern struct kupdev_softc *
+kupdev_create_domain(const char *name, size_t size, size_t chan_cnt,
+		int domain);
+
+extern struct kupdev_softc *
+kupdev_create_asym(const char *name, size_t size, size_t rsize,
+		size_t chan_cnt, int domain);
+
+extern int
+kupdev_set_lazy(struct kupdev_softc *sc, int idle_ms);
+
+extern void
+kupdev_set_copy_threshold(struct kupdev_softc *sc, size_t threshold);
+
+extern int
+kupdev_channel_domain(struct kupdev_softc *sc, int chan_id);
+
 extern int
 kupdev_wait_channel(struct kupdev_softc *sc);
 
 extern int
 kupdev_unload(struct kupdev_softc* sc);
 
+extern int
+kupdev_disable(struct kupdev_softc* sc);
+
+extern void
+kupdev_destroy(struct kupdev_softc* sc);
+
+extern int
+kupdev_resize(struct kupdev_softc* sc, size_t chan_cnt);
+
 extern void
 kupdev_notify(struct kupdev_softc *sc);
 
 extern int
 kupdev_send(struct kupdev_softc *sc, void *data, size_t len, int chan_id);
 
+extern int
+kupdev_bind_cpu(struct kupdev_softc* sc, int chan_id, int cpu);
+
+extern int
+kupdev_send_local(struct kupdev_softc* sc, void *data, size_t len);
+
+extern int
+kupdev_send_flow(struct kupdev_softc* sc, uint64_t flow_key, void *data,
+		size_t len);
+
+extern int
+kupdev_send_any(struct kupdev_softc* sc, void *data, size_t len);
+
 extern void*
 kupdev_receive(struct kupdev_softc *sc, int chan_id);
 
+extern void*
+kupdev_receive_msg(struct kupdev_softc *sc, int chan_id, size_t *len);
+
 extern void
 kupdev_unlock_channel(struct kupdev_softc* sc, int chan_id);
 
+struct kupdev_lease;
+
+extern struct kupdev_lease*
+kupdev_receive_lease(struct kupdev_softc* sc, int chan_id, void** data);
+
+extern void
+kupdev_release(struct kupdev_lease* lease);
+
 extern void
 kupdev_pass(struct kupdev_softc* sc, int chan_id);
 
@@ -0,0 +1,195 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * Finds the message size from which copying into a channel with streaming
+ * stores beats memcpy() on this machine. For each size, a message is copied
+ * from a source buffer to a destination buffer playing the shared memory,
+ * with memcpy() and with each streaming copy kernel the CPU supports, after
+ * which the sender reads its own working set again. Streaming stores are
+ * slower to copy small messages, but they leave the working set of the
+ * sender in its caches. Prints the cost of both steps, and the copy
+ * threshold to pass to kernproxy_set_copy_threshold().
+ *
+ * usage: copy_bench [-w working_set_kb] [-m max_size_mb]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../kup.h"
+#include "../kup_copy.h"
+
+#define MIN_SIZE	4096
+#define ISA_CNT		(KP_COPY_AVX512 + 1)
+
+static const char* isa_names[ISA_CNT] = {
+	[KP_COPY_MEMCPY] = "memcpy",
+	[KP_COPY_SSE2] = "sse2",
+	[KP_COPY_AVX2] = "avx2",
+	[KP_COPY_AVX512] = "avx512",
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile uint64_t sink;
+
+/**
+ * Reads one word of every cache line of 'ws'.
+ */
+static void
+touch(const uint64_t* ws, size_t len)
+{
+	uint64_t sum = 0;
+	for (size_t i = 0; i < len / sizeof(*ws); i += 8)
+		sum += ws[i];
+	sink += sum;
+}
+
+/**
+ * Returns the time in seconds it takes to copy 'size' bytes with 'isa' and
+ * then read the working set 'ws' of 'ws_len' bytes, averaged over 'reps'
+ * rounds. The time spent on reading the working set is stored in 'reread'.
+ */
+static double
+measure(int isa, uint8_t* dst, const uint8_t* src, size_t size,
+		const uint64_t* ws, size_t ws_len, int reps, double* reread)
+{
+	double copy = 0, read = 0, t;
+
+	for (int r = 0; r < reps; r++) {
+		touch(ws, ws_len);
+		t = now();
+		if (isa == KP_COPY_MEMCPY)
+			memcpy(dst, src, size);
+		else
+			kernproxy_copy_nt(isa, dst, src, size);
+		copy += now() - t;
+		t = now();
+		touch(ws, ws_len);
+		read += now() - t;
+	}
+	*reread = read / reps;
+	return (copy + read) / reps;
+}
+
+int
+main(int argc, char* argv[])
+{
+	size_t ws_len = 256 << 10, max_size = 64 << 20;
+	size_t threshold = SIZE_MAX;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:m:")) != -1) {
+		switch (opt) {
+		case 'w': ws_len = strtoul(optarg, NULL, 10) << 10; break;
+		case 'm': max_size = strtoul(optarg, NULL, 10) << 20; break;
+		default:
+			fprintf(stderr, "usage: %s [-w working_set_kb] [-m max_size_mb]\n",
+					argv[0]);
+			return 1;
+		}
+	}
+	if (ws_len == 0 || max_size < MIN_SIZE) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	uint8_t* src = aligned_alloc(4096, max_size);
+	uint8_t* dst = aligned_alloc(4096, max_size);
+	uint64_t* ws = aligned_alloc(4096, ws_len);
+	if (src == NULL || dst == NULL || ws == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+	memset(src, 's', max_size);
+	memset(dst, 'd', max_size);
+	memset(ws, 'w', ws_len);
+
+	printf("selected kernel: %s, working set: %zu KB\n",
+			isa_names[kernproxy_copy_isa()], ws_len >> 10);
+	printf("%10s", "size");
+	for (int isa = 0; isa < ISA_CNT; isa++)
+		if (kernproxy_copy_nt(isa, dst, src, 0) == 0)
+			printf(" %10s GB/s %8s us", isa_names[isa], "reread");
+	printf("\n");
+
+	for (size_t size = MIN_SIZE; size <= max_size; size *= 2) {
+		int reps = (int)((256 << 20) / size);
+		double best_nt = 0, plain = 0, total, reread;
+
+		if (reps < 4)
+			reps = 4;
+		printf("%10zu", size);
+		for (int isa = 0; isa < ISA_CNT; isa++) {
+			if (kernproxy_copy_nt(isa, dst, src, 0) != 0)
+				continue;
+			// Warm up, and fault in the buffers.
+			measure(isa, dst, src, size, ws, ws_len, 1, &reread);
+			total = measure(isa, dst, src, size, ws, ws_len, reps, &reread);
+			printf(" %15.2f %11.2f", size / (total - reread) / 1e9,
+					reread * 1e6);
+			if (isa == KP_COPY_MEMCPY)
+				plain = total;
+			else if (best_nt == 0 || total < best_nt)
+				best_nt = total;
+		}
+		printf("\n");
+		// The threshold is the smallest size from which streaming wins for
+		// every larger size measured.
+		if (best_nt != 0 && best_nt < plain) {
+			if (threshold == SIZE_MAX)
+				threshold = size;
+		} else
+			threshold = SIZE_MAX;
+	}
+
+	if (threshold == SIZE_MAX)
+		printf("streaming stores do not pay off up to %zu bytes\n", max_size);
+	else
+		printf("suggested threshold: kernproxy_set_copy_threshold(%zu)\n",
+				threshold);
+	free(ws);
+	free(dst);
+	free(src);
+	return 0;
+}
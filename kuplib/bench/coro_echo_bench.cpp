@@ -0,0 +1,157 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * Echo benchmark for the C++20 coroutine binding. One thread runs a
+ * kup::scheduler with one echo session per channel, while a number of
+ * producer threads play the kernel side through the user space stand-in
+ * (kuploop), each keeping one message in flight on every channel it owns.
+ *
+ * usage: coro_echo_bench [-c sessions] [-k producers] [-m msg_size]
+ *                        [-t seconds]
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+#include "../kup_coro.hpp"
+#include "../kuploop.h"
+
+namespace {
+
+kup::session
+echo(kup::channel chan)
+{
+	std::size_t len;
+	while (void* data = co_await chan.receive(&len))
+		co_await chan.send(data, len);
+}
+
+struct producer {
+	std::vector<int>	chan_ids;
+	unsigned long		count = 0;
+};
+
+void
+produce(kuploop* loop, producer& p, std::size_t msg_size,
+		std::atomic<bool> const& stop)
+{
+	std::vector<char> msg(msg_size, 'k');
+	while (!stop.load(std::memory_order_relaxed)) {
+		for (int id : p.chan_ids)
+			if (kuploop_send(loop, msg.data(), msg.size(), id))
+				return;
+		for (int id : p.chan_ids)
+			if (kuploop_receive(loop, id) == nullptr)
+				return;
+		p.count += p.chan_ids.size();
+	}
+}
+
+} // namespace
+
+int
+main(int argc, char* argv[])
+{
+	int sessions = 1024, producers = 2, seconds = 2;
+	std::size_t msg_size = 64;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:k:m:t:")) != -1) {
+		switch (opt) {
+		case 'c': sessions = std::atoi(optarg); break;
+		case 'k': producers = std::atoi(optarg); break;
+		case 'm': msg_size = std::strtoul(optarg, nullptr, 10); break;
+		case 't': seconds = std::atoi(optarg); break;
+		default:
+			std::fprintf(stderr, "usage: %s [-c sessions] [-k producers] "
+					"[-m msg_size] [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (sessions < 1 || producers < 1 || producers > sessions ||
+			msg_size == 0 || msg_size > 4096) {
+		std::fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	kuploop* loop = kuploop_create(1, sessions);
+	void* handle = kuploop_open(loop);
+	kup::scheduler sched;
+	std::vector<producer> prod(producers);
+	for (int i = 0; i < sessions; i++) {
+		void* chan = kernproxy_channel(handle, i, 1);
+		if (chan == nullptr) {
+			std::fprintf(stderr, "Failed to attach channel %d\n", i);
+			return 1;
+		}
+		prod[i % producers].chan_ids.push_back(kuploop_wait_channel(loop));
+		echo(kup::channel(sched, handle, chan));
+	}
+
+	std::atomic<bool> stop{false};
+	std::vector<std::thread> threads;
+	auto start = std::chrono::steady_clock::now();
+	for (auto& p : prod)
+		threads.emplace_back(produce, loop, std::ref(p), msg_size,
+						std::cref(stop));
+	// Stop the producers after the deadline and shut the stand-in down,
+	// which ends every echo session and makes the scheduler return.
+	std::thread control([&] {
+		std::this_thread::sleep_for(std::chrono::seconds(seconds));
+		stop = true;
+		for (auto& t : threads)
+			t.join();
+		kuploop_unload(loop);
+	});
+	sched.run();
+	control.join();
+	std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+
+	unsigned long total = 0;
+	for (auto const& p : prod)
+		total += p.count;
+	std::printf("sessions: %d, producers: %d, message size: %zu\n",
+			sessions, producers, msg_size);
+	std::printf("%.0f msgs/s\n", total / elapsed.count());
+
+	kernproxy_close(handle);
+	kuploop_destroy(loop);
+	return 0;
+}
@@ -0,0 +1,782 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * Measures the data path of KUP against the user space stand-in for the
+ * kernel side (kuploop), next to pipes, UNIX domain sockets and a plain
+ * shared memory ping-pong that does what a channel does without kuplib. Each
+ * pair of threads plays the kernel side and the daemon side of one channel.
+ * KUP is measured with the daemon in blocking mode ("kup") and polling with
+ * KP_NB ("kup-nb"). Four tests are run:
+ *
+ *   l  round trip latency percentiles of 'msg_size' byte echoes
+ *   t  one way throughput against the message size; the daemon acknowledges
+ *      each message with one byte, except on pipes and sockets which stream
+ *   s  round trips per second against the number of channels, with two
+ *      threads per channel
+ *   m  round trips per second of 'max_channels' channels against the number
+ *      of daemon threads serving them; each daemon thread polls its share
+ *      of the channels in turn, so kup and kup-nb behave the same here
+ *
+ * usage: datapath_bench [-T tests] [-x transports] [-n rounds] [-d ms]
+ *                       [-m msg_size] [-S max_size] [-c max_channels]
+ *
+ *   -T tests         tests to run, any of "ltsm" (default all)
+ *   -x transports    comma separated transports to measure, out of
+ *                    kup,kup-nb,pipe,unix,shm (default all)
+ *   -n rounds        round trips per latency measurement (default 100000)
+ *   -d ms            length of each throughput and scaling run (default 1000)
+ *   -m msg_size      message size for latency and scaling (default 64)
+ *   -S max_size      largest message size of the throughput test (default 1M)
+ *   -c max_channels  largest channel count of the scaling test, and the
+ *                    channel count of the daemon thread test (default 8)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "../kup.h"
+#include "../kuploop.h"
+
+struct bench;
+
+struct server {
+	struct bench*		b;
+	pthread_t			thread;
+	// Serves the pairs from 'first' on, every 'server_cnt'th of them
+	size_t				first;
+};
+
+struct pair {
+	struct bench*		b;
+	pthread_t			kernel_thread;
+	pthread_t			daemon_thread;
+	// kup: channel id on the stand-in and the channel of the daemon
+	int					chan_id;
+	void*				channel;
+	// pipe and unix: read and write ends of either side
+	int					kfd[2];
+	int					dfd[2];
+	uint8_t*			kbuf;
+	uint8_t*			dbuf;
+	// shm
+	struct shm_chan*	shm;
+	size_t				shm_bytes;
+	// Messages sent by the kernel side, and their round trip times
+	uint64_t			msgs;
+	uint64_t*			rtt;
+	// Set by daemon_poll once the kernel side is done
+	int					closed;
+};
+
+struct transport {
+	const char*	name;
+	// Whether a message can be sent before the previous one is consumed
+	int			streams;
+	int			(*setup)(struct bench* b);
+	// Stops the daemon side threads, waits for them and frees everything
+	void		(*teardown)(struct bench* b);
+	int			(*kernel_send)(struct pair* p, void* data, size_t len);
+	void*		(*kernel_receive)(struct pair* p, size_t len);
+	void*		(*daemon_receive)(struct pair* p, size_t len);
+	// Like daemon_receive but returns NULL if no message is there yet, and
+	// sets 'closed' if none will ever be
+	void*		(*daemon_poll)(struct pair* p, size_t len);
+	int			(*daemon_send)(struct pair* p, void* data, size_t len);
+};
+
+struct bench {
+	struct transport*	t;
+	struct pair*		pairs;
+	size_t				pair_cnt;
+	size_t				size;
+	// Echo every message, or acknowledge it with a single byte
+	int					oneway;
+	// Round trips per pair, or 0 to run until 'stop' is set
+	uint64_t			rounds;
+	atomic_int			stop;
+	// Daemon threads shared by the pairs, or none for one per pair
+	struct server*		servers;
+	size_t				server_cnt;
+	struct kuploop*		loop;
+	void*				handle;
+};
+
+static long page_size;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline void
+spin_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+static void
+join_daemons(struct bench* b)
+{
+	for (size_t i = 0; i < b->server_cnt; i++)
+		pthread_join(b->servers[i].thread, NULL);
+	for (size_t i = 0; b->server_cnt == 0 && i < b->pair_cnt; i++)
+		pthread_join(b->pairs[i].daemon_thread, NULL);
+}
+
+/* KUP over the user space stand-in */
+
+static int
+kup_setup(struct bench* b)
+{
+	size_t pages = (b->size + page_size - 1) / page_size;
+	void** chans = calloc(b->pair_cnt, sizeof(void*));
+
+	b->loop = kuploop_create(pages, b->pair_cnt);
+	b->handle = b->loop ? kuploop_open(b->loop) : NULL;
+	if (b->handle == NULL ||
+			kernproxy_channels(b->handle, 0, b->pair_cnt, pages, chans)) {
+		free(chans);
+		return (-1);
+	}
+	for (size_t i = 0; i < b->pair_cnt; i++) {
+		int chan_id = kuploop_wait_channel(b->loop);
+		b->pairs[chan_id].chan_id = chan_id;
+		b->pairs[chan_id].channel = chans[chan_id];
+	}
+	free(chans);
+	return (0);
+}
+
+static void
+kup_teardown(struct bench* b)
+{
+	kuploop_unload(b->loop);
+	join_daemons(b);
+	kernproxy_close(b->handle);
+	kuploop_destroy(b->loop);
+}
+
+static int
+kup_kernel_send(struct pair* p, void* data, size_t len)
+{
+	return kuploop_send(p->b->loop, data, len, p->chan_id);
+}
+
+static void*
+kup_kernel_receive(struct pair* p, size_t len)
+{
+	return kuploop_receive(p->b->loop, p->chan_id);
+}
+
+static void*
+kup_daemon_receive(struct pair* p, size_t len)
+{
+	return kernproxy_receive(p->channel, 0);
+}
+
+static void*
+kup_daemon_receive_nb(struct pair* p, size_t len)
+{
+	void* data;
+
+	while ((data = kernproxy_receive(p->channel, KP_NB)) == NULL) {
+		if (kernproxy_error(p->b->handle) != EKU_NOTREADY)
+			return (NULL);
+		spin_pause();
+	}
+	return (data);
+}
+
+static void*
+kup_daemon_poll(struct pair* p, size_t len)
+{
+	void* data = kernproxy_receive(p->channel, KP_NB);
+
+	if (data == NULL && kernproxy_error(p->b->handle) != EKU_NOTREADY)
+		p->closed = 1;
+	return (data);
+}
+
+static int
+kup_daemon_send(struct pair* p, void* data, size_t len)
+{
+	return kernproxy_send(p->channel, data, len, 0);
+}
+
+/* Pipes and UNIX domain sockets */
+
+static int
+fd_write(int fd, const void* data, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n <= 0)
+			return (-1);
+		data = (const uint8_t*)data + n;
+		len -= n;
+	}
+	return (0);
+}
+
+static void*
+fd_read(int fd, uint8_t* buf, size_t len)
+{
+	for (size_t done = 0; done < len;) {
+		ssize_t n = read(fd, buf + done, len - done);
+		if (n <= 0)
+			return (NULL);
+		done += n;
+	}
+	return (buf);
+}
+
+static int
+pipe_setup(struct bench* b)
+{
+	for (size_t i = 0; i < b->pair_cnt; i++) {
+		struct pair* p = &b->pairs[i];
+		int down[2], up[2];
+		if (pipe(down) || pipe(up))
+			return (-1);
+		p->dfd[0] = down[0];
+		p->kfd[1] = down[1];
+		p->kfd[0] = up[0];
+		p->dfd[1] = up[1];
+		p->kbuf = malloc(b->size);
+		p->dbuf = malloc(b->size);
+	}
+	return (0);
+}
+
+static int
+unix_setup(struct bench* b)
+{
+	for (size_t i = 0; i < b->pair_cnt; i++) {
+		struct pair* p = &b->pairs[i];
+		int sv[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+			return (-1);
+		p->kfd[0] = p->kfd[1] = sv[0];
+		p->dfd[0] = p->dfd[1] = sv[1];
+		p->kbuf = malloc(b->size);
+		p->dbuf = malloc(b->size);
+	}
+	return (0);
+}
+
+static void
+fd_teardown(struct bench* b)
+{
+	// The daemon side reads end of file once the kernel side stops writing.
+	for (size_t i = 0; i < b->pair_cnt; i++) {
+		struct pair* p = &b->pairs[i];
+		if (p->kfd[0] == p->kfd[1])
+			shutdown(p->kfd[1], SHUT_WR);
+		else
+			close(p->kfd[1]);
+	}
+	join_daemons(b);
+	for (size_t i = 0; i < b->pair_cnt; i++) {
+		struct pair* p = &b->pairs[i];
+		close(p->kfd[0]);
+		close(p->dfd[0]);
+		if (p->dfd[1] != p->dfd[0])
+			close(p->dfd[1]);
+		free(p->kbuf);
+		free(p->dbuf);
+	}
+}
+
+static int
+fd_kernel_send(struct pair* p, void* data, size_t len)
+{
+	return fd_write(p->kfd[1], data, len);
+}
+
+static void*
+fd_kernel_receive(struct pair* p, size_t len)
+{
+	return fd_read(p->kfd[0], p->kbuf, len);
+}
+
+static void*
+fd_daemon_receive(struct pair* p, size_t len)
+{
+	return fd_read(p->dfd[0], p->dbuf, len);
+}
+
+static void*
+fd_daemon_poll(struct pair* p, size_t len)
+{
+	struct pollfd pfd = { .fd = p->dfd[0], .events = POLLIN };
+	void* data;
+
+	if (poll(&pfd, 1, 0) != 1)
+		return (NULL);
+	// End of file is readable too, and fails the read.
+	if ((data = fd_read(p->dfd[0], p->dbuf, len)) == NULL)
+		p->closed = 1;
+	return (data);
+}
+
+static int
+fd_daemon_send(struct pair* p, void* data, size_t len)
+{
+	return fd_write(p->dfd[1], data, len);
+}
+
+/* Plain shared memory, turn word and message area per direction */
+
+enum { SHM_KERNEL, SHM_DAEMON, SHM_STOPPED };
+
+struct shm_chan {
+	atomic_int	turn;
+	uint32_t	len;
+	uint8_t		pad[56];
+};
+
+static uint8_t*
+shm_area(struct pair* p, int to)
+{
+	size_t half = (p->shm_bytes - page_size) / 2;
+	return ((uint8_t*)p->shm + page_size + (to == SHM_DAEMON ? 0 : half));
+}
+
+static int
+shm_setup(struct bench* b)
+{
+	size_t half = (b->size + page_size - 1) / page_size * page_size;
+
+	for (size_t i = 0; i < b->pair_cnt; i++) {
+		struct pair* p = &b->pairs[i];
+		p->shm_bytes = page_size + 2 * half;
+		p->shm = mmap(NULL, p->shm_bytes, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+		if (p->shm == MAP_FAILED)
+			return (-1);
+		atomic_store(&p->shm->turn, SHM_KERNEL);
+	}
+	return (0);
+}
+
+static void
+shm_teardown(struct bench* b)
+{
+	for (size_t i = 0; i < b->pair_cnt; i++)
+		atomic_store(&b->pairs[i].shm->turn, SHM_STOPPED);
+	join_daemons(b);
+	for (size_t i = 0; i < b->pair_cnt; i++)
+		munmap(b->pairs[i].shm, b->pairs[i].shm_bytes);
+}
+
+static int
+shm_send(struct pair* p, int to, void* data, size_t len)
+{
+	memcpy(shm_area(p, to), data, len);
+	p->shm->len = len;
+	atomic_store_explicit(&p->shm->turn, to, memory_order_release);
+	return (0);
+}
+
+static void*
+shm_receive(struct pair* p, int me)
+{
+	int turn;
+
+	while ((turn = atomic_load_explicit(&p->shm->turn,
+					memory_order_acquire)) != me) {
+		if (turn == SHM_STOPPED)
+			return (NULL);
+		spin_pause();
+	}
+	return (shm_area(p, me));
+}
+
+static int
+shm_kernel_send(struct pair* p, void* data, size_t len)
+{
+	return shm_send(p, SHM_DAEMON, data, len);
+}
+
+static void*
+shm_kernel_receive(struct pair* p, size_t len)
+{
+	return shm_receive(p, SHM_KERNEL);
+}
+
+static void*
+shm_daemon_receive(struct pair* p, size_t len)
+{
+	return shm_receive(p, SHM_DAEMON);
+}
+
+static void*
+shm_daemon_poll(struct pair* p, size_t len)
+{
+	int turn = atomic_load_explicit(&p->shm->turn, memory_order_acquire);
+
+	if (turn == SHM_STOPPED)
+		p->closed = 1;
+	return (turn == SHM_DAEMON ? shm_area(p, SHM_DAEMON) : NULL);
+}
+
+static int
+shm_daemon_send(struct pair* p, void* data, size_t len)
+{
+	return shm_send(p, SHM_KERNEL, data, len);
+}
+
+static struct transport transports[] = {
+	{ "kup", 0, kup_setup, kup_teardown, kup_kernel_send,
+		kup_kernel_receive, kup_daemon_receive, kup_daemon_poll,
+		kup_daemon_send },
+	{ "kup-nb", 0, kup_setup, kup_teardown, kup_kernel_send,
+		kup_kernel_receive, kup_daemon_receive_nb, kup_daemon_poll,
+		kup_daemon_send },
+	{ "pipe", 1, pipe_setup, fd_teardown, fd_kernel_send,
+		fd_kernel_receive, fd_daemon_receive, fd_daemon_poll,
+		fd_daemon_send },
+	{ "unix", 1, unix_setup, fd_teardown, fd_kernel_send,
+		fd_kernel_receive, fd_daemon_receive, fd_daemon_poll,
+		fd_daemon_send },
+	{ "shm", 0, shm_setup, shm_teardown, shm_kernel_send,
+		shm_kernel_receive, shm_daemon_receive, shm_daemon_poll,
+		shm_daemon_send },
+};
+#define TRANSPORT_CNT	(sizeof(transports) / sizeof(transports[0]))
+
+static void*
+kernel_main(void* arg)
+{
+	struct pair* p = arg;
+	struct bench* b = p->b;
+	struct transport* t = b->t;
+	uint8_t* msg = malloc(b->size);
+	int acked = !b->oneway || !t->streams;
+
+	memset(msg, 'k', b->size);
+	while (b->rounds ? p->msgs < b->rounds :
+			!atomic_load_explicit(&b->stop, memory_order_relaxed)) {
+		uint64_t start = p->rtt ? now() : 0;
+		if (t->kernel_send(p, msg, b->size) ||
+				(acked && t->kernel_receive(p, b->oneway ? 1 : b->size) ==
+				 NULL)) {
+			fprintf(stderr, "%s: the kernel side failed\n", t->name);
+			exit(1);
+		}
+		if (p->rtt)
+			p->rtt[p->msgs] = now() - start;
+		p->msgs++;
+	}
+	free(msg);
+	return (NULL);
+}
+
+static void
+daemon_reply(struct pair* p, void* data)
+{
+	struct bench* b = p->b;
+
+	if (!b->oneway)
+		b->t->daemon_send(p, data, b->size);
+	else if (!b->t->streams)
+		b->t->daemon_send(p, "", 1);
+}
+
+static void*
+daemon_main(void* arg)
+{
+	struct pair* p = arg;
+	void* data;
+
+	while ((data = p->b->t->daemon_receive(p, p->b->size)) != NULL)
+		daemon_reply(p, data);
+	return (NULL);
+}
+
+static void*
+server_main(void* arg)
+{
+	struct server* s = arg;
+	struct bench* b = s->b;
+	size_t open = 0;
+
+	for (size_t i = s->first; i < b->pair_cnt; i += b->server_cnt)
+		open++;
+	while (open > 0) {
+		int idle = 1;
+		for (size_t i = s->first; i < b->pair_cnt; i += b->server_cnt) {
+			struct pair* p = &b->pairs[i];
+			void* data;
+			if (p->closed)
+				continue;
+			if ((data = b->t->daemon_poll(p, b->size)) != NULL) {
+				daemon_reply(p, data);
+				idle = 0;
+			} else if (p->closed) {
+				open--;
+			}
+		}
+		if (idle)
+			spin_pause();
+	}
+	return (NULL);
+}
+
+/**
+ * Runs 't' with 'pair_cnt' pairs of threads exchanging 'size' byte messages,
+ * for 'rounds' round trips per pair or for 'ms' milliseconds. The daemon
+ * sides of the pairs are shared by 'server_cnt' threads, unless it is 0.
+ * Returns the number of messages sent per second, and stores the round trip
+ * times in 'rtt' if it is not NULL.
+ */
+static double
+run(struct transport* t, size_t pair_cnt, size_t server_cnt, size_t size,
+		int oneway, uint64_t rounds, int ms, uint64_t* rtt)
+{
+	struct bench b = {
+		.t = t, .pair_cnt = pair_cnt, .size = size, .oneway = oneway,
+		.rounds = rounds, .server_cnt = server_cnt
+	};
+	uint64_t msgs = 0;
+
+	b.pairs = calloc(pair_cnt, sizeof(*b.pairs));
+	for (size_t i = 0; i < pair_cnt; i++) {
+		b.pairs[i].b = &b;
+		if (rtt)
+			b.pairs[i].rtt = rtt + i * rounds;
+	}
+	if (t->setup(&b)) {
+		fprintf(stderr, "%s: setup failed\n", t->name);
+		exit(1);
+	}
+	b.servers = calloc(server_cnt, sizeof(*b.servers));
+	for (size_t i = 0; i < server_cnt; i++) {
+		b.servers[i].b = &b;
+		b.servers[i].first = i;
+		pthread_create(&b.servers[i].thread, NULL, server_main,
+				&b.servers[i]);
+	}
+	for (size_t i = 0; server_cnt == 0 && i < pair_cnt; i++)
+		pthread_create(&b.pairs[i].daemon_thread, NULL, daemon_main,
+				&b.pairs[i]);
+
+	uint64_t start = now();
+	for (size_t i = 0; i < pair_cnt; i++)
+		pthread_create(&b.pairs[i].kernel_thread, NULL, kernel_main,
+				&b.pairs[i]);
+	if (!rounds) {
+		struct timespec ts = {
+			.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L
+		};
+		nanosleep(&ts, NULL);
+		atomic_store(&b.stop, 1);
+	}
+	for (size_t i = 0; i < pair_cnt; i++) {
+		pthread_join(b.pairs[i].kernel_thread, NULL);
+		msgs += b.pairs[i].msgs;
+	}
+	double elapsed = (now() - start) / 1e9;
+
+	t->teardown(&b);
+	free(b.servers);
+	free(b.pairs);
+	return (msgs / elapsed);
+}
+
+static int
+compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(const uint64_t* sorted, size_t cnt, double p)
+{
+	if (cnt == 0)
+		return 0;
+	return sorted[(size_t)(p / 100 * (cnt - 1))] / 1e3;
+}
+
+static size_t
+parse_size(const char* s)
+{
+	char* end;
+	size_t size = strtoul(s, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K': return (size << 10);
+	case 'm': case 'M': return (size << 20);
+	default: return (size);
+	}
+}
+
+static void
+print_header(const char* first, struct transport** sel, size_t sel_cnt)
+{
+	printf("%10s", first);
+	for (size_t i = 0; i < sel_cnt; i++)
+		printf(" %12s", sel[i]->name);
+	printf("\n");
+}
+
+int
+main(int argc, char* argv[])
+{
+	const char* tests = "ltsm";
+	char* only = NULL;
+	uint64_t rounds = 100000;
+	size_t msg_size = 64, max_size = 1 << 20, max_chans = 8;
+	struct transport* sel[TRANSPORT_CNT];
+	size_t sel_cnt = 0;
+	int ms = 1000, opt;
+
+	while ((opt = getopt(argc, argv, "T:x:n:d:m:S:c:")) != -1) {
+		switch (opt) {
+		case 'T': tests = optarg; break;
+		case 'x': only = optarg; break;
+		case 'n': rounds = strtoull(optarg, NULL, 10); break;
+		case 'd': ms = atoi(optarg); break;
+		case 'm': msg_size = parse_size(optarg); break;
+		case 'S': max_size = parse_size(optarg); break;
+		case 'c': max_chans = strtoul(optarg, NULL, 10); break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || rounds < 1 || ms < 1 || msg_size < 1 ||
+			max_size < 1 || max_chans < 1)
+		goto usage;
+
+	for (size_t i = 0; i < TRANSPORT_CNT; i++) {
+		if (only) {
+			const char* s = strstr(only, transports[i].name);
+			size_t len = strlen(transports[i].name);
+			// Match whole names only, "kup" is a prefix of "kup-nb".
+			while (s && ((s != only && s[-1] != ',') ||
+						(s[len] != '\0' && s[len] != ',')))
+				s = strstr(s + 1, transports[i].name);
+			if (s == NULL)
+				continue;
+		}
+		sel[sel_cnt++] = &transports[i];
+	}
+	if (sel_cnt == 0)
+		goto usage;
+	page_size = sysconf(_SC_PAGESIZE);
+	// Everything but pipes and sockets spins on the turn, and needs a CPU
+	// for each thread to give meaningful numbers.
+	printf("cpus: %ld\n\n", sysconf(_SC_NPROCESSORS_ONLN));
+
+	if (strchr(tests, 'l')) {
+		uint64_t* rtt = calloc(rounds, sizeof(*rtt));
+		printf("latency: %zu byte round trips, %ju per transport, us\n",
+				msg_size, (uintmax_t)rounds);
+		printf("%10s %10s %10s %10s %10s\n", "transport", "p50", "p99",
+				"p99.9", "max");
+		for (size_t i = 0; i < sel_cnt; i++) {
+			run(sel[i], 1, 0, msg_size, 0, rounds, 0, rtt);
+			qsort(rtt, rounds, sizeof(*rtt), compare_u64);
+			printf("%10s %10.2f %10.2f %10.2f %10.2f\n", sel[i]->name,
+					percentile(rtt, rounds, 50), percentile(rtt, rounds, 99),
+					percentile(rtt, rounds, 99.9),
+					percentile(rtt, rounds, 100));
+			fflush(stdout);
+		}
+		free(rtt);
+	}
+
+	if (strchr(tests, 't')) {
+		printf("\nthroughput: one way, %d ms per size, MB/s\n", ms);
+		print_header("size", sel, sel_cnt);
+		for (size_t size = 64; size <= max_size; size *= 4) {
+			printf("%10zu", size);
+			for (size_t i = 0; i < sel_cnt; i++)
+				printf(" %12.1f", run(sel[i], 1, 0, size, 1, 0, ms, NULL) *
+						size / 1e6);
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+
+	if (strchr(tests, 's')) {
+		printf("\nscaling: %zu byte round trips, two threads per channel, "
+				"%d ms per count, msgs/s\n", msg_size, ms);
+		print_header("channels", sel, sel_cnt);
+		for (size_t chans = 1; chans <= max_chans; chans *= 2) {
+			printf("%10zu", chans);
+			for (size_t i = 0; i < sel_cnt; i++)
+				printf(" %12.0f", run(sel[i], chans, 0, msg_size, 0, 0, ms,
+							NULL));
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+
+	if (strchr(tests, 'm')) {
+		printf("\nthreads: %zu byte round trips on %zu channels, %d ms per "
+				"count, msgs/s\n", msg_size, max_chans, ms);
+		print_header("threads", sel, sel_cnt);
+		for (size_t threads = 1; threads <= max_chans; threads *= 2) {
+			printf("%10zu", threads);
+			for (size_t i = 0; i < sel_cnt; i++)
+				printf(" %12.0f", run(sel[i], max_chans, threads, msg_size,
+							0, 0, ms, NULL));
+			printf("\n");
+			fflush(stdout);
+		}
+	}
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-T tests] [-x transports] [-n rounds] "
+			"[-d ms] [-m msg_size] [-S max_size] [-c max_channels]\n",
+			argv[0]);
+	return 1;
+}
@@ -0,0 +1,200 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * Measures the throughput of the kuplib dispatch engine against the number
+ * of poller and worker threads. The kernel side is played by the user space
+ * stand-in (kuploop), with a number of producer threads each keeping one
+ * message in flight on every channel it owns. The engine answers every
+ * message with an echo of it.
+ *
+ * usage: engine_bench [-c channels] [-k producers] [-m msg_size]
+ *                     [-P max_pollers] [-W max_workers] [-t seconds]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "../kup.h"
+#include "../kup_engine.h"
+#include "../kuploop.h"
+
+struct producer {
+	pthread_t		thread;
+	struct kuploop*	loop;
+	int*			chan_ids;
+	int				chan_cnt;
+	size_t			msg_size;
+	atomic_int*		stop;
+	unsigned long	count;
+};
+
+static int
+echo(void* arg, void* channel, void* data, size_t len, void* reply,
+		size_t reply_size)
+{
+	if (len > reply_size)
+		len = reply_size;
+	memcpy(reply, data, len);
+	return (int)len;
+}
+
+static void*
+producer_main(void* arg)
+{
+	struct producer* p = arg;
+	char msg[4096];
+
+	memset(msg, 'k', sizeof(msg));
+	while (!atomic_load_explicit(p->stop, memory_order_relaxed)) {
+		for (int i = 0; i < p->chan_cnt; i++)
+			if (kuploop_send(p->loop, msg, p->msg_size, p->chan_ids[i]))
+				return (NULL);
+		for (int i = 0; i < p->chan_cnt; i++)
+			if (kuploop_receive(p->loop, p->chan_ids[i]) == NULL)
+				return (NULL);
+		p->count += p->chan_cnt;
+	}
+	return (NULL);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+run(int channels, int producers, size_t msg_size, int pollers, int workers,
+		int seconds)
+{
+	struct kuploop* loop = kuploop_create(1, channels);
+	void* handle = kuploop_open(loop);
+	struct kernproxy_engine_conf conf = {
+		.pollers = pollers,
+		.workers = workers,
+		.poller_cpus = NULL,
+		.max_channels = channels,
+	};
+	void* engine = kernproxy_engine_create(&conf, echo, NULL);
+	struct producer* prod = calloc(producers, sizeof(*prod));
+	atomic_int stop = 0;
+
+	for (int i = 0; i < producers; i++) {
+		prod[i].loop = loop;
+		prod[i].chan_ids = calloc(channels, sizeof(int));
+		prod[i].msg_size = msg_size;
+		prod[i].stop = &stop;
+	}
+	for (int i = 0; i < channels; i++) {
+		void* channel = kernproxy_channel(handle, i, 1);
+		if (channel == NULL) {
+			fprintf(stderr, "Failed to attach channel %d\n", i);
+			exit(1);
+		}
+		kernproxy_engine_add(engine, channel);
+		struct producer* p = &prod[i % producers];
+		p->chan_ids[p->chan_cnt++] = kuploop_wait_channel(loop);
+	}
+
+	kernproxy_engine_start(engine);
+	double start = now();
+	for (int i = 0; i < producers; i++)
+		pthread_create(&prod[i].thread, NULL, producer_main, &prod[i]);
+	sleep(seconds);
+	atomic_store(&stop, 1);
+	unsigned long total = 0;
+	for (int i = 0; i < producers; i++) {
+		pthread_join(prod[i].thread, NULL);
+		total += prod[i].count;
+	}
+	double elapsed = now() - start;
+
+	kernproxy_engine_stop(engine);
+	kernproxy_engine_destroy(engine);
+	kuploop_unload(loop);
+	kernproxy_close(handle);
+	kuploop_destroy(loop);
+	for (int i = 0; i < producers; i++)
+		free(prod[i].chan_ids);
+	free(prod);
+	return total / elapsed;
+}
+
+int
+main(int argc, char* argv[])
+{
+	int channels = 64, producers = 2, max_pollers = 2, max_workers = 4;
+	int seconds = 1;
+	size_t msg_size = 64;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:k:m:P:W:t:")) != -1) {
+		switch (opt) {
+		case 'c': channels = atoi(optarg); break;
+		case 'k': producers = atoi(optarg); break;
+		case 'm': msg_size = strtoul(optarg, NULL, 10); break;
+		case 'P': max_pollers = atoi(optarg); break;
+		case 'W': max_workers = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-c channels] [-k producers] "
+					"[-m msg_size] [-P max_pollers] [-W max_workers] "
+					"[-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (channels < 1 || producers < 1 || producers > channels ||
+			max_pollers < 1 || max_workers < 0 || msg_size > 4096) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	printf("channels: %d, producers: %d, message size: %zu\n",
+			channels, producers, msg_size);
+	printf("%8s %8s %14s\n", "pollers", "workers", "msgs/s");
+	for (int p = 1; p <= max_pollers; p++) {
+		for (int w = 0; w <= max_workers; w = w ? w * 2 : 1) {
+			double rate = run(channels, producers, msg_size, p, w, seconds);
+			printf("%8d %8d %14.0f\n", p, w, rate);
+			fflush(stdout);
+		}
+	}
+	return 0;
+}
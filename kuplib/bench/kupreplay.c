@@ -0,0 +1,299 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * Replays a traffic log recorded with kernproxy_capture() against the user
+ * space stand-in for the kernel side (kuploop). One thread per channel plays
+ * the kernel side, sending the captured messages of the kernel at their
+ * original times, scaled by the speed factor, and waiting for the reply. One
+ * thread per channel plays the daemon, answering each message with the next
+ * captured reply of the daemon on that channel. Reports the throughput, the
+ * round trip latencies and how far the replay fell behind the schedule.
+ *
+ * usage: kupreplay [-s speed | -f] capture_file
+ *
+ *   -s speed  replay 'speed' times faster than captured (default 1)
+ *   -f        replay as fast as possible, ignoring the captured times
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../kup.h"
+#include "../kuploop.h"
+#include "../kup_capture.h"
+
+struct replay_channel {
+	int									index;
+	void*								channel;
+	struct kuploop*						loop;
+	pthread_t							kernel_thread;
+	pthread_t							daemon_thread;
+	// Captured messages of either side, in the order they were captured
+	const struct kup_capture_record**	in;
+	size_t								in_cnt;
+	const struct kup_capture_record**	out;
+	size_t								out_cnt;
+	// Round trip time of each replayed message, in nanoseconds
+	uint64_t*							rtt;
+	// Largest delay of a message behind its scheduled time
+	uint64_t							behind;
+	uint64_t							bytes;
+};
+
+static double speed = 1;
+static int flat_out;
+static uint64_t replay_start;
+
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+sleep_until(uint64_t when)
+{
+	struct timespec ts = {
+		.tv_sec = when / 1000000000,
+		.tv_nsec = when % 1000000000
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+		;
+}
+
+static void*
+kernel_main(void* arg)
+{
+	struct replay_channel* rc = arg;
+
+	for (size_t i = 0; i < rc->in_cnt; i++) {
+		const struct kup_capture_record* rec = rc->in[i];
+		uint64_t sent;
+		if (!flat_out) {
+			uint64_t when = replay_start + (uint64_t)(rec->kr_time / speed);
+			if (now() < when)
+				sleep_until(when);
+			sent = now();
+			if (sent - when > rc->behind)
+				rc->behind = sent - when;
+		} else
+			sent = now();
+		if (kuploop_send(rc->loop, (void*)(rec + 1), rec->kr_len,
+					rc->index)) {
+			fprintf(stderr, "Send failed on channel %d\n", rc->index);
+			exit(1);
+		}
+		if (kuploop_receive(rc->loop, rc->index) == NULL) {
+			fprintf(stderr, "Receive failed on channel %d\n", rc->index);
+			exit(1);
+		}
+		rc->rtt[i] = now() - sent;
+		rc->bytes += rec->kr_len;
+	}
+	return (NULL);
+}
+
+static void*
+daemon_main(void* arg)
+{
+	struct replay_channel* rc = arg;
+	size_t next = 0;
+
+	while (kernproxy_receive(rc->channel, 0) != NULL) {
+		if (next < rc->out_cnt) {
+			const struct kup_capture_record* rec = rc->out[next++];
+			kernproxy_send(rc->channel, (void*)(rec + 1), rec->kr_len, 0);
+		} else
+			kernproxy_send(rc->channel, "", 0, 0);
+	}
+	return (NULL);
+}
+
+static int
+compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(const uint64_t* sorted, size_t cnt, double p)
+{
+	if (cnt == 0)
+		return 0;
+	return sorted[(size_t)(p / 100 * (cnt - 1))] / 1e3;
+}
+
+int
+main(int argc, char* argv[])
+{
+	const struct kup_capture_header* hdr;
+	const uint8_t *rec_start, *p, *end;
+	struct replay_channel* rcs;
+	struct stat st;
+	size_t channels = 0, total_in = 0, total_out = 0;
+	uint64_t captured_span = 0;
+	int opt, fd;
+
+	while ((opt = getopt(argc, argv, "s:f")) != -1) {
+		switch (opt) {
+		case 's': speed = atof(optarg); break;
+		case 'f': flat_out = 1; break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1 || speed <= 0)
+		goto usage;
+
+	fd = open(argv[optind], O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(*hdr)) {
+		fprintf(stderr, "Cannot read '%s'\n", argv[optind]);
+		return 1;
+	}
+	hdr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (hdr == MAP_FAILED || hdr->kc_magic != KUP_CAPTURE_MAGIC ||
+			hdr->kc_version != KUP_CAPTURE_VERSION ||
+			sizeof(*hdr) + hdr->kc_length > (size_t)st.st_size) {
+		fprintf(stderr, "'%s' is not a KUP capture\n", argv[optind]);
+		return 1;
+	}
+	rec_start = (const uint8_t*)(hdr + 1);
+	end = rec_start + hdr->kc_length;
+
+	// Size the per channel lists of messages.
+	for (p = rec_start; p < end;) {
+		const struct kup_capture_record* rec = (const void*)p;
+		if ((size_t)rec->kr_channel >= channels)
+			channels = rec->kr_channel + 1;
+		p += KUP_CAPTURE_RECORD_SIZE(rec->kr_len);
+	}
+	if (channels == 0) {
+		fprintf(stderr, "The capture is empty\n");
+		return 1;
+	}
+	rcs = calloc(channels, sizeof(*rcs));
+	for (p = rec_start; p < end;) {
+		const struct kup_capture_record* rec = (const void*)p;
+		if (rec->kr_dir == KUP_CAPTURE_IN)
+			rcs[rec->kr_channel].in_cnt++;
+		else
+			rcs[rec->kr_channel].out_cnt++;
+		captured_span = rec->kr_time;
+		p += KUP_CAPTURE_RECORD_SIZE(rec->kr_len);
+	}
+	for (size_t i = 0; i < channels; i++) {
+		rcs[i].index = i;
+		rcs[i].in = calloc(rcs[i].in_cnt + 1, sizeof(*rcs[i].in));
+		rcs[i].out = calloc(rcs[i].out_cnt + 1, sizeof(*rcs[i].out));
+		rcs[i].rtt = calloc(rcs[i].in_cnt + 1, sizeof(*rcs[i].rtt));
+		total_in += rcs[i].in_cnt;
+		total_out += rcs[i].out_cnt;
+		rcs[i].in_cnt = rcs[i].out_cnt = 0;
+	}
+	for (p = rec_start; p < end;) {
+		const struct kup_capture_record* rec = (const void*)p;
+		struct replay_channel* rc = &rcs[rec->kr_channel];
+		if (rec->kr_dir == KUP_CAPTURE_IN)
+			rc->in[rc->in_cnt++] = rec;
+		else
+			rc->out[rc->out_cnt++] = rec;
+		p += KUP_CAPTURE_RECORD_SIZE(rec->kr_len);
+	}
+
+	struct kuploop* loop = kuploop_create_asym(hdr->kc_size, hdr->kc_rsize,
+			channels);
+	void* handle = loop ? kuploop_open(loop) : NULL;
+	void** chans = calloc(channels, sizeof(void*));
+	if (handle == NULL ||
+			kernproxy_channels(handle, 0, channels, hdr->kc_size, chans)) {
+		fprintf(stderr, "Failed to set up the stand-in\n");
+		return 1;
+	}
+	for (size_t i = 0; i < channels; i++) {
+		int chan_id = kuploop_wait_channel(loop);
+		rcs[chan_id].channel = chans[chan_id];
+		rcs[chan_id].loop = loop;
+		pthread_create(&rcs[chan_id].daemon_thread, NULL, daemon_main,
+				&rcs[chan_id]);
+	}
+
+	printf("capture: %zu channels, %zu messages in, %zu out, %zu dropped, "
+			"%.3f s\n", channels, total_in, total_out,
+			(size_t)hdr->kc_dropped, captured_span / 1e9);
+	replay_start = now();
+	for (size_t i = 0; i < channels; i++)
+		pthread_create(&rcs[i].kernel_thread, NULL, kernel_main, &rcs[i]);
+	for (size_t i = 0; i < channels; i++)
+		pthread_join(rcs[i].kernel_thread, NULL);
+	double elapsed = (now() - replay_start) / 1e9;
+
+	kuploop_unload(loop);
+	uint64_t* rtt = calloc(total_in + 1, sizeof(*rtt));
+	uint64_t behind = 0, bytes = 0;
+	size_t n = 0;
+	for (size_t i = 0; i < channels; i++) {
+		pthread_join(rcs[i].daemon_thread, NULL);
+		memcpy(rtt + n, rcs[i].rtt, rcs[i].in_cnt * sizeof(*rtt));
+		n += rcs[i].in_cnt;
+		bytes += rcs[i].bytes;
+		if (rcs[i].behind > behind)
+			behind = rcs[i].behind;
+	}
+	qsort(rtt, n, sizeof(*rtt), compare_u64);
+
+	printf("replay:  %.3f s, %.0f msgs/s, %.1f MB/s\n", elapsed,
+			n / elapsed, bytes / elapsed / 1e6);
+	printf("rtt us:  p50 %.2f  p99 %.2f  p99.9 %.2f  max %.2f\n",
+			percentile(rtt, n, 50), percentile(rtt, n, 99),
+			percentile(rtt, n, 99.9), percentile(rtt, n, 100));
+	if (!flat_out)
+		printf("behind:  max %.2f us\n", behind / 1e3);
+
+	kernproxy_close(handle);
+	kuploop_destroy(loop);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-s speed | -f] capture_file\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,168 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * Compares sending on fixed channels with kuploop_send_any() when the daemon
+ * threads consuming the channels run at different speeds. The kernel side is
+ * played by the user space stand-in (kuploop). One producer thread sends
+ * messages round robin over the channels, or to whichever channel is idle,
+ * and one daemon thread per channel acknowledges each message after a
+ * simulated amount of work. The first 'slow' channels take 'skew' times
+ * longer per message than the others.
+ *
+ * usage: skew_bench [-c channels] [-s slow_channels] [-x skew]
+ *                   [-w work] [-t seconds]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "../kup.h"
+#include "../kuploop.h"
+
+struct consumer {
+	pthread_t		thread;
+	void*			channel;
+	unsigned long	work;
+	unsigned long	count;
+};
+
+static void*
+consumer_main(void* arg)
+{
+	struct consumer* c = arg;
+	volatile unsigned long sink = 0;
+
+	while (kernproxy_receive(c->channel, 0) != NULL) {
+		for (unsigned long i = 0; i < c->work; i++)
+			sink += i;
+		c->count++;
+		kernproxy_send(c->channel, "", 1, 0);
+	}
+	return (NULL);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double
+run(int channels, int slow, unsigned long skew, unsigned long work,
+		int seconds, int any)
+{
+	struct kuploop* loop = kuploop_create(1, channels);
+	void* handle = kuploop_open(loop);
+	struct consumer* cons = calloc(channels, sizeof(*cons));
+	int* chan_ids = calloc(channels, sizeof(int));
+	char msg[64];
+	unsigned long sent = 0;
+
+	memset(msg, 'k', sizeof(msg));
+	for (int i = 0; i < channels; i++) {
+		cons[i].channel = kernproxy_channel(handle, i, 1);
+		if (cons[i].channel == NULL) {
+			fprintf(stderr, "Failed to attach channel %d\n", i);
+			exit(1);
+		}
+		cons[i].work = i < slow ? work * skew : work;
+		chan_ids[i] = kuploop_wait_channel(loop);
+		pthread_create(&cons[i].thread, NULL, consumer_main, &cons[i]);
+	}
+
+	double start = now(), end = start + seconds;
+	while (now() < end) {
+		for (int i = 0; i < channels; i++) {
+			int error = any ? kuploop_send_any(loop, msg, sizeof(msg)) < 0 :
+					kuploop_send(loop, msg, sizeof(msg), chan_ids[i]);
+			if (error) {
+				fprintf(stderr, "Send failed\n");
+				exit(1);
+			}
+		}
+		sent += channels;
+	}
+	double elapsed = now() - start;
+
+	kuploop_unload(loop);
+	for (int i = 0; i < channels; i++)
+		pthread_join(cons[i].thread, NULL);
+	kernproxy_close(handle);
+	kuploop_destroy(loop);
+	free(chan_ids);
+	free(cons);
+	return sent / elapsed;
+}
+
+int
+main(int argc, char* argv[])
+{
+	int channels = 4, slow = 1, seconds = 1;
+	unsigned long skew = 100, work = 1000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "c:s:x:w:t:")) != -1) {
+		switch (opt) {
+		case 'c': channels = atoi(optarg); break;
+		case 's': slow = atoi(optarg); break;
+		case 'x': skew = strtoul(optarg, NULL, 10); break;
+		case 'w': work = strtoul(optarg, NULL, 10); break;
+		case 't': seconds = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: %s [-c channels] [-s slow_channels] "
+					"[-x skew] [-w work] [-t seconds]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (channels < 1 || slow < 0 || slow > channels || skew < 1) {
+		fprintf(stderr, "Invalid arguments\n");
+		return 1;
+	}
+
+	printf("channels: %d, slow: %d, skew: %lux, work: %lu\n",
+			channels, slow, skew, work);
+	printf("%10s %14s\n", "selection", "msgs/s");
+	printf("%10s %14.0f\n", "fixed",
+			run(channels, slow, skew, work, seconds, 0));
+	fflush(stdout);
+	printf("%10s %14.0f\n", "any",
+			run(channels, slow, skew, work, seconds, 1));
+	return 0;
+}
@@ -32,20 +32,91 @@
 
 #pragma once
 
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 enum { KP_EMPTY = 0, KP_NB = 1 };
-enum { EKU_SHUTDOWN, EKU_NOTREADY };
+enum { EKU_SHUTDOWN, EKU_NOTREADY, EKU_BUSY, EKU_SIZE, EKU_UNBOUND };
 enum { KPE_NOTREADY, KPE_FINISH };
+enum { KP_DOMAIN_ANY = -1 };
+enum { KP_CPU_NONE = -1 };
+
+// Pass as chan_id to kernproxy_channel() to attach to any free channel
+#define KP_CHAN_ANY ((size_t)-1)
 
 extern int kernproxy_errno;
 
+struct kernproxy_geometry {
+	// Version of the interface between the kernel module and this library
+	unsigned	version;
+	// Number of channels of the device
+	size_t		channels;
+	// Size of each channel in pages, kernel to user space
+	size_t		size;
+	// Number of channels no process is attached to
+	size_t		free;
+	// Size of each channel in pages, user space to kernel. 0 if replies go
+	// to a small area of the control page, see kernproxy_send_max().
+	size_t		rsize;
+};
+
 extern void* kernproxy_open(char const *name);
 
 extern void* kernproxy_channel(void* handle, size_t chan_id, size_t size);
 
+extern void* kernproxy_channel_on(void* handle, size_t chan_id, size_t size,
+		int domain);
+
+extern int kernproxy_channels(void* handle, size_t first, size_t count,
+		size_t size, void* out[]);
+
+extern size_t kernproxy_attached(void* handle, void* out[], size_t max);
+
+extern size_t kernproxy_channel_index(void* channel);
+
+extern size_t kernproxy_send_max(void* channel);
+
+extern int kernproxy_channel_domain(void* channel);
+
+extern int kernproxy_channel_cpu(void* channel);
+
+extern int kernproxy_pin(void* channel);
+
+extern int kernproxy_geometry(void* handle, struct kernproxy_geometry* geo);
+
 extern void* kernproxy_receive(void *handle, int flags);
 
+extern void* kernproxy_receive_msg(void *handle, int flags, size_t* len);
+
 extern int kernproxy_send(void *handle, void *data, size_t len, int flags);
 
+extern int kernproxy_handoff(void* handle, int sock);
+
+extern void* kernproxy_adopt(int sock);
+
+extern int kernproxy_capture(void* handle, char const* path,
+		size_t max_bytes);
+
+extern int kernproxy_capture_stop(void* handle);
+
+struct kup_chan_stats;
+
+extern void* kernproxy_stats_open(char const* name);
+
+extern const struct kup_chan_stats* kernproxy_stats(void* stats,
+		size_t* count);
+
+extern void kernproxy_stats_close(void* stats);
+
+extern int kernproxy_channel_close(void* channel);
+
 extern void kernproxy_close(void* handle);
 
 extern int kernproxy_error(void* handle);
+
+#ifdef __cplusplus
+}
+#endif
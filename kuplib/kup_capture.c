@@ -0,0 +1,199 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * Recording of the traffic on the channels of a handle into a memory mapped
+ * log, for replaying it later against the user space stand-in for the kernel
+ * side. See kup_capture.h for the format of the log, and bench/kupreplay.c
+ * for the replay driver.
+ *
+ * Recording a message takes a slot in the log with a single atomic add, so
+ * threads serving different channels do not serialize on the log. Messages
+ * that do not fit in the log any more are counted and dropped.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include "kup.h"
+#include "kup_capture.h"
+#include "kup_private.h"
+
+#define KERNPROXY_API
+
+struct kup_capture {
+	int							fd;
+	struct kup_capture_header*	header;
+	// Room for records after the header
+	uint64_t					capacity;
+	// Monotonic time of the start of the capture, in nanoseconds
+	uint64_t					start;
+	// Where the next record goes, advanced by every message recorded,
+	// including the ones that are dropped
+	_Alignas(CACHE_LINE_SIZE)
+	uint64_t					tail;
+	// Where the first record that did not fit would have started
+	uint64_t					limit;
+	uint64_t					dropped;
+};
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+kup_capture_record(struct kup_capture* cap, channel_t* channel, int dir,
+		const void* data, size_t len)
+{
+	uint64_t size = KUP_CAPTURE_RECORD_SIZE(len);
+	uint64_t at = __atomic_fetch_add(&cap->tail, size, __ATOMIC_RELAXED);
+	struct kup_capture_record* rec;
+
+	if (at + size > cap->capacity) {
+		// Only the first record that does not fit starts within the log.
+		if (at <= cap->capacity)
+			cap->limit = at;
+		__atomic_fetch_add(&cap->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+	rec = (struct kup_capture_record*)((uint8_t*)(cap->header + 1) + at);
+	rec->kr_time = clock_ns(CLOCK_MONOTONIC) - cap->start;
+	rec->kr_len = len;
+	rec->kr_channel = *CHAN_INDEX(channel);
+	rec->kr_dir = dir;
+	rec->kr_reserved = 0;
+	memcpy(rec + 1, data, len);
+}
+
+/**
+ *	Starts recording the messages sent and received on the channels of
+ *	'handle', through kernproxy_receive(), kernproxy_send() and the dispatch
+ *	engine, to a new log at 'path'. The log is a file of at most 'max_bytes'
+ *	bytes mapped into memory, and messages that do not fit in it anymore are
+ *	dropped.
+ *
+ *	Returns 0 on success, and -1 with errno set on failure, EBUSY if 'handle'
+ *	is already capturing.
+ */
+KERNPROXY_API
+int
+kernproxy_capture(void* handle, char const* path, size_t max_bytes)
+{
+	kernproxy_t* kp = (kernproxy_t*) handle;
+	struct kup_capture* cap;
+	struct kup_capture_header* header;
+	size_t length = sizeof(*header) + max_bytes;
+	int fd, error;
+
+	if (kp->capture) {
+		errno = EBUSY;
+		return -1;
+	}
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (ftruncate(fd, length) < 0)
+		goto fail;
+	header = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (header == MAP_FAILED)
+		goto fail;
+	cap = aligned_alloc(CACHE_LINE_SIZE,
+			roundup(sizeof(*cap), CACHE_LINE_SIZE));
+	if (cap == NULL) {
+		munmap(header, length);
+		goto fail;
+	}
+	memset(cap, 0, sizeof(*cap));
+	cap->fd = fd;
+	cap->header = header;
+	cap->capacity = max_bytes;
+	cap->limit = max_bytes;
+	header->kc_magic = KUP_CAPTURE_MAGIC;
+	header->kc_version = KUP_CAPTURE_VERSION;
+	header->kc_size = kp->size;
+	header->kc_rsize = kp->rsize;
+	header->kc_start = clock_ns(CLOCK_REALTIME);
+	cap->start = clock_ns(CLOCK_MONOTONIC);
+	__atomic_store_n(&kp->capture, cap, __ATOMIC_RELEASE);
+	return 0;
+
+fail:
+	error = errno;
+	close(fd);
+	unlink(path);
+	errno = error;
+	return -1;
+}
+
+/**
+ *	Stops the capture started on 'handle' by kernproxy_capture(), and trims
+ *	the log to the records in it. No thread may be receiving or sending on
+ *	the channels of 'handle' meanwhile.
+ *
+ *	Returns 0 on success, and -1 with errno set on failure, EINVAL if
+ *	'handle' is not capturing.
+ */
+KERNPROXY_API
+int
+kernproxy_capture_stop(void* handle)
+{
+	kernproxy_t* kp = (kernproxy_t*) handle;
+	struct kup_capture* cap = kp->capture;
+	int error = 0;
+
+	if (cap == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	__atomic_store_n(&kp->capture, NULL, __ATOMIC_RELEASE);
+	cap->header->kc_length = MIN(cap->tail, cap->limit);
+	cap->header->kc_dropped = cap->dropped;
+	munmap(cap->header, sizeof(*cap->header) + cap->capacity);
+	if (ftruncate(cap->fd, sizeof(*cap->header) + MIN(cap->tail, cap->limit)))
+		error = errno;
+	close(cap->fd);
+	free(cap);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,89 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#pragma once
+
+/**
+ * Format of the traffic logs written by kernproxy_capture(). A log starts
+ * with a struct kup_capture_header, followed by the records back to back.
+ * Each record is a struct kup_capture_record followed by its payload, padded
+ * to a multiple of 8 bytes. All fields are in host byte order.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define KUP_CAPTURE_MAGIC		0x4350554b	/* "KUPC" */
+#define KUP_CAPTURE_VERSION		1
+
+// Direction of a captured message
+enum { KUP_CAPTURE_IN = 0, KUP_CAPTURE_OUT = 1 };
+
+struct kup_capture_header {
+	uint32_t	kc_magic;
+	uint32_t	kc_version;
+	// Geometry of the device the log was captured on, in pages
+	uint64_t	kc_size;
+	uint64_t	kc_rsize;
+	// Wall clock time of the start of the capture, in nanoseconds since the
+	// epoch. Record timestamps are relative to it.
+	uint64_t	kc_start;
+	// Number of bytes of records following the header
+	uint64_t	kc_length;
+	// Number of messages that did not fit in the log
+	uint64_t	kc_dropped;
+	uint64_t	kc_reserved[2];
+};
+
+struct kup_capture_record {
+	// Nanoseconds since the start of the capture
+	uint64_t	kr_time;
+	// Length of the payload following the record
+	uint32_t	kr_len;
+	// Index of the channel in its device
+	uint16_t	kr_channel;
+	// KUP_CAPTURE_IN for the messages of the kernel, KUP_CAPTURE_OUT for
+	// those of the daemon
+	uint8_t		kr_dir;
+	uint8_t		kr_reserved;
+};
+
+// Size of the record with a payload of 'len' bytes, padding included
+#define KUP_CAPTURE_RECORD_SIZE(len)										\
+		((sizeof(struct kup_capture_record) + (len) + 7) & ~(size_t)7)
+
+#ifdef __cplusplus
+}
+#endif
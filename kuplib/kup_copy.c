@@ -0,0 +1,259 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * Copy kernels with streaming stores, and the runtime selection of the one
+ * the send paths use. See kup_copy.h.
+ *
+ * Each kernel copies the unaligned head of the destination with memcpy(),
+ * streams the aligned middle part, and copies the tail with memcpy(). The
+ * streaming stores are fenced before returning, so that they are ordered
+ * before the store that passes the turn to the peer.
+ */
+
+#include <string.h>
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#include "kup.h"
+#include "kup_copy.h"
+#include "kup_private.h"
+
+#define KERNPROXY_API
+
+static void
+copy_memcpy(void* dst, const void* src, size_t len)
+{
+	memcpy(dst, src, len);
+}
+
+size_t kup_copy_threshold = KP_COPY_THRESHOLD;
+void (*kup_copy_nt)(void*, const void*, size_t) = copy_memcpy;
+static int copy_isa = KP_COPY_MEMCPY;
+
+#if defined(__x86_64__) || defined(__i386__)
+
+/**
+ * Copies the bytes of 'src' that go before the first 'align' aligned byte of
+ * 'dst', and advances the pointers and 'len' past them.
+ */
+static inline void
+copy_head(uint8_t** dst, const uint8_t** src, size_t* len, size_t align)
+{
+	size_t head = -(uintptr_t)*dst & (align - 1);
+	if (head > *len)
+		head = *len;
+	memcpy(*dst, *src, head);
+	*dst += head;
+	*src += head;
+	*len -= head;
+}
+
+__attribute__((target("sse2")))
+static void
+copy_sse2(void* dst, const void* src, size_t len)
+{
+	uint8_t* d = dst;
+	const uint8_t* s = src;
+
+	copy_head(&d, &s, &len, 16);
+	for (; len >= 64; len -= 64, d += 64, s += 64) {
+		__m128i a = _mm_loadu_si128((const __m128i*)s);
+		__m128i b = _mm_loadu_si128((const __m128i*)(s + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(s + 32));
+		__m128i e = _mm_loadu_si128((const __m128i*)(s + 48));
+		_mm_stream_si128((__m128i*)d, a);
+		_mm_stream_si128((__m128i*)(d + 16), b);
+		_mm_stream_si128((__m128i*)(d + 32), c);
+		_mm_stream_si128((__m128i*)(d + 48), e);
+	}
+	_mm_sfence();
+	memcpy(d, s, len);
+}
+
+__attribute__((target("avx2")))
+static void
+copy_avx2(void* dst, const void* src, size_t len)
+{
+	uint8_t* d = dst;
+	const uint8_t* s = src;
+
+	copy_head(&d, &s, &len, 32);
+	for (; len >= 128; len -= 128, d += 128, s += 128) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)s);
+		__m256i b = _mm256_loadu_si256((const __m256i*)(s + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(s + 64));
+		__m256i e = _mm256_loadu_si256((const __m256i*)(s + 96));
+		_mm256_stream_si256((__m256i*)d, a);
+		_mm256_stream_si256((__m256i*)(d + 32), b);
+		_mm256_stream_si256((__m256i*)(d + 64), c);
+		_mm256_stream_si256((__m256i*)(d + 96), e);
+	}
+	_mm_sfence();
+	memcpy(d, s, len);
+}
+
+__attribute__((target("avx512f")))
+static void
+copy_avx512(void* dst, const void* src, size_t len)
+{
+	uint8_t* d = dst;
+	const uint8_t* s = src;
+
+	copy_head(&d, &s, &len, 64);
+	for (; len >= 256; len -= 256, d += 256, s += 256) {
+		__m512i a = _mm512_loadu_si512((const void*)s);
+		__m512i b = _mm512_loadu_si512((const void*)(s + 64));
+		__m512i c = _mm512_loadu_si512((const void*)(s + 128));
+		__m512i e = _mm512_loadu_si512((const void*)(s + 192));
+		_mm512_stream_si512((void*)d, a);
+		_mm512_stream_si512((void*)(d + 64), b);
+		_mm512_stream_si512((void*)(d + 128), c);
+		_mm512_stream_si512((void*)(d + 192), e);
+	}
+	_mm_sfence();
+	memcpy(d, s, len);
+}
+
+/**
+ * Returns whether the CPU and the operating system support the instruction
+ * set 'isa'.
+ */
+static int
+isa_supported(int isa)
+{
+	__builtin_cpu_init();
+	switch (isa) {
+	case KP_COPY_MEMCPY:
+		return 1;
+	case KP_COPY_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case KP_COPY_AVX2:
+		return __builtin_cpu_supports("avx2");
+	case KP_COPY_AVX512:
+		return __builtin_cpu_supports("avx512f");
+	default:
+		return 0;
+	}
+}
+
+static void (*const copy_kernels[])(void*, const void*, size_t) = {
+	[KP_COPY_MEMCPY] = copy_memcpy,
+	[KP_COPY_SSE2] = copy_sse2,
+	[KP_COPY_AVX2] = copy_avx2,
+	[KP_COPY_AVX512] = copy_avx512,
+};
+
+#else
+
+static int
+isa_supported(int isa)
+{
+	return isa == KP_COPY_MEMCPY;
+}
+
+static void (*const copy_kernels[])(void*, const void*, size_t) = {
+	[KP_COPY_MEMCPY] = copy_memcpy,
+};
+
+#endif
+
+/**
+ * Selects the widest streaming copy kernel the CPU supports when the
+ * library is loaded.
+ */
+__attribute__((constructor))
+static void
+select_copy_kernel(void)
+{
+	for (int isa = KP_COPY_AVX512; isa > KP_COPY_MEMCPY; isa--) {
+		if (isa_supported(isa)) {
+			copy_isa = isa;
+			kup_copy_nt = copy_kernels[isa];
+			return;
+		}
+	}
+}
+
+/**
+ *	Returns the instruction set of the streaming copy kernel used for large
+ *	messages, one of the KP_COPY_* constants.
+ */
+KERNPROXY_API
+int
+kernproxy_copy_isa(void)
+{
+	return copy_isa;
+}
+
+/**
+ *	Copies 'len' bytes from 'src' to 'dst' with the streaming copy kernel
+ *	for instruction set 'isa', whatever the copy threshold. Meant for
+ *	measuring the kernels against each other.
+ *
+ *	Returns 0, or -1 if the CPU does not support 'isa'.
+ */
+KERNPROXY_API
+int
+kernproxy_copy_nt(int isa, void* dst, const void* src, size_t len)
+{
+	if (isa < 0 || (size_t)isa >= sizeof(copy_kernels) / sizeof(*copy_kernels)
+			|| !isa_supported(isa))
+		return -1;
+	copy_kernels[isa](dst, src, len);
+	return 0;
+}
+
+/**
+ *	Returns the size in bytes from which messages are copied with streaming
+ *	stores.
+ */
+KERNPROXY_API
+size_t
+kernproxy_copy_threshold(void)
+{
+	return kup_copy_threshold;
+}
+
+/**
+ *	Makes messages of 'threshold' bytes or more be copied with streaming
+ *	stores. SIZE_MAX turns them off. Applies to the whole process, and is
+ *	meant to be set at startup.
+ */
+KERNPROXY_API
+void
+kernproxy_set_copy_threshold(size_t threshold)
+{
+	kup_copy_threshold = threshold;
+}
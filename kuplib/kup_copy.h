@@ -0,0 +1,69 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#pragma once
+
+/**
+ * Copy layer used by kernproxy_send() and kuploop_send() to fill the shared
+ * memory of a channel.
+ *
+ * Messages below the copy threshold are copied with memcpy(). Larger ones
+ * are copied with non-temporal (streaming) stores, which write around the
+ * caches of the sending CPU, so that a payload only the peer reads does not
+ * evict the working set of the sender. The widest streaming stores the CPU
+ * supports are picked when the library is loaded. bench/copy_bench.c finds
+ * the size from which this pays off on a given machine.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Instruction sets of the streaming copy kernels
+enum { KP_COPY_MEMCPY, KP_COPY_SSE2, KP_COPY_AVX2, KP_COPY_AVX512 };
+
+// Default copy threshold, in bytes
+enum { KP_COPY_THRESHOLD = 1 << 20 };
+
+extern int kernproxy_copy_isa(void);
+
+extern int kernproxy_copy_nt(int isa, void* dst, const void* src, size_t len);
+
+extern size_t kernproxy_copy_threshold(void);
+
+extern void kernproxy_set_copy_threshold(size_t threshold);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,396 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#pragma once
+
+/**
+ * Header-only C++20 coroutine binding for kuplib channels.
+ *
+ * 'co_await chan.receive()' and 'co_await chan.send(buf, len)' suspend the
+ * calling coroutine instead of spinning until it is our turn on the channel.
+ * A single-threaded kup::scheduler polls the channels of all suspended
+ * coroutines with KP_NB, and resumes each one as soon as its operation can
+ * complete. This lets thousands of sessions share one thread.
+ *
+ * Nothing is allocated per message: the awaiters live in the coroutine
+ * frames and are linked into the scheduler intrusively, and the frames of
+ * kup::session coroutines are recycled through a per-thread pool.
+ *
+ *	kup::session
+ *	echo(kup::channel chan)
+ *	{
+ *		std::size_t len;
+ *		while (void* data = co_await chan.receive(&len))
+ *			co_await chan.send(data, len);
+ *	}
+ *
+ *	kup::scheduler sched;
+ *	for (...)
+ *		echo(kup::channel(sched, handle, kernproxy_channel(handle, i, 1)));
+ *	sched.run();
+ */
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdlib>
+#include <exception>
+#include <new>
+#include <thread>
+
+#include "kup.h"
+
+namespace kup {
+
+/**
+ * Per-thread pool of coroutine frames, with one free list per multiple of
+ * kGranule bytes. Frames larger than kMaxFrame go to the global allocator.
+ */
+class frame_pool {
+public:
+	static constexpr std::size_t kGranule = 64;
+	static constexpr std::size_t kMaxFrame = 4096;
+
+	static void*
+	allocate(std::size_t size)
+	{
+		std::size_t bucket = bucket_of(size);
+		if (bucket >= kBuckets)
+			return ::operator new(size);
+		free_frame*& head = instance().free_[bucket];
+		if (head) {
+			free_frame* frame = head;
+			head = frame->next;
+			return frame;
+		}
+		return ::operator new((bucket + 1) * kGranule);
+	}
+
+	static void
+	deallocate(void* ptr, std::size_t size)
+	{
+		std::size_t bucket = bucket_of(size);
+		if (bucket >= kBuckets) {
+			::operator delete(ptr);
+			return;
+		}
+		free_frame*& head = instance().free_[bucket];
+		free_frame* frame = static_cast<free_frame*>(ptr);
+		frame->next = head;
+		head = frame;
+	}
+
+	~frame_pool()
+	{
+		for (free_frame* head : free_) {
+			while (head) {
+				free_frame* next = head->next;
+				::operator delete(head);
+				head = next;
+			}
+		}
+	}
+
+private:
+	struct free_frame {
+		free_frame* next;
+	};
+
+	static constexpr std::size_t kBuckets = kMaxFrame / kGranule;
+
+	static std::size_t
+	bucket_of(std::size_t size)
+	{
+		return (size + kGranule - 1) / kGranule - 1;
+	}
+
+	static frame_pool&
+	instance()
+	{
+		thread_local frame_pool pool;
+		return pool;
+	}
+
+	free_frame* free_[kBuckets] = {};
+};
+
+/**
+ * Return type of fire-and-forget coroutines run by a kup::scheduler. The
+ * coroutine starts running immediately, and its frame is returned to the
+ * frame pool when it finishes.
+ */
+class session {
+public:
+	struct promise_type {
+		session get_return_object() noexcept { return {}; }
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() noexcept {}
+		void unhandled_exception() noexcept { std::terminate(); }
+
+		static void*
+		operator new(std::size_t size)
+		{
+			return frame_pool::allocate(size);
+		}
+
+		static void
+		operator delete(void* ptr, std::size_t size)
+		{
+			frame_pool::deallocate(ptr, size);
+		}
+	};
+};
+
+class scheduler;
+
+/**
+ * A suspended channel operation. Awaiters are linked into the scheduler
+ * while their coroutine is suspended.
+ */
+class awaiter_base {
+protected:
+	friend class scheduler;
+
+	explicit awaiter_base(scheduler& sched) : sched_(sched) {}
+
+	// Attempts the operation without blocking. Returns true if it completed.
+	virtual bool try_complete() = 0;
+
+	void suspend(std::coroutine_handle<> handle);
+
+	scheduler&				sched_;
+	std::coroutine_handle<>	handle_;
+	awaiter_base*			prev_ = nullptr;
+	awaiter_base*			next_ = nullptr;
+};
+
+/**
+ * Single-threaded scheduler that polls the channels of all suspended
+ * coroutines and resumes them when their operation completes.
+ */
+class scheduler {
+public:
+	// Number of idle polling rounds after which the scheduler starts to
+	// yield the processor between rounds.
+	static constexpr int kSpin = 1024;
+
+	scheduler() = default;
+	scheduler(scheduler const&) = delete;
+	scheduler& operator=(scheduler const&) = delete;
+
+	/**
+	 * Runs until no coroutine is waiting on a channel anymore.
+	 */
+	void
+	run()
+	{
+		int idle = 0;
+		while (head_) {
+			if (poll())
+				idle = 0;
+			else if (++idle < kSpin)
+				spinwait();
+			else
+				std::this_thread::yield();
+		}
+	}
+
+	/**
+	 * Makes one pass over the suspended coroutines, resuming the ones whose
+	 * operation completed. Returns the number of resumed coroutines.
+	 */
+	std::size_t
+	poll()
+	{
+		std::size_t resumed = 0;
+		awaiter_base* a = head_;
+		while (a) {
+			awaiter_base* next = a->next_;
+			if (a->try_complete()) {
+				unlink(a);
+				resumed++;
+				a->handle_.resume();
+			}
+			a = next;
+		}
+		return resumed;
+	}
+
+	std::size_t waiting() const { return waiting_; }
+
+private:
+	friend class awaiter_base;
+
+	static void
+	spinwait()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		__builtin_ia32_pause();
+#elif defined(__aarch64__)
+		__asm__ __volatile__("yield");
+#endif
+	}
+
+	void
+	link(awaiter_base* a)
+	{
+		a->prev_ = tail_;
+		a->next_ = nullptr;
+		if (tail_)
+			tail_->next_ = a;
+		else
+			head_ = a;
+		tail_ = a;
+		waiting_++;
+	}
+
+	void
+	unlink(awaiter_base* a)
+	{
+		if (a->prev_)
+			a->prev_->next_ = a->next_;
+		else
+			head_ = a->next_;
+		if (a->next_)
+			a->next_->prev_ = a->prev_;
+		else
+			tail_ = a->prev_;
+		waiting_--;
+	}
+
+	awaiter_base*	head_ = nullptr;
+	awaiter_base*	tail_ = nullptr;
+	std::size_t		waiting_ = 0;
+};
+
+inline void
+awaiter_base::suspend(std::coroutine_handle<> handle)
+{
+	handle_ = handle;
+	sched_.link(this);
+}
+
+/**
+ * A kuplib channel bound to a scheduler. This is a thin, copyable wrapper
+ * around the handles returned by kernproxy_open() and kernproxy_channel().
+ */
+class channel {
+public:
+	channel(scheduler& sched, void* handle, void* chan)
+		: sched_(&sched), handle_(handle), chan_(chan) {}
+
+	class receive_awaiter : public awaiter_base {
+	public:
+		receive_awaiter(channel const& c, std::size_t* len)
+			: awaiter_base(*c.sched_), chan_(c), len_(len) {}
+
+		bool await_ready() { return try_complete(); }
+		void await_suspend(std::coroutine_handle<> h) { suspend(h); }
+		// The received data, or nullptr if it cannot be received.
+		void* await_resume() const noexcept { return data_; }
+
+	private:
+		// Any failure but the turn not being ours yet completes the receive.
+		bool
+		try_complete() override
+		{
+			data_ = kernproxy_receive_msg(chan_.chan_, KP_NB, len_);
+			return data_ != nullptr ||
+					kernproxy_error(chan_.handle_) != EKU_NOTREADY;
+		}
+
+		channel const&	chan_;
+		std::size_t*	len_;
+		void*			data_ = nullptr;
+	};
+
+	class send_awaiter : public awaiter_base {
+	public:
+		send_awaiter(channel const& c, void const* buf, std::size_t len)
+			: awaiter_base(*c.sched_), chan_(c), buf_(buf), len_(len) {}
+
+		bool await_ready() { return try_complete(); }
+		void await_suspend(std::coroutine_handle<> h) { suspend(h); }
+		// What kernproxy_send() returned, see send().
+		int await_resume() const noexcept { return result_; }
+
+	private:
+		// Any failure but the turn not being ours yet completes the send.
+		bool
+		try_complete() override
+		{
+			result_ = kernproxy_send(chan_.chan_, const_cast<void*>(buf_), len_,
+							KP_NB);
+			return result_ == 0 ||
+					kernproxy_error(chan_.handle_) != EKU_NOTREADY;
+		}
+
+		channel const&	chan_;
+		void const*		buf_;
+		std::size_t		len_;
+		int				result_ = 0;
+	};
+
+	/**
+	 * Completes with a pointer to the received data, or with nullptr when
+	 * it cannot be received, for instance as the kernel shut the channel
+	 * down. kernproxy_error() of the handle then tells why. The length of
+	 * the message is stored in 'len' unless it is nullptr, see
+	 * kernproxy_receive_msg().
+	 */
+	receive_awaiter
+	receive(std::size_t* len = nullptr) const
+	{
+		return receive_awaiter(*this, len);
+	}
+
+	/**
+	 * Completes with 0 once 'len' bytes from 'buf' have been sent and the
+	 * turn has been passed to the kernel, or with -1 if they cannot be sent,
+	 * for instance as they do not fit in the channel. kernproxy_error() of
+	 * the handle then tells why, as the coroutine is resumed right away.
+	 */
+	send_awaiter
+	send(void const* buf, std::size_t len) const
+	{
+		return send_awaiter(*this, buf, len);
+	}
+
+	void* native_handle() const { return chan_; }
+
+private:
+	scheduler*	sched_;
+	void*		handle_;
+	void*		chan_;
+};
+
+} // namespace kup
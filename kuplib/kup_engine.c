@@ -0,0 +1,425 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "kup.h"
+#include "kup_capture.h"
+#include "kup_private.h"
+#include "kup_engine.h"
+
+#define KERNPROXY_API
+
+// Number of empty rounds after which idle pollers and workers start to
+// yield the processor between rounds.
+#define ENGINE_SPIN		1024
+
+enum {
+	SLOT_IDLE,
+	SLOT_BUSY,
+	SLOT_DEAD
+};
+
+/**
+ * A channel served by the engine. A slot is queued at most once at a time:
+ * the poller moves it from SLOT_IDLE to SLOT_BUSY before queueing it, and
+ * it only goes back to SLOT_IDLE after the turn has been passed back to the
+ * kernel.
+ */
+typedef struct {
+	_Alignas(CACHE_LINE_SIZE)
+	channel_t*		chan;
+	atomic_int		state;
+} slot_t;
+
+/**
+ * Fixed size Chase-Lev work-stealing deque. The owning poller pushes at the
+ * bottom, and workers steal from the top. As every slot is queued at most
+ * once, a capacity of 'max_channels' can never overflow.
+ */
+typedef struct {
+	_Alignas(CACHE_LINE_SIZE)
+	_Atomic(int64_t)	top;
+	_Alignas(CACHE_LINE_SIZE)
+	_Atomic(int64_t)	bottom;
+	_Alignas(CACHE_LINE_SIZE)
+	int64_t				mask;
+	_Atomic(slot_t*)*	buf;
+} deque_t;
+
+typedef struct poller {
+	_Alignas(CACHE_LINE_SIZE)
+	struct engine*		engine;
+	pthread_t			thread;
+	int					cpu;
+	slot_t**			slots;
+	atomic_size_t		slot_cnt;
+	deque_t				queue;
+} poller_t;
+
+typedef struct worker {
+	_Alignas(CACHE_LINE_SIZE)
+	struct engine*		engine;
+	pthread_t			thread;
+	int					home;
+} worker_t;
+
+typedef struct engine {
+	kernproxy_handler_t	handler;
+	void*				arg;
+	int					poller_cnt;
+	int					worker_cnt;
+	size_t				max_channels;
+	atomic_int			running;
+	// Serializes kernproxy_engine_add()
+	pthread_mutex_t		lock;
+	size_t				slot_cnt;
+	slot_t*				slots;
+	poller_t*			pollers;
+	worker_t*			workers;
+} engine_t;
+
+static int
+deque_init(deque_t* q, size_t capacity)
+{
+	size_t size = 1;
+	while (size < capacity)
+		size <<= 1;
+	q->buf = calloc(size, sizeof(*q->buf));
+	if (q->buf == NULL)
+		return (ENOMEM);
+	q->mask = size - 1;
+	atomic_init(&q->top, 0);
+	atomic_init(&q->bottom, 0);
+	return (0);
+}
+
+static void
+deque_push(deque_t* q, slot_t* slot)
+{
+	int64_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+	atomic_store_explicit(&q->buf[b & q->mask], slot, memory_order_relaxed);
+	atomic_store_explicit(&q->bottom, b + 1, memory_order_release);
+}
+
+static slot_t*
+deque_steal(deque_t* q)
+{
+	int64_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	int64_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+	if (t >= b)
+		return (NULL);
+	slot_t* slot = atomic_load_explicit(&q->buf[t & q->mask],
+					memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+					memory_order_seq_cst, memory_order_relaxed))
+		return (NULL);
+	return (slot);
+}
+
+/**
+ * Runs the handler on a channel that is our turn, and passes the turn back
+ * to the kernel.
+ */
+static void
+dispatch(engine_t* e, slot_t* slot)
+{
+	channel_t* chan = slot->chan;
+	size_t in_len;
+	void* in = chan_read(chan, CHAN_DATA_RECV(chan), chan->size * PAGE_SIZE,
+			&in_len);
+	struct kup_capture* cap = channel_capture(chan);
+	if (cap)
+		kup_capture_record(cap, chan, KUP_CAPTURE_IN, in, in_len);
+	int len = e->handler(e->arg, chan, in, in_len, CHAN_DATA_SEND(chan),
+					CHAN_SEND_MAX(chan));
+	// A reply longer than the room for it has already overrun it, and must
+	// not reach the capture or the kernel.
+	if (len < 0 || (size_t)len > CHAN_SEND_MAX(chan)) {
+		atomic_store_explicit(&slot->state, SLOT_DEAD, memory_order_release);
+		return;
+	}
+	*CHAN_LEN(chan) = len;
+	if (cap)
+		kup_capture_record(cap, chan, KUP_CAPTURE_OUT, CHAN_DATA_SEND(chan),
+				len);
+	switch_turn(chan);
+	atomic_store_explicit(&slot->state, SLOT_IDLE, memory_order_release);
+}
+
+static void
+idle(int* rounds)
+{
+	if (++*rounds < ENGINE_SPIN)
+		cpu_spinwait();
+	else
+		sched_yield();
+}
+
+static void*
+poller_main(void* arg)
+{
+	poller_t* p = arg;
+	engine_t* e = p->engine;
+	int rounds = 0;
+
+	while (atomic_load_explicit(&e->running, memory_order_relaxed)) {
+		size_t cnt = atomic_load_explicit(&p->slot_cnt, memory_order_acquire);
+		int found = 0;
+		for (size_t i = 0; i < cnt; i++) {
+			slot_t* slot = p->slots[i];
+			if (atomic_load_explicit(&slot->state, memory_order_acquire) !=
+							SLOT_IDLE)
+				continue;
+			if (*CHAN_CMD(slot->chan) == CMD_CLOSE) {
+				atomic_store_explicit(&slot->state, SLOT_DEAD,
+								memory_order_relaxed);
+				continue;
+			}
+			if (!is_our_turn(slot->chan))
+				continue;
+			atomic_store_explicit(&slot->state, SLOT_BUSY,
+							memory_order_relaxed);
+			found = 1;
+			if (e->worker_cnt == 0)
+				dispatch(e, slot);
+			else
+				deque_push(&p->queue, slot);
+		}
+		if (found)
+			rounds = 0;
+		else
+			idle(&rounds);
+	}
+	return (NULL);
+}
+
+static void*
+worker_main(void* arg)
+{
+	worker_t* w = arg;
+	engine_t* e = w->engine;
+	int rounds = 0;
+
+	while (atomic_load_explicit(&e->running, memory_order_relaxed)) {
+		slot_t* slot = NULL;
+		// Prefer the deque of our home poller, and steal from the others
+		// when it is empty.
+		for (int i = 0; i < e->poller_cnt && slot == NULL; i++) {
+			poller_t* p = &e->pollers[(w->home + i) % e->poller_cnt];
+			slot = deque_steal(&p->queue);
+		}
+		if (slot == NULL) {
+			idle(&rounds);
+			continue;
+		}
+		rounds = 0;
+		dispatch(e, slot);
+	}
+	return (NULL);
+}
+
+/**
+ *	Creates a dispatch engine with the configuration 'conf', that will call
+ *	'handler' with 'arg' for every message received on its channels. The
+ *	engine does not start before kernproxy_engine_start() is called.
+ */
+KERNPROXY_API
+void*
+kernproxy_engine_create(struct kernproxy_engine_conf const* conf,
+		kernproxy_handler_t handler, void* arg)
+{
+	if (conf->pollers < 1 || conf->workers < 0 || conf->max_channels == 0) {
+		errno = EINVAL;
+		return (NULL);
+	}
+	engine_t* e = calloc(1, sizeof(*e));
+	if (e == NULL)
+		return (NULL);
+	e->handler = handler;
+	e->arg = arg;
+	e->poller_cnt = conf->pollers;
+	e->worker_cnt = conf->workers;
+	e->max_channels = conf->max_channels;
+	atomic_init(&e->running, 0);
+	pthread_mutex_init(&e->lock, NULL);
+	e->slots = aligned_alloc(CACHE_LINE_SIZE,
+					e->max_channels * sizeof(*e->slots));
+	e->pollers = aligned_alloc(CACHE_LINE_SIZE,
+					e->poller_cnt * sizeof(*e->pollers));
+	e->workers = aligned_alloc(CACHE_LINE_SIZE,
+					(e->worker_cnt + 1) * sizeof(*e->workers));
+	if (e->pollers)
+		memset(e->pollers, 0, e->poller_cnt * sizeof(*e->pollers));
+	if (e->workers)
+		memset(e->workers, 0, (e->worker_cnt + 1) * sizeof(*e->workers));
+	if (e->slots == NULL || e->pollers == NULL || e->workers == NULL)
+		goto error;
+	for (int i = 0; i < e->poller_cnt; i++) {
+		poller_t* p = &e->pollers[i];
+		p->engine = e;
+		p->cpu = conf->poller_cpus ? conf->poller_cpus[i] : -1;
+		atomic_init(&p->slot_cnt, 0);
+		p->slots = calloc(e->max_channels, sizeof(*p->slots));
+		if (p->slots == NULL || deque_init(&p->queue, e->max_channels))
+			goto error;
+	}
+	for (int i = 0; i < e->worker_cnt; i++) {
+		e->workers[i].engine = e;
+		e->workers[i].home = i % e->poller_cnt;
+	}
+	return (e);
+
+error:
+	kernproxy_engine_destroy(e);
+	errno = ENOMEM;
+	return (NULL);
+}
+
+/**
+ *	Adds channel 'channel' to the set of channels served by 'engine'. This
+ *	can be done both before and after the engine is started.
+ *
+ *	Returns 0 on success, and -1 if the engine is already serving
+ *	'max_channels' channels.
+ */
+KERNPROXY_API
+int
+kernproxy_engine_add(void* engine, void* channel)
+{
+	engine_t* e = engine;
+
+	pthread_mutex_lock(&e->lock);
+	if (e->slot_cnt == e->max_channels) {
+		pthread_mutex_unlock(&e->lock);
+		return (-1);
+	}
+	slot_t* slot = &e->slots[e->slot_cnt];
+	slot->chan = channel;
+	atomic_init(&slot->state, SLOT_IDLE);
+	poller_t* p = &e->pollers[e->slot_cnt % e->poller_cnt];
+	size_t cnt = atomic_load_explicit(&p->slot_cnt, memory_order_relaxed);
+	p->slots[cnt] = slot;
+	atomic_store_explicit(&p->slot_cnt, cnt + 1, memory_order_release);
+	e->slot_cnt++;
+	pthread_mutex_unlock(&e->lock);
+	return (0);
+}
+
+/**
+ *	Starts the poller and worker threads of 'engine'.
+ *
+ *	Returns 0 on success, or an error number.
+ */
+KERNPROXY_API
+int
+kernproxy_engine_start(void* engine)
+{
+	engine_t* e = engine;
+	int error;
+
+	atomic_store(&e->running, 1);
+	for (int i = 0; i < e->poller_cnt; i++) {
+		poller_t* p = &e->pollers[i];
+		error = pthread_create(&p->thread, NULL, poller_main, p);
+		if (error)
+			goto error;
+		if (p->cpu >= 0)
+			kup_pin_thread(p->thread, p->cpu);
+	}
+	for (int i = 0; i < e->worker_cnt; i++) {
+		error = pthread_create(&e->workers[i].thread, NULL, worker_main,
+						&e->workers[i]);
+		if (error)
+			goto error;
+	}
+	return (0);
+
+error:
+	kernproxy_engine_stop(e);
+	return (error);
+}
+
+/**
+ *	Stops the threads of 'engine' and waits for them to exit. Messages that
+ *	were already queued but not yet handled stay unanswered.
+ */
+KERNPROXY_API
+void
+kernproxy_engine_stop(void* engine)
+{
+	engine_t* e = engine;
+
+	atomic_store(&e->running, 0);
+	for (int i = 0; i < e->poller_cnt; i++) {
+		if (e->pollers[i].thread) {
+			pthread_join(e->pollers[i].thread, NULL);
+			e->pollers[i].thread = 0;
+		}
+	}
+	for (int i = 0; i < e->worker_cnt; i++) {
+		if (e->workers[i].thread) {
+			pthread_join(e->workers[i].thread, NULL);
+			e->workers[i].thread = 0;
+		}
+	}
+}
+
+/**
+ *	Frees 'engine'. The engine must have been stopped. The channels added to
+ *	it remain attached.
+ */
+KERNPROXY_API
+void
+kernproxy_engine_destroy(void* engine)
+{
+	engine_t* e = engine;
+
+	if (e->pollers) {
+		for (int i = 0; i < e->poller_cnt; i++) {
+			free(e->pollers[i].slots);
+			free(e->pollers[i].queue.buf);
+		}
+	}
+	free(e->pollers);
+	free(e->workers);
+	free(e->slots);
+	pthread_mutex_destroy(&e->lock);
+	free(e);
+}
@@ -0,0 +1,93 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#pragma once
+
+/**
+ * Dispatch engine for serving many KUP channels with a fixed number of
+ * threads.
+ *
+ * A small number of poller threads, optionally pinned to CPUs, watch the
+ * turn word of every channel added to the engine. When the kernel passes the
+ * turn on a channel, the poller queues it on its work-stealing deque, and
+ * the worker threads steal queued channels from the deques of all pollers
+ * and run the handler on them. The reply is written by the handler straight
+ * into the send region of the channel, and the turn is passed back to the
+ * kernel once the handler returns. The number of spinning cores is
+ * therefore 'pollers' + 'workers', independent of the number of channels.
+ *
+ * With 'workers' set to 0 the pollers run the handler themselves.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * Called by the engine with the 'len' bytes received on 'channel' at 'data'
+ * and a buffer of 'reply_size' bytes in which the reply can be written.
+ * Short messages are passed inline in the control page, so only the first
+ * 'len' bytes at 'data' belong to the message. Returns the length of the
+ * reply, or a negative value to stop serving 'channel' without passing the
+ * turn back to the kernel. Returning more than 'reply_size' stops serving
+ * 'channel' too.
+ */
+typedef int (*kernproxy_handler_t)(void* arg, void* channel, void* data,
+		size_t len, void* reply, size_t reply_size);
+
+struct kernproxy_engine_conf {
+	// Number of poller threads, at least 1.
+	int				pollers;
+	// Number of worker threads.
+	int				workers;
+	// If not NULL, poller i is pinned to CPU poller_cpus[i].
+	int const*		poller_cpus;
+	// The maximum number of channels that can be added to the engine.
+	size_t			max_channels;
+};
+
+extern void* kernproxy_engine_create(struct kernproxy_engine_conf const* conf,
+		kernproxy_handler_t handler, void* arg);
+
+extern int kernproxy_engine_add(void* engine, void* channel);
+
+extern int kernproxy_engine_start(void* engine);
+
+extern void kernproxy_engine_stop(void* engine);
+
+extern void kernproxy_engine_destroy(void* engine);
+
+#ifdef __cplusplus
+}
+#endif
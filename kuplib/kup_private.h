@@ -0,0 +1,323 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#pragma once
+
+/**
+ * Definitions shared by the translation units of libkup. Nothing in here is
+ * part of the public API in kup.h.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#ifdef __FreeBSD__
+#include <sys/event.h>
+#endif
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE			4096
+#endif
+
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE		64
+#endif
+
+/**
+ * Layout of a channel as seen from user space. The first page is the control
+ * page, followed by 'size' pages written by the kernel and 'rsize' pages
+ * written by the daemon. With an 'rsize' of 0 the daemon writes to the last
+ * CHAN_RETURN_SIZE bytes of the control page instead.
+ */
+#define CHAN_SIZE(s, r)		((1 + (s) + (r)) * PAGE_SIZE)
+#define CHAN_RETURN_SIZE	2048
+#define CHAN_TURN(c)		((int*)((c)->mem))
+// Length of the message last sent on the channel, in either direction
+#define CHAN_LEN(c)			((uint32_t*)((c)->mem + 4))
+// Messages of up to CHAN_INLINE_SIZE bytes go here, in the cache line of the
+// turn, instead of the data pages. CHAN_LEN_INLINE is set in their length.
+#define CHAN_INLINE(c)		((c)->mem + 16)
+#define CHAN_INLINE_SIZE	48
+#define CHAN_LEN_INLINE		0x80000000u
+#define CHAN_CMD(c)			((int*)((c)->mem + 8))
+#define CHAN_DOMAIN(c)		((int*)((c)->mem + 64))
+#define CHAN_CPU(c)			((int*)((c)->mem + 68))
+#define CHAN_INDEX(c)		((int*)((c)->mem + 72))
+#define CHAN_DATA_RECV(c)	((c)->mem + PAGE_SIZE)
+#define CHAN_DATA_SEND(c)	((c)->rsize ?							\
+		(c)->mem + PAGE_SIZE * ((c)->size + 1) :				\
+		(c)->mem + PAGE_SIZE - CHAN_RETURN_SIZE)
+// Room for the messages of the daemon
+#define CHAN_SEND_MAX(c)	((c)->rsize ? (c)->rsize * PAGE_SIZE : CHAN_RETURN_SIZE)
+
+// The kernel takes the preferred NUMA domain from these bits of the offset.
+// They hold KP_DOMAIN_ANY up to CHAN_DOMAIN_MAX, other domains have to be
+// rejected before, as they would spill over into the flags below.
+#define CHAN_DOMAIN_MAX		254
+#define CHAN_DOMAIN_OFF(d)	((off_t)((d) + 1) << 48)
+// Asks the kernel for any free channel instead of the one at the offset
+#define CHAN_ANY_OFF		((off_t)1 << 56)
+// Maps channels already attached through the same file, see kernproxy_adopt()
+#define CHAN_ADOPT_OFF		((off_t)1 << 57)
+// Maps the statistics of the channels instead, see kernproxy_stats()
+#define CHAN_STATS_OFF		((off_t)1 << 58)
+// The statistics of a device come in chunks of this many channels, each
+// taking whole pages
+#define STATS_CHUNK			64
+
+enum {
+		CMD_ACTIVE,
+		CMD_CLOSE
+};
+
+enum {
+	DAEMON = 0,
+	KERNEL = 1
+};
+
+// Version of the interface to the KUP kernel module this library speaks.
+#define KUP_ABI_VERSION		5
+
+/**
+ * Reply to the KUPIOC_GEOMETRY ioctl. Mirrors the definition in the kernel
+ * module.
+ */
+struct kup_geometry {
+	uint32_t	kg_version;
+	uint32_t	kg_page_size;
+	uint64_t	kg_channels;
+	uint64_t	kg_size;
+	uint64_t	kg_free;
+	uint64_t	kg_rsize;
+};
+
+#define KUPIOC_GEOMETRY		_IOR('k', 1, struct kup_geometry)
+#define KUPIOC_CLAIM		_IOR('k', 2, uint64_t)
+#define KUPIOC_DETACH		_IOW('k', 3, uint32_t)
+
+/**
+ * Sent over the socket along with the device file by kernproxy_handoff(),
+ * followed by the indexes of the channels, one uint32_t each.
+ */
+struct kup_handoff {
+	uint32_t	kh_version;
+	uint32_t	kh_count;
+	uint64_t	kh_size;
+};
+
+struct kuploop;
+struct kup_capture;
+
+typedef struct {
+	uint8_t*	mem;
+	size_t 		size;
+	size_t		rsize;
+	void*   	handle;
+} channel_t;
+
+typedef struct {
+	int fd;
+	int kdf;
+	int kernproxy_errno;
+	// Size of the channels of the device in pages, in the kernel to user
+	// space direction and the other way round.
+	size_t size;
+	size_t rsize;
+	// Channels attached through this handle.
+	channel_t** channels;
+	size_t channel_cnt;
+	size_t channel_max;
+#ifdef __FreeBSD__
+	struct kevent event_list[2];
+#endif
+	// Set when the handle is attached to a user space stand-in for the
+	// kernel side instead of a KUP device. See kuploop.c.
+	struct kuploop* loop;
+	// Traffic log the messages on the channels of this handle are recorded
+	// to, or NULL. See kup_capture.c.
+	struct kup_capture* capture;
+} kernproxy_t;
+
+/**
+ * Returns the traffic log the messages on 'channel' are to be recorded to,
+ * or NULL if its handle is not capturing.
+ */
+static inline struct kup_capture*
+channel_capture(channel_t* channel)
+{
+	kernproxy_t* kp = (kernproxy_t*)channel->handle;
+	return __atomic_load_n(&kp->capture, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Hint to the CPU that we are busy-waiting on a memory location.
+ */
+static inline void
+cpu_spinwait(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * Set the turn on 'channel' to 'turn_id'. The release store publishes the
+ * data written to the channel before the turn is handed over.
+ */
+static inline void
+set_turn(channel_t* channel, int turn_id)
+{
+	__atomic_store_n(CHAN_TURN(channel), turn_id, __ATOMIC_RELEASE);
+}
+
+/**
+ * Pass the turn on this channel to kernel
+ */
+static inline void
+switch_turn(channel_t* channel)
+{
+	set_turn(channel, KERNEL);
+}
+
+/**
+ * This function check if we currently have the turn on channel 'channel'
+ * or not.
+ *
+ * Returns 1 if it is our turn, 0 otherwise.
+ */
+static inline int
+is_our_turn(channel_t* channel)
+{
+	return (__atomic_load_n(CHAN_TURN(channel), __ATOMIC_ACQUIRE) == DAEMON);
+}
+
+/**
+ * This function blocks until the KUP kernel module passes the turn
+ * on channel 'channel' to user space.
+ */
+static inline void
+wait_for_turn(channel_t* channel)
+{
+	while (!is_our_turn(channel))
+		;
+}
+
+// Messages of at least this many bytes are copied with 'kup_copy_nt', the
+// streaming copy kernel selected for the CPU. See kup_copy.c.
+extern size_t kup_copy_threshold;
+extern void (*kup_copy_nt)(void* dst, const void* src, size_t len);
+
+/**
+ * Copies a message of 'len' bytes at 'src' into the shared memory of a
+ * channel at 'dst'.
+ */
+static inline void
+kup_copy(void* dst, const void* src, size_t len)
+{
+	if (len < kup_copy_threshold)
+		memcpy(dst, src, len);
+	else
+		kup_copy_nt(dst, src, len);
+}
+
+/**
+ * Writes a message of 'len' bytes at 'data' to 'channel', inline if it is
+ * short enough and to 'area' otherwise, along with its length. 'data' may
+ * point to the message last received on the channel.
+ */
+static inline void
+chan_write(channel_t* channel, uint8_t* area, const void* data, size_t len)
+{
+	if (len <= CHAN_INLINE_SIZE) {
+		memmove(CHAN_INLINE(channel), data, len);
+		*CHAN_LEN(channel) = len | CHAN_LEN_INLINE;
+	} else {
+		kup_copy(area, data, len);
+		*CHAN_LEN(channel) = len;
+	}
+}
+
+/**
+ * Returns where the message last written to 'channel' is, inline or in
+ * 'area' of 'max' bytes, and stores its length in 'len' unless it is NULL.
+ */
+static inline void*
+chan_read(channel_t* channel, uint8_t* area, size_t max, size_t* len)
+{
+	uint32_t word = *CHAN_LEN(channel);
+
+	if (word & CHAN_LEN_INLINE) {
+		if (len)
+			*len = MIN(word & ~CHAN_LEN_INLINE, CHAN_INLINE_SIZE);
+		return CHAN_INLINE(channel);
+	}
+	if (len)
+		*len = MIN(word, max);
+	return area;
+}
+
+/**
+ * Restricts 'thread' to run on CPU 'cpu'. Returns 0 or an errno value.
+ */
+int kup_pin_thread(pthread_t thread, int cpu);
+
+/**
+ * Hands out the memory of 'count' consecutive channels of the user space
+ * stand-in 'loop' to kernproxy_channels(). Returns NULL if the channels are
+ * not available.
+ */
+uint8_t* kuploop_attach(struct kuploop* loop, size_t first, size_t count,
+		size_t size, int domain);
+
+/**
+ * Fills in 'geo' for the user space stand-in 'loop', like KUPIOC_GEOMETRY.
+ */
+void kuploop_geometry(struct kuploop* loop, struct kup_geometry* geo);
+
+/**
+ * Detaches channel 'index' of the user space stand-in 'loop', like the
+ * KUPIOC_DETACH ioctl.
+ */
+void kuploop_detach(struct kuploop* loop, size_t index);
+
+/**
+ * Appends the message of 'len' bytes at 'data' that went over 'channel' in
+ * direction 'dir' to the traffic log 'cap'.
+ */
+void kup_capture_record(struct kup_capture* cap, channel_t* channel, int dir,
+		const void* data, size_t len);
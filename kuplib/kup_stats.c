@@ -0,0 +1,180 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * Read-only access to the statistics a KUP device keeps for its channels,
+ * see kup_stats.h. They are mapped from the device, which goes on updating
+ * them, so monitoring a device costs its data path nothing.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "kup.h"
+#include "kup_stats.h"
+#include "kup_private.h"
+
+#define KERNPROXY_API
+
+// Bytes of statistics per chunk of channels
+#define STATS_CHUNK_BYTES	\
+		roundup(STATS_CHUNK * sizeof(struct kup_chan_stats), PAGE_SIZE)
+
+// The chunks are back to back, so the statistics form a single array.
+_Static_assert(STATS_CHUNK * sizeof(struct kup_chan_stats) % PAGE_SIZE == 0,
+		"the statistics of a chunk must fill whole pages");
+
+struct kup_stats_map {
+	int								fd;
+	const struct kup_chan_stats*	mem;
+	// Size of the mapping at 'mem'
+	size_t							len;
+};
+
+#ifdef __FreeBSD__
+
+/**
+ *	Opens the KUP device named 'name' read-only for kernproxy_stats(). Any
+ *	user that can read the device can look at its statistics, without
+ *	getting in the way of the daemons attached to it.
+ *
+ *	Returns NULL with errno set on failure, EPROTONOSUPPORT if the kernel
+ *	module does not speak the version of this library.
+ */
+KERNPROXY_API
+void*
+kernproxy_stats_open(char const* name)
+{
+	struct kup_stats_map* map;
+	struct kup_geometry geo;
+	int fd;
+
+	fd = open(name, O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	if (ioctl(fd, KUPIOC_GEOMETRY, &geo) == -1 ||
+		geo.kg_version != KUP_ABI_VERSION || geo.kg_page_size != PAGE_SIZE) {
+		close(fd);
+		errno = EPROTONOSUPPORT;
+		return NULL;
+	}
+	map = calloc(1, sizeof(*map));
+	if (map == NULL) {
+		close(fd);
+		return NULL;
+	}
+	map->fd = fd;
+	return map;
+}
+
+/**
+ *	Returns the statistics of the channels of the device opened with
+ *	kernproxy_stats_open() as 'stats', one struct kup_chan_stats per channel,
+ *	and stores the number of channels in 'count'. They change under the
+ *	caller as the device is used. The array is valid until the next call,
+ *	which follows the device if its channel count changed.
+ *
+ *	Returns NULL with errno set on failure.
+ */
+KERNPROXY_API
+const struct kup_chan_stats*
+kernproxy_stats(void* stats, size_t* count)
+{
+	struct kup_stats_map* map = stats;
+	struct kup_geometry geo;
+	size_t len;
+	void* mem;
+
+	if (ioctl(map->fd, KUPIOC_GEOMETRY, &geo) == -1)
+		return NULL;
+	len = howmany(geo.kg_channels, STATS_CHUNK) * STATS_CHUNK_BYTES;
+	if (len != map->len) {
+		mem = mmap(NULL, len, PROT_READ, MAP_SHARED, map->fd, CHAN_STATS_OFF);
+		if (mem == MAP_FAILED)
+			return NULL;
+		if (map->mem != NULL)
+			munmap((void*)map->mem, map->len);
+		map->mem = mem;
+		map->len = len;
+	}
+	*count = geo.kg_channels;
+	return map->mem;
+}
+
+/**
+ *	Unmaps the statistics and closes the device opened with
+ *	kernproxy_stats_open().
+ */
+KERNPROXY_API
+void
+kernproxy_stats_close(void* stats)
+{
+	struct kup_stats_map* map = stats;
+
+	if (map->mem != NULL)
+		munmap((void*)map->mem, map->len);
+	close(map->fd);
+	free(map);
+}
+
+#else /* !__FreeBSD__ */
+
+/**
+ *	KUP devices only exist on FreeBSD. Elsewhere the user space stand-in
+ *	keeps the same statistics, see kuploop_stats().
+ */
+KERNPROXY_API
+void*
+kernproxy_stats_open(char const* name)
+{
+	errno = ENODEV;
+	return NULL;
+}
+
+KERNPROXY_API
+const struct kup_chan_stats*
+kernproxy_stats(void* stats, size_t* count)
+{
+	errno = ENODEV;
+	return NULL;
+}
+
+KERNPROXY_API
+void
+kernproxy_stats_close(void* stats)
+{
+}
+
+#endif /* __FreeBSD__ */
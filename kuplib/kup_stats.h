@@ -0,0 +1,77 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#pragma once
+
+/**
+ * Statistics of the channels of a KUP device, as returned by
+ * kernproxy_stats() and kuploop_stats(): an array of struct kup_chan_stats
+ * indexed by channel. The kernel updates them as it goes, so reading them
+ * takes no system call, and two reads apart in time give rates. Mirrors the
+ * definition in the kernel module.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct kup_chan_stats {
+	// Messages and bytes sent by the kernel side to the daemon, and received
+	// from it
+	uint64_t	ks_msgs_out;
+	uint64_t	ks_bytes_out;
+	uint64_t	ks_msgs_in;
+	uint64_t	ks_bytes_in;
+	// Time the kernel side waited for the turn spinning and sleeping, in
+	// nanoseconds, and the number of times it went to sleep. Waiting is
+	// what the kernel side does while the daemon handles a message.
+	uint64_t	ks_spin_ns;
+	uint64_t	ks_sleep_ns;
+	uint64_t	ks_sleeps;
+	// CLOCK_MONOTONIC time in nanoseconds when the kernel side started the
+	// wait for the turn it is in, 0 if it is not waiting. A wait that goes
+	// on for long means the daemon is stuck on the channel.
+	uint64_t	ks_wait_start;
+	// Number of times a daemon attached to the channel and detached from it
+	uint64_t	ks_attaches;
+	uint64_t	ks_detaches;
+	// Process of the daemon attached to the channel, 0 if there is none
+	int32_t		ks_pid;
+	uint32_t	ks_reserved1;
+	uint64_t	ks_reserved[5];
+};
+
+#ifdef __cplusplus
+}
+#endif
@@ -30,24 +30,35 @@
  * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 **/
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <sys/time.h>
-#include <sys/event.h>
-#include <sys/user.h>
 #include <sys/param.h>
-#include <sys/sysctl.h>
-#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __FreeBSD__
+#include <sys/event.h>
+#include <sys/cpuset.h>
+#include <pthread_np.h>
+#endif
 #include <assert.h>
-#include <libutil.h>
 
 #include "kup.h"
+#include "kup_capture.h"
+#include "kup_private.h"
 
 #define KERNPROXY_API
 
@@ -65,99 +76,74 @@
 	}									\
 	)
 
-#define CHAN_CMD(c)			((int*)(c->mem + 8))
-#define CHAN_DATA_RECV(c)	(c->mem + PAGE_SIZE)
-#define CHAN_DATA_SEND(c)	(c->mem + PAGE_SIZE * (c->size + 1))
-
-enum {
-		CMD_ACTIVE,
-		CMD_CLOSE
-};
-
-enum {
-	DAEMON = 0,
-	KERNEL = 1
-};
-
-struct fdinfo {
-	int kf_type;
-	int vnode_type;
-};
-
-#define KF_TYPE_VNODE     1
-#define KF_VTYPE_VCHR     4
-
-typedef struct {
-	uint8_t*	mem;
-	size_t 		size;
-	void*   	handle;
-} channel_t;
-
-struct fdinfo*
-getfdinfo(int fd)
-{
-	int cntp;
-	struct fdinfo *fdi;
-
-	pid_t pid = getpid();
-	struct kinfo_file *result = kinfo_getfile(pid, &cntp);
-	if (result == NULL)
-		return (NULL);
-	for (int j = 0; j < cntp; j++) {
-		struct kinfo_file *kf = &result[j];
-		if (kf->kf_fd == fd) {
-			fdi = malloc(sizeof(*fdi));
-			if (fdi == NULL) {
-				free(result);
-				return NULL;
-			}
-			fdi->kf_type = kf->kf_type;
-			fdi->vnode_type = kf->kf_vnode_type;
-			free(result);
-			return fdi;
-		}
-	}
-	free(result);
-	return (NULL); 
-}
+/**
+ *	Makes room for 'count' more channels in the list of channels attached
+ *	through 'kp'. Returns 0 on success and -1 if out of memory.
+ */
+static int
+reserve_channels(kernproxy_t* kp, size_t count)
+{
+	size_t max = kp->channel_max;
+	channel_t** channels;
 
-typedef struct {
-	int fd;
-	int kdf;
-	int kernproxy_errno;
-	struct kevent event_list[2];
-} kernproxy_t;
+	if (kp->channel_cnt + count <= max)
+		return 0;
+	while (max < kp->channel_cnt + count)
+		max = max ? max * 2 : 16;
+	channels = realloc(kp->channels, max * sizeof(*channels));
+	if (channels == NULL)
+		return -1;
+	kp->channels = channels;
+	kp->channel_max = max;
+	return 0;
+}
 
 /**
- *	Opens a KUP device named 'name' and returns a handle to it.
+ *	Returns a new channel on the memory at 'mem', attached through 'kp', and
+ *	adds it to the list of channels of 'kp', which must have room for it.
  */
-KERNPROXY_API
-void*
-kernproxy_open(char const *name)
+static channel_t*
+add_channel(kernproxy_t* kp, uint8_t* mem)
 {
-	int cdev = open(name, O_RDWR, 0);
-	if (cdev < 0) {
-		perror("open device failed");
+	channel_t* chan = malloc(sizeof(*chan));
+	if (chan == NULL)
 		return NULL;
-	}
-	struct fdinfo* finfo = getfdinfo(cdev);
-	if (finfo->kf_type 		!= KF_TYPE_VNODE ||
-		finfo->vnode_type	!= KF_VTYPE_VCHR) {
+	chan->mem = mem;
+	chan->size = kp->size;
+	chan->rsize = kp->rsize;
+	chan->handle = kp;
+	kp->channels[kp->channel_cnt++] = chan;
+	return chan;
+}
+
+#ifdef __FreeBSD__
+
+/**
+ *	Returns a handle to the KUP device open as 'cdev', or NULL if it is not a
+ *	KUP device this library can talk to.
+ */
+static kernproxy_t*
+open_device(int cdev)
+{
+	// Only KUP devices answer this query, and the answer tells us whether
+	// we speak the same language.
+	struct kup_geometry geo;
+	if (MAYINT(ioctl(cdev, KUPIOC_GEOMETRY, &geo)) == -1 ||
+		geo.kg_version != KUP_ABI_VERSION || geo.kg_page_size != PAGE_SIZE) {
 		fprintf(stderr, "%s: Invalid device!\n", __FUNCTION__);
-		MAYINT(close(cdev));
-		free(finfo);
 		return NULL;
 	}
-	free(finfo);
 
 	int kdf = MAYINT(kqueue());
 	if (kdf == -1) {
 		perror("kqueue");
 		return NULL;
 	}
-	kernproxy_t* kp = malloc(sizeof(*kp));
+	kernproxy_t* kp = calloc(1, sizeof(*kp));
 	kp->fd = cdev;
 	kp->kdf = kdf;
+	kp->size = geo.kg_size;
+	kp->rsize = geo.kg_rsize;
 	// This event 'EVFILT_READ' is fired when a new channel is available
 	// on this device.
 	EV_SET(&kp->event_list[0], kp->fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
@@ -166,6 +152,7 @@ kernproxy_open(char const *name)
 	EV_SET(&kp->event_list[1], kp->fd, EVFILT_USER, EV_ADD, 0, 0, NULL);
 	int error = MAYINT(kevent(kp->kdf, kp->event_list, 2, NULL, 0, NULL));
 	if (error == -1) {
+		MAYINT(close(kdf));
 		free(kp);
 		perror("kevent");
 		return NULL;
@@ -175,48 +162,295 @@ kernproxy_open(char const *name)
 }
 
 /**
- * Set the turn on 'channel' to 'turn_id'
+ *	Opens a KUP device named 'name' and returns a handle to it.
  */
-static void
-set_turn(channel_t* channel, int turn_id)
+KERNPROXY_API
+void*
+kernproxy_open(char const *name)
 {
-	volatile int* turn = (int*)(channel->mem);
-	*turn = turn_id;
+	int cdev = open(name, O_RDWR, 0);
+	if (cdev < 0) {
+		perror("open device failed");
+		return NULL;
+	}
+	kernproxy_t* kp = open_device(cdev);
+	if (kp == NULL)
+		MAYINT(close(cdev));
+	return kp;
 }
 
 /**
- * Pass the turn on this channel to kernel
+ *	Touches every page of the 'len' bytes of channel memory at 'mem' for
+ *	writing, so that the first messages on the channels take no page faults.
+ *	Adding 0 atomically leaves the contents intact, even if the kernel is
+ *	writing to the same page.
  */
 static void
-switch_turn(channel_t* channel)
+prefault(uint8_t* mem, size_t len)
 {
-	set_turn(channel, KERNEL);
+	for (size_t off = 0; off < len; off += PAGE_SIZE)
+		__atomic_fetch_add((int*)(mem + off), 0, __ATOMIC_RELAXED);
 }
 
 /**
- * This function blocks until the KUP kernel module passes the turn
- * on channel 'channel' to user space.
+ *	Waits for a channel to become available on the KUP device behind 'kp' and
+ *	maps the 'count' channels starting at 'first' with a single mmap. Returns
+ *	NULL and sets the error code of 'kp' on failure.
  */
-static void
-wait_for_turn(channel_t* channel)
+static uint8_t*
+device_channels(kernproxy_t* kp, size_t first, size_t count, size_t size,
+		int domain)
 {
-	volatile int *turn = (int*)(channel->mem);
-	while (*turn == KERNEL);
+	int ret = kevent(kp->kdf, NULL, 0, kp->event_list, 2, NULL);
+	if (ret == -1) {
+		perror("kevent");
+		exit(4);
+	}
+	for (int i = 0; i < ret; i++) {
+		if (kp->event_list[i].flags & EV_ERROR) {
+			fprintf(stderr, "ERROR: %s: %s\n", __FUNCTION__,
+							strerror(kp->event_list[i].data));
+		} else if (kp->event_list[i].filter == EVFILT_USER) {
+			fprintf(stderr, "%s: Shutdown request from kernel.\n",
+							__FUNCTION__);
+			kp->kernproxy_errno = EKU_SHUTDOWN;
+			return NULL;
+		}
+	}
+
+	off_t offset = first == KP_CHAN_ANY ? CHAN_ANY_OFF :
+					 (off_t)CHAN_SIZE(size, kp->rsize) * first;
+	void* mem = mmap(0, CHAN_SIZE(size, kp->rsize) * count, PROT_READ | PROT_WRITE,
+					 MAP_SHARED, kp->fd, offset | CHAN_DOMAIN_OFF(domain));
+	if (mem == MAP_FAILED) {
+		if (errno == EBUSY) {
+			kp->kernproxy_errno = EKU_BUSY;
+			return NULL;
+		}
+		perror("mmap failed");
+		kp->kernproxy_errno = EKU_NOTREADY;
+		return NULL;
+	}
+	prefault(mem, CHAN_SIZE(size, kp->rsize) * count);
+	return mem;
 }
 
 /**
- * This function check if we currently have the turn on channel 'channel'
- * or not.
+ *	Hands the channels attached through 'handle' over to the process at the
+ *	other end of the UNIX domain socket 'sock', which picks them up with
+ *	kernproxy_adopt(). The device file is passed along, so the channels stay
+ *	attached, with their memory and turn state, when this process exits
+ *	afterwards. Stop using the channels before calling this.
  *
- * Returns 1 if it is our turn, 0 otherwise.
+ *	Returns 0 on success and -1 with errno set on failure.
+ */
+KERNPROXY_API
+int
+kernproxy_handoff(void* handle, int sock)
+{
+	kernproxy_t* kp = (kernproxy_t*) handle;
+	struct kup_handoff* hdr;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr	hdr;
+		char			buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	uint32_t* ids;
+	size_t len;
+	ssize_t ret;
+
+	if (kp->fd < 0) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	len = sizeof(*hdr) + kp->channel_cnt * sizeof(*ids);
+	hdr = malloc(len);
+	if (hdr == NULL)
+		return -1;
+	hdr->kh_version = KUP_ABI_VERSION;
+	hdr->kh_count = kp->channel_cnt;
+	hdr->kh_size = kp->size;
+	ids = (uint32_t*)(hdr + 1);
+	for (size_t i = 0; i < kp->channel_cnt; i++)
+		ids[i] = *CHAN_INDEX(kp->channels[i]);
+
+	memset(&msg, 0, sizeof(msg));
+	memset(&cmsg, 0, sizeof(cmsg));
+	iov.iov_base = hdr;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	cmsg.hdr.cmsg_len = CMSG_LEN(sizeof(int));
+	cmsg.hdr.cmsg_level = SOL_SOCKET;
+	cmsg.hdr.cmsg_type = SCM_RIGHTS;
+	memcpy(CMSG_DATA(&cmsg.hdr), &kp->fd, sizeof(int));
+
+	// The file goes with the first chunk, the rest may take more writes.
+	ret = MAYINT(sendmsg(sock, &msg, 0));
+	for (size_t done = ret; ret > 0 && done < len; done += ret)
+		ret = MAYINT(write(sock, (char*)hdr + done, len - done));
+	free(hdr);
+	return ret < 0 ? -1 : 0;
+}
+
+/**
+ *	Reads exactly 'len' bytes from 'sock' into 'buf'.
  */
 static int
-is_our_turn(channel_t* channel)
+read_all(int sock, void* buf, size_t len)
 {
-	volatile int *turn = (int*)(channel->mem);
-	return (*turn == DAEMON);
+	for (size_t done = 0; done < len; ) {
+		ssize_t ret = MAYINT(read(sock, (char*)buf + done, len - done));
+		if (ret <= 0) {
+			if (ret == 0)
+				errno = ECONNRESET;
+			return -1;
+		}
+		done += ret;
+	}
+	return 0;
 }
 
+/**
+ *	Takes over the channels handed off by another process with
+ *	kernproxy_handoff() over the UNIX domain socket 'sock', and returns a
+ *	handle to the device they belong to. The channels are mapped as they
+ *	are, messages in flight included, and the calling process becomes their
+ *	owner. Use kernproxy_attached() to get at them.
+ *
+ *	Returns NULL with errno set on failure.
+ */
+KERNPROXY_API
+void*
+kernproxy_adopt(int sock)
+{
+	struct kup_handoff hdr;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr* cm;
+	union {
+		struct cmsghdr	hdr;
+		char			buf[CMSG_SPACE(sizeof(int))];
+	} cmsg;
+	kernproxy_t* kp = NULL;
+	uint32_t* ids = NULL;
+	uint64_t claimed;
+	int cdev = -1;
+	ssize_t ret;
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof(hdr);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsg.buf;
+	msg.msg_controllen = sizeof(cmsg.buf);
+	ret = MAYINT(recvmsg(sock, &msg, 0));
+	if (ret <= 0) {
+		if (ret == 0)
+			errno = ECONNRESET;
+		return NULL;
+	}
+	for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm))
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+			memcpy(&cdev, CMSG_DATA(cm), sizeof(int));
+	if (cdev < 0) {
+		errno = EBADMSG;
+		return NULL;
+	}
+	if ((size_t)ret < sizeof(hdr) &&
+			read_all(sock, (char*)&hdr + ret, sizeof(hdr) - ret))
+		goto error;
+	if (hdr.kh_version != KUP_ABI_VERSION) {
+		errno = EPROTONOSUPPORT;
+		goto error;
+	}
+	ids = calloc(hdr.kh_count + 1, sizeof(*ids));
+	if (ids == NULL || read_all(sock, ids, hdr.kh_count * sizeof(*ids)))
+		goto error;
+	kp = open_device(cdev);
+	if (kp == NULL) {
+		errno = ENODEV;
+		goto error;
+	}
+	if (hdr.kh_size != kp->size || reserve_channels(kp, hdr.kh_count)) {
+		errno = EINVAL;
+		goto error;
+	}
+	for (uint32_t i = 0; i < hdr.kh_count; i++) {
+		off_t offset = (off_t)CHAN_SIZE(kp->size, kp->rsize) * ids[i];
+		uint8_t* mem = mmap(0, CHAN_SIZE(kp->size, kp->rsize), PROT_READ | PROT_WRITE,
+						MAP_SHARED, kp->fd, offset | CHAN_ADOPT_OFF);
+		if (mem == MAP_FAILED)
+			goto error;
+		prefault(mem, CHAN_SIZE(kp->size, kp->rsize));
+		add_channel(kp, mem);
+	}
+	if (MAYINT(ioctl(kp->fd, KUPIOC_CLAIM, &claimed)) == -1)
+		goto error;
+	free(ids);
+	return kp;
+
+error:
+	// Closing our reference to the file does not detach the channels while
+	// the process that handed them off still holds its own.
+	free(ids);
+	if (kp != NULL) {
+		for (size_t i = 0; i < kp->channel_cnt; i++) {
+			munmap(kp->channels[i]->mem, CHAN_SIZE(kp->size, kp->rsize));
+			free(kp->channels[i]);
+		}
+		free(kp->channels);
+		MAYINT(close(kp->kdf));
+		free(kp);
+	}
+	MAYINT(close(cdev));
+	return NULL;
+}
+
+#else /* !__FreeBSD__ */
+
+/**
+ *	KUP devices only exist on FreeBSD. Elsewhere the library can only be
+ *	used with the user space stand-in for the kernel side, see kuploop.h.
+ */
+KERNPROXY_API
+void*
+kernproxy_open(char const *name)
+{
+	errno = ENODEV;
+	return NULL;
+}
+
+static uint8_t*
+device_channels(kernproxy_t* kp, size_t first, size_t count, size_t size,
+		int domain)
+{
+	kp->kernproxy_errno = EKU_NOTREADY;
+	return NULL;
+}
+
+KERNPROXY_API
+int
+kernproxy_handoff(void* handle, int sock)
+{
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
+KERNPROXY_API
+void*
+kernproxy_adopt(int sock)
+{
+	errno = ENODEV;
+	return NULL;
+}
+
+#endif /* __FreeBSD__ */
+
 /**
  *	Returns the current error code on KUP device 'handle'. The return value of
  *	this function is valid only when an error condition is indicated by some
@@ -230,48 +464,229 @@ kernproxy_error(void* handle)
 	return kp->kernproxy_errno;
 }
 
+static int
+attach_channels(kernproxy_t* kp, size_t first, size_t count, size_t size,
+		int domain, void* out[])
+{
+	uint8_t* mem;
+
+	// Channel offsets are computed from the size, so it has to match.
+	if (size == 0)
+		size = kp->size;
+	if (size != kp->size) {
+		kp->kernproxy_errno = EKU_SIZE;
+		return -1;
+	}
+	// The same as the kernel does with a domain it does not have.
+	if (domain < KP_DOMAIN_ANY || domain > CHAN_DOMAIN_MAX) {
+		kp->kernproxy_errno = EKU_NOTREADY;
+		return -1;
+	}
+	if (reserve_channels(kp, count)) {
+		kp->kernproxy_errno = EKU_NOTREADY;
+		return -1;
+	}
+
+	if (kp->loop) {
+		errno = 0;
+		mem = kuploop_attach(kp->loop, first, count, size, domain);
+		if (mem == NULL)
+			kp->kernproxy_errno = errno == EBUSY ? EKU_BUSY : EKU_NOTREADY;
+	} else
+		mem = device_channels(kp, first, count, size, domain);
+	if (mem == NULL)
+		return -1;
+
+	for (size_t i = 0; i < count; i++)
+		out[i] = add_channel(kp, mem + i * CHAN_SIZE(size, kp->rsize));
+	return 0;
+}
+
 /**
  *	This method blocks until channel 'chan_id' of size 'size' becomes available
  *	on the KUP device corresponding to 'handle'. It then returns a handle to
  *	that cahnnel. This handle can be used to send/receive data to/from the
- *	channel.
+ *	channel. With KP_CHAN_ANY any free channel is taken. If channel 'chan_id'
+ *	is already taken NULL is returned and the error code is set to EKU_BUSY.
+ *	A 'size' of 0 stands for the channel size of the device, any other size
+ *	that does not match it fails with EKU_SIZE.
  */
 KERNPROXY_API
 void*
 kernproxy_channel(void* handle, size_t chan_id, size_t size)
 {
-	kernproxy_t* kp = (kernproxy_t*) handle;
-	int ret = kevent(kp->kdf, NULL, 0, kp->event_list, 2, NULL);
-	if (ret == -1) {
-		perror("kevent");
-		exit(4);
-	}
-	for (int i = 0; i < ret; i++) {
-		if (kp->event_list[i].flags & EV_ERROR) {
-			fprintf(stderr, "ERROR: %s: %s\n", __FUNCTION__,
-							strerror(kp->event_list[i].data));
-		} else if (kp->event_list[i].filter == EVFILT_USER) {
-			fprintf(stderr, "%s: Shutdown request from kernel.\n",
-							__FUNCTION__);
-			kp->kernproxy_errno = EKU_SHUTDOWN;
-			return NULL;
-		}
-	}
+	return kernproxy_channel_on(handle, chan_id, size, KP_DOMAIN_ANY);
+}
 
-#define CHAN_SIZE(s)  ((1 + 2 * s) * PAGE_SIZE)
+/**
+ *	Same as kernproxy_channel(), but asks the kernel to allocate the memory
+ *	of the channel from NUMA domain 'domain'. With KP_DOMAIN_ANY the domain
+ *	declared by the kernel side is used, or the domain of the calling thread
+ *	if there is none. kernproxy_channel_domain() reports the outcome. A
+ *	domain the kernel does not have, or a negative one other than
+ *	KP_DOMAIN_ANY, fails with EKU_NOTREADY.
+ */
+KERNPROXY_API
+void*
+kernproxy_channel_on(void* handle, size_t chan_id, size_t size, int domain)
+{
+	void* channel;
 
-	void* mem = mmap(0, CHAN_SIZE(size), PROT_READ | PROT_WRITE, MAP_SHARED,
-					 kp->fd, CHAN_SIZE(size) * chan_id);
-	if (mem == MAP_FAILED) {
-		perror("mmap failed");
-		kp->kernproxy_errno = EKU_NOTREADY;
+	if (attach_channels(handle, chan_id, 1, size, domain, &channel))
 		return NULL;
+	return channel;
+}
+
+/**
+ *	Attaches to the 'count' channels of size 'size' starting at channel
+ *	'first' on the KUP device corresponding to 'handle', all at once, and
+ *	stores their handles in 'out'. This maps all of them with a single
+ *	mmap, which makes it much cheaper than calling kernproxy_channel() for
+ *	each of them. If any of the channels is already taken, none of them is
+ *	attached and the error code is set to EKU_BUSY.
+ *
+ *	Returns 0 on success and -1 on failure.
+ */
+KERNPROXY_API
+int
+kernproxy_channels(void* handle, size_t first, size_t count, size_t size,
+		void* out[])
+{
+	return attach_channels(handle, first, count, size, KP_DOMAIN_ANY, out);
+}
+
+/**
+ *	Stores the handles of up to 'max' of the channels attached through
+ *	'handle' in 'out', in the order they were attached, and returns how many
+ *	channels are attached through it.
+ */
+KERNPROXY_API
+size_t
+kernproxy_attached(void* handle, void* out[], size_t max)
+{
+	kernproxy_t* kp = (kernproxy_t*) handle;
+
+	for (size_t i = 0; i < kp->channel_cnt && i < max; i++)
+		out[i] = kp->channels[i];
+	return kp->channel_cnt;
+}
+
+/**
+ *	Returns the largest message that can be sent on channel 'channelp'.
+ */
+KERNPROXY_API
+size_t
+kernproxy_send_max(void* channelp)
+{
+	channel_t* channel = (channel_t*)channelp;
+	return CHAN_SEND_MAX(channel);
+}
+
+/**
+ *	Returns the index of channel 'channelp' in its KUP device.
+ */
+KERNPROXY_API
+size_t
+kernproxy_channel_index(void* channelp)
+{
+	channel_t* channel = (channel_t*)channelp;
+	return *CHAN_INDEX(channel);
+}
+
+/**
+ *	Fills in 'geo' with the current geometry of the KUP device corresponding
+ *	to 'handle'. Returns 0 on success and -1 on failure.
+ */
+KERNPROXY_API
+int
+kernproxy_geometry(void* handle, struct kernproxy_geometry* geo)
+{
+	kernproxy_t* kp = (kernproxy_t*) handle;
+	struct kup_geometry kg;
+
+	if (kp->loop)
+		kuploop_geometry(kp->loop, &kg);
+	else if (MAYINT(ioctl(kp->fd, KUPIOC_GEOMETRY, &kg)) == -1)
+		return -1;
+	geo->version = kg.kg_version;
+	geo->channels = kg.kg_channels;
+	geo->size = kg.kg_size;
+	geo->rsize = kg.kg_rsize;
+	geo->free = kg.kg_free;
+	return 0;
+}
+
+/**
+ *	Returns the NUMA domain the kernel allocated the memory of channel
+ *	'channelp' from.
+ */
+KERNPROXY_API
+int
+kernproxy_channel_domain(void* channelp)
+{
+	channel_t* channel = (channel_t*)channelp;
+	return *CHAN_DOMAIN(channel);
+}
+
+/**
+ *	Returns the CPU the kernel side has bound channel 'channelp' to with
+ *	kupdev_bind_cpu(), or KP_CPU_NONE. The binding may change while the
+ *	channel is attached.
+ */
+KERNPROXY_API
+int
+kernproxy_channel_cpu(void* channelp)
+{
+	channel_t* channel = (channel_t*)channelp;
+	return __atomic_load_n(CHAN_CPU(channel), __ATOMIC_RELAXED);
+}
+
+int
+kup_pin_thread(pthread_t thread, int cpu)
+{
+#if defined(__FreeBSD__)
+	cpuset_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+#elif defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(thread, sizeof(set), &set);
+#else
+	return (EOPNOTSUPP);
+#endif
+}
+
+/**
+ *	Pins the calling thread to the CPU channel 'channelp' is bound to, so
+ *	that it runs next to the kernel producer of the channel. Call it again
+ *	if the kernel side moves the channel to another CPU.
+ *
+ *	Returns 0 on success. Returns -1 with the error code set to EKU_UNBOUND
+ *	if the channel is not bound to a CPU, and with errno set if the thread
+ *	could not be pinned.
+ */
+KERNPROXY_API
+int
+kernproxy_pin(void* channelp)
+{
+	channel_t* channel = (channel_t*)channelp;
+	kernproxy_t* kp = (kernproxy_t*) channel->handle;
+	int cpu, error;
+
+	cpu = kernproxy_channel_cpu(channelp);
+	if (cpu == KP_CPU_NONE) {
+		kp->kernproxy_errno = EKU_UNBOUND;
+		return -1;
 	}
-	channel_t* chan = malloc(sizeof(*chan));
-	chan->mem	= mem;
-	chan->size	= size;
-	chan->handle = handle;
-	return chan;
+	error = kup_pin_thread(pthread_self(), cpu);
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
 }
 
 /**
@@ -285,6 +700,19 @@ kernproxy_channel(void* handle, size_t chan_id, size_t size)
 KERNPROXY_API
 void*
 kernproxy_receive(void* channelp, int flags)
+{
+	return kernproxy_receive_msg(channelp, flags, NULL);
+}
+
+/**
+ *	Same as kernproxy_receive(), but also stores the length of the received
+ *	message in 'len' unless it is NULL. Short messages are passed inline in
+ *	the control page, so the returned pointer is only valid until the turn
+ *	goes back to the kernel, like that of kernproxy_receive().
+ */
+KERNPROXY_API
+void*
+kernproxy_receive_msg(void* channelp, int flags, size_t* len)
 {
 	channel_t* channel = (channel_t*)channelp;
 	kernproxy_t* kp = (kernproxy_t*) channel->handle;
@@ -300,7 +728,16 @@ kernproxy_receive(void* channelp, int flags)
 		}
 	} else
 		wait_for_turn(channel);
-	return CHAN_DATA_RECV(channel);
+	size_t msg_len;
+	void* msg = chan_read(channel, CHAN_DATA_RECV(channel),
+			channel->size * PAGE_SIZE, &msg_len);
+	struct kup_capture* cap = channel_capture(channel);
+	// The turn also comes back when the kernel side shuts down.
+	if (cap && *CHAN_CMD(channel) != CMD_CLOSE)
+		kup_capture_record(cap, channel, KUP_CAPTURE_IN, msg, msg_len);
+	if (len)
+		*len = msg_len;
+	return msg;
 }
 
 /**
@@ -310,6 +747,8 @@ kernproxy_receive(void* channelp, int flags)
  *	@param flags: If flags contains KP_NB, then the function terminates
  *	immediately if the channel is not ready for transmission. Otherwise,
  *	it blocks until the channel is ready.
+ *
+ *	Fails with EKU_SIZE if 'len' is more than kernproxy_send_max() bytes.
  */
 KERNPROXY_API
 int
@@ -317,6 +756,10 @@ kernproxy_send(void* channelp, void *data, size_t len, int flags)
 {
 	channel_t* channel = (channel_t*)channelp;
 	kernproxy_t* kp = (kernproxy_t*) channel->handle;
+	if (len > CHAN_SEND_MAX(channel)) {
+		kp->kernproxy_errno = EKU_SIZE;
+		return -1;
+	}
 	if (flags & KP_NB) {
 		if (!is_our_turn(channel)) {
 			kp->kernproxy_errno = EKU_NOTREADY;
@@ -324,20 +767,87 @@ kernproxy_send(void* channelp, void *data, size_t len, int flags)
 		}
 	} else
 		wait_for_turn(channel);
-	memcpy(CHAN_DATA_SEND(channel), data, len);
+	struct kup_capture* cap = channel_capture(channel);
+	if (cap)
+		kup_capture_record(cap, channel, KUP_CAPTURE_OUT, data, len);
+	chan_write(channel, CHAN_DATA_SEND(channel), data, len);
 	switch_turn(channel);
 	return (0);
 }
 
 /**
- *	Closes the KUP device pointed to by 'handle'. This will release the kernel
- *	resources allocated for this instance.
+ *	Gives up the memory of channel 'chan' attached through 'kp'. The user
+ *	space stand-in is told right away that the channel is detached, while the
+ *	kernel only learns about it from the caller.
+ */
+static void
+unmap_channel(kernproxy_t* kp, channel_t* chan)
+{
+	if (kp->loop)
+		kuploop_detach(kp->loop, *CHAN_INDEX(chan));
+	else
+		munmap(chan->mem, CHAN_SIZE(chan->size, chan->rsize));
+}
+
+/**
+ *	Detaches from channel 'channelp' and unmaps its memory, without closing
+ *	the KUP device. The kernel takes the channel back right away and another
+ *	daemon can attach to it. The handle of the channel is freed, so it must
+ *	not be in use by any other thread, or in a dispatch engine.
+ *
+ *	Returns 0 on success and -1 on failure, with errno set.
+ */
+KERNPROXY_API
+int
+kernproxy_channel_close(void* channelp)
+{
+	channel_t* channel = (channel_t*)channelp;
+	kernproxy_t* kp = (kernproxy_t*) channel->handle;
+	uint32_t index = *CHAN_INDEX(channel);
+	size_t i;
+	int error = 0;
+
+	for (i = 0; i < kp->channel_cnt && kp->channels[i] != channel; i++)
+		;
+	if (i == kp->channel_cnt) {
+		errno = EINVAL;
+		return -1;
+	}
+	// Keep the rest in the order they were attached, see kernproxy_attached().
+	memmove(&kp->channels[i], &kp->channels[i + 1],
+			(kp->channel_cnt - i - 1) * sizeof(*kp->channels));
+	kp->channel_cnt--;
+	unmap_channel(kp, channel);
+	if (!kp->loop && MAYINT(ioctl(kp->fd, KUPIOC_DETACH, &index)) == -1)
+		error = -1;
+	free(channel);
+	return error;
+}
+
+/**
+ *	Closes the KUP device pointed to by 'handle', and releases everything
+ *	allocated for it. The kernel takes back the channels attached through
+ *	'handle', unless another process still has the device file open, see
+ *	kernproxy_handoff(). A capture still running on 'handle' is stopped.
+ *	Neither 'handle' nor its channels can be used afterwards.
  */
 KERNPROXY_API
 void
 kernproxy_close(void* handle)
 {
 	kernproxy_t* kp = (kernproxy_t*) handle;
-	MAYINT(close(kp->fd));
+
+	if (kp->capture)
+		kernproxy_capture_stop(kp);
+	for (size_t i = 0; i < kp->channel_cnt; i++) {
+		unmap_channel(kp, kp->channels[i]);
+		free(kp->channels[i]);
+	}
+	free(kp->channels);
+	if (kp->kdf >= 0)
+		MAYINT(close(kp->kdf));
+	if (kp->fd >= 0)
+		MAYINT(close(kp->fd));
+	free(kp);
 }
 
@@ -0,0 +1,633 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "kup.h"
+#include "kup_private.h"
+#include "kup_stats.h"
+#include "kuploop.h"
+
+#define KUPLOOP_API
+
+// The number of times the kernel side polls the turn before it starts
+// yielding the processor. Same as in the kernel module.
+#define KUPLOOP_SPIN	2000000
+
+// Same as KUP_ANY_SPIN in the kernel module.
+#define KUPLOOP_ANY_SPIN	1024
+
+// CPUs that can have a channel bound to them.
+#define KUPLOOP_MAXCPU	256
+
+enum {
+		CHAN_PENDING,
+		CHAN_READY
+};
+
+struct loop_channel {
+	_Alignas(CACHE_LINE_SIZE)
+	// The view of the channel from user space, which is all we need to
+	// locate the control page and the data regions.
+	channel_t		chan;
+	int				attached;
+	volatile int	status;
+	// CPU the channel is bound to, or KP_CPU_NONE.
+	int				cpu;
+	// Serializes kuploop_send_local() and kuploop_send_flow().
+	pthread_mutex_t	send_lock;
+};
+
+struct kuploop {
+	pthread_mutex_t		lock;
+	pthread_cond_t		condvar;
+	size_t				size;
+	size_t				rsize;
+	size_t				channel_cnt;
+	uint8_t*			mem;
+	volatile int		disabled;
+	// The channel bound to each CPU, or -1.
+	volatile int		cpu_channel[KUPLOOP_MAXCPU];
+	// Where kuploop_send_any() starts looking.
+	size_t				any_next;
+	// The statistics of the channels, kept the way the kernel module does.
+	struct kup_chan_stats*	stats;
+	struct loop_channel	channels[];
+};
+
+/**
+ *	Creates a stand-in for a KUP device with 'chan_cnt' channels of 'size'
+ *	pages each, the same as kupdev_create() would.
+ */
+KUPLOOP_API
+struct kuploop*
+kuploop_create(size_t size, size_t chan_cnt)
+{
+	return kuploop_create_asym(size, size, chan_cnt);
+}
+
+/**
+ *	Same as kuploop_create(), with 'rsize' pages for the messages of the
+ *	daemon, like kupdev_create_asym().
+ */
+KUPLOOP_API
+struct kuploop*
+kuploop_create_asym(size_t size, size_t rsize, size_t chan_cnt)
+{
+	struct kuploop* loop;
+	size_t loop_size;
+
+	loop_size = roundup(sizeof(*loop) + chan_cnt * sizeof(struct loop_channel),
+					CACHE_LINE_SIZE);
+	loop = aligned_alloc(CACHE_LINE_SIZE, loop_size);
+	if (loop == NULL)
+		return NULL;
+	memset(loop, 0, loop_size);
+	loop->mem = mmap(NULL, chan_cnt * CHAN_SIZE(size, rsize),
+					PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANON, -1, 0);
+	if (loop->mem == MAP_FAILED) {
+		free(loop);
+		return NULL;
+	}
+	// Cache line aligned, so that channels do not share cache lines of counters.
+	loop->stats = aligned_alloc(CACHE_LINE_SIZE,
+					chan_cnt * sizeof(*loop->stats));
+	if (loop->stats == NULL) {
+		munmap(loop->mem, chan_cnt * CHAN_SIZE(size, rsize));
+		free(loop);
+		return NULL;
+	}
+	memset(loop->stats, 0, chan_cnt * sizeof(*loop->stats));
+	pthread_mutex_init(&loop->lock, NULL);
+	pthread_cond_init(&loop->condvar, NULL);
+	loop->size = size;
+	loop->rsize = rsize;
+	loop->channel_cnt = chan_cnt;
+	for (int cpu = 0; cpu < KUPLOOP_MAXCPU; cpu++)
+		loop->cpu_channel[cpu] = -1;
+	for (size_t i = 0; i < chan_cnt; i++) {
+		loop->channels[i].cpu = KP_CPU_NONE;
+		pthread_mutex_init(&loop->channels[i].send_lock, NULL);
+		channel_t* chan = &loop->channels[i].chan;
+		chan->mem = loop->mem + i * CHAN_SIZE(size, rsize);
+		chan->size = size;
+		chan->rsize = rsize;
+		chan->handle = loop;
+	}
+	return loop;
+}
+
+/**
+ *	Returns a handle that can be passed to kernproxy_channel() in place of
+ *	one returned by kernproxy_open().
+ */
+KUPLOOP_API
+void*
+kuploop_open(struct kuploop* loop)
+{
+	kernproxy_t* kp = calloc(1, sizeof(*kp));
+	if (kp == NULL)
+		return NULL;
+	kp->fd = -1;
+	kp->kdf = -1;
+	kp->size = loop->size;
+	kp->rsize = loop->rsize;
+	kp->loop = loop;
+	return kp;
+}
+
+void
+kuploop_detach(struct kuploop* loop, size_t index)
+{
+	struct loop_channel* lc = &loop->channels[index];
+
+	pthread_mutex_lock(&loop->lock);
+	lc->attached = 0;
+	lc->status = CHAN_PENDING;
+	loop->stats[index].ks_detaches++;
+	loop->stats[index].ks_pid = 0;
+	pthread_mutex_unlock(&loop->lock);
+}
+
+void
+kuploop_geometry(struct kuploop* loop, struct kup_geometry* geo)
+{
+	geo->kg_version = KUP_ABI_VERSION;
+	geo->kg_page_size = PAGE_SIZE;
+	geo->kg_channels = loop->channel_cnt;
+	geo->kg_size = loop->size;
+	geo->kg_rsize = loop->rsize;
+	geo->kg_free = 0;
+	pthread_mutex_lock(&loop->lock);
+	for (size_t i = 0; i < loop->channel_cnt; i++)
+		if (!loop->channels[i].attached)
+			geo->kg_free++;
+	pthread_mutex_unlock(&loop->lock);
+}
+
+/**
+ *	Attaches the 'count' channels starting at 'first', or any free channel if
+ *	'first' is KP_CHAN_ANY, the way the kernel does on mmap. The memory of the
+ *	channels is contiguous, and the memory of the first one is returned.
+ *	Returns NULL with errno set to EBUSY if any of the channels is taken.
+ */
+uint8_t*
+kuploop_attach(struct kuploop* loop, size_t first, size_t count, size_t size,
+		int domain)
+{
+	uint8_t* mem = NULL;
+	size_t i;
+
+	pthread_mutex_lock(&loop->lock);
+	if (loop->disabled || size != loop->size || count == 0)
+		goto out;
+	if (first == KP_CHAN_ANY) {
+		if (count != 1)
+			goto out;
+		for (i = 0; i < loop->channel_cnt; i++)
+			if (!loop->channels[i].attached)
+				break;
+		if (i == loop->channel_cnt)
+			goto out;
+		first = i;
+	} else {
+		if (first >= loop->channel_cnt || count > loop->channel_cnt - first)
+			goto out;
+		for (i = first; i < first + count; i++) {
+			if (loop->channels[i].attached) {
+				errno = EBUSY;
+				goto out;
+			}
+		}
+	}
+	for (i = first; i < first + count; i++) {
+		struct loop_channel* lc = &loop->channels[i];
+		lc->attached = 1;
+		lc->status = CHAN_PENDING;
+		*CHAN_CMD(&lc->chan) = CMD_ACTIVE;
+		*CHAN_DOMAIN(&lc->chan) = domain == KP_DOMAIN_ANY ? 0 : domain;
+		*CHAN_CPU(&lc->chan) = lc->cpu;
+		*CHAN_INDEX(&lc->chan) = i;
+		loop->stats[i].ks_attaches++;
+		loop->stats[i].ks_pid = getpid();
+		set_turn(&lc->chan, KERNEL);
+	}
+	pthread_cond_broadcast(&loop->condvar);
+	mem = loop->channels[first].chan.mem;
+out:
+	pthread_mutex_unlock(&loop->lock);
+	return mem;
+}
+
+/**
+ *	Blocks until a channel has been attached from user space and returns
+ *	its index, like kupdev_wait_channel(). Returns -1 once the stand-in has
+ *	been unloaded.
+ */
+KUPLOOP_API
+int
+kuploop_wait_channel(struct kuploop* loop)
+{
+	int chan_id = -1;
+
+	pthread_mutex_lock(&loop->lock);
+	while (!loop->disabled && chan_id < 0) {
+		for (size_t i = 0; i < loop->channel_cnt; i++) {
+			struct loop_channel* lc = &loop->channels[i];
+			if (lc->attached && lc->status == CHAN_PENDING) {
+				lc->status = CHAN_READY;
+				chan_id = i;
+				break;
+			}
+		}
+		if (chan_id < 0)
+			pthread_cond_wait(&loop->condvar, &loop->lock);
+	}
+	pthread_mutex_unlock(&loop->lock);
+	return chan_id;
+}
+
+static uint64_t
+loop_clock(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ *	Blocks until the daemon passes the turn on 'lc' to the kernel side.
+ *	Polls for a while and then starts yielding the processor between polls.
+ *	The time spent waiting goes to the statistics of the channel, with the
+ *	yields standing in for the sleeps of the kernel module.
+ *
+ *	Returns non-zero if the stand-in is being unloaded.
+ */
+static int
+loop_wait_for_turn(struct kuploop* loop, struct loop_channel* lc)
+{
+	struct kup_chan_stats* stats = &loop->stats[lc - loop->channels];
+	uint64_t start = 0, yielded = 0, t;
+	int cnt = 0, yields = 0;
+	while (__atomic_load_n(CHAN_TURN(&lc->chan), __ATOMIC_ACQUIRE) == DAEMON &&
+			lc->status == CHAN_READY && !loop->disabled) {
+		if (start == 0) {
+			start = loop_clock();
+			stats->ks_wait_start = start;
+		}
+		if (cnt < KUPLOOP_SPIN) {
+			cnt++;
+			cpu_spinwait();
+		} else {
+			t = loop_clock();
+			sched_yield();
+			yielded += loop_clock() - t;
+			yields++;
+		}
+	}
+	if (start != 0)
+		stats->ks_wait_start = 0;
+	if (lc->status != CHAN_READY || loop->disabled)
+		return (1);
+	if (start != 0) {
+		stats->ks_spin_ns += loop_clock() - start - yielded;
+		stats->ks_sleep_ns += yielded;
+		stats->ks_sleeps += yields;
+	}
+	return (0);
+}
+
+/**
+ *	Sends 'len' bytes from 'data' to the daemon on channel 'chan_id',
+ *	blocking until it is our turn, like kupdev_send(). Fails with -1 as well
+ *	if 'len' is more than the 'size' pages of the channels.
+ */
+KUPLOOP_API
+int
+kuploop_send(struct kuploop* loop, void *data, size_t len, int chan_id)
+{
+	struct loop_channel* lc = &loop->channels[chan_id];
+	if (lc->status != CHAN_READY || len > loop->size * PAGE_SIZE)
+		return (-1);
+	if (loop_wait_for_turn(loop, lc))
+		return (-2);
+	chan_write(&lc->chan, CHAN_DATA_RECV(&lc->chan), data, len);
+	loop->stats[chan_id].ks_msgs_out++;
+	loop->stats[chan_id].ks_bytes_out += len;
+	set_turn(&lc->chan, DAEMON);
+	return (0);
+}
+
+/**
+ *	Binds channel 'chan_id' to CPU 'cpu', or unbinds it if 'cpu' is
+ *	KP_CPU_NONE, like kupdev_bind_cpu(). Returns 0 or EINVAL.
+ */
+KUPLOOP_API
+int
+kuploop_bind_cpu(struct kuploop* loop, int chan_id, int cpu)
+{
+	struct loop_channel* lc;
+
+	if (chan_id < 0 || (size_t)chan_id >= loop->channel_cnt ||
+			cpu < KP_CPU_NONE || cpu >= KUPLOOP_MAXCPU)
+		return (EINVAL);
+	lc = &loop->channels[chan_id];
+	pthread_mutex_lock(&loop->lock);
+	if (cpu != KP_CPU_NONE && loop->cpu_channel[cpu] >= 0) {
+		struct loop_channel* old = &loop->channels[loop->cpu_channel[cpu]];
+		old->cpu = KP_CPU_NONE;
+		*CHAN_CPU(&old->chan) = KP_CPU_NONE;
+	}
+	if (lc->cpu != KP_CPU_NONE)
+		__atomic_store_n(&loop->cpu_channel[lc->cpu], -1, __ATOMIC_RELEASE);
+	lc->cpu = cpu;
+	*CHAN_CPU(&lc->chan) = cpu;
+	if (cpu != KP_CPU_NONE)
+		__atomic_store_n(&loop->cpu_channel[cpu], chan_id, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&loop->lock);
+	return (0);
+}
+
+/**
+ *	Sends on the channel bound to the CPU we are running on, like
+ *	kupdev_send_local(). Returns -4 if there is none, and -5 if another
+ *	thread is sending on it through this function.
+ */
+KUPLOOP_API
+int
+kuploop_send_local(struct kuploop* loop, void *data, size_t len)
+{
+	struct loop_channel* lc;
+	int cpu, chan_id, error;
+
+	cpu = sched_getcpu();
+	if (cpu < 0 || cpu >= KUPLOOP_MAXCPU)
+		return (-4);
+	chan_id = __atomic_load_n(&loop->cpu_channel[cpu], __ATOMIC_ACQUIRE);
+	if (chan_id < 0)
+		return (-4);
+	lc = &loop->channels[chan_id];
+	if (pthread_mutex_trylock(&lc->send_lock))
+		return (-5);
+	error = kuploop_send(loop, data, len, chan_id);
+	pthread_mutex_unlock(&lc->send_lock);
+	return (error);
+}
+
+/**
+ *	Jump consistent hash of 'key' over 'buckets' buckets, as in the kernel
+ *	module.
+ */
+static int
+jump_hash(uint64_t key, int buckets)
+{
+	int64_t b = -1, j = 0;
+
+	while (j < buckets) {
+		b = j;
+		key = key * 2862933555777941757ULL + 1;
+		j = (b + 1) * ((int64_t)1 << 31) / (int64_t)((key >> 33) + 1);
+	}
+	return (b);
+}
+
+/**
+ *	Sends on the channel 'flow_key' hashes to, like kupdev_send_flow().
+ *	Returns -4 if no channel has been taken up.
+ */
+KUPLOOP_API
+int
+kuploop_send_flow(struct kuploop* loop, uint64_t flow_key, void *data,
+		size_t len)
+{
+	struct loop_channel* lc;
+	int chan_id, error;
+
+	chan_id = jump_hash(flow_key, loop->channel_cnt);
+	if (loop->channels[chan_id].status != CHAN_READY) {
+		size_t ready = 0, i;
+		int pick;
+
+		pthread_mutex_lock(&loop->lock);
+		for (i = 0; i < loop->channel_cnt; i++)
+			ready += loop->channels[i].status == CHAN_READY;
+		chan_id = -1;
+		if (ready > 0) {
+			pick = jump_hash(flow_key, ready);
+			for (i = 0; i < loop->channel_cnt; i++) {
+				if (loop->channels[i].status == CHAN_READY && pick-- == 0) {
+					chan_id = i;
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&loop->lock);
+		if (chan_id < 0)
+			return (-4);
+	}
+	lc = &loop->channels[chan_id];
+	pthread_mutex_lock(&lc->send_lock);
+	error = kuploop_send(loop, data, len, chan_id);
+	pthread_mutex_unlock(&lc->send_lock);
+	return (error);
+}
+
+/**
+ *	Looks for a taken up channel that is our turn, round robin, and locks it
+ *	for sending. Returns its index, -1 if none is idle, and -4 if no channel
+ *	has been taken up.
+ */
+static int
+loop_find_idle(struct kuploop* loop)
+{
+	int chan_id = -4;
+
+	pthread_mutex_lock(&loop->lock);
+	for (size_t i = 0; i < loop->channel_cnt; i++) {
+		size_t k = (loop->any_next + i) % loop->channel_cnt;
+		struct loop_channel* lc = &loop->channels[k];
+		if (lc->status != CHAN_READY)
+			continue;
+		chan_id = -1;
+		if (__atomic_load_n(CHAN_TURN(&lc->chan), __ATOMIC_ACQUIRE) ==
+				KERNEL && pthread_mutex_trylock(&lc->send_lock) == 0) {
+			loop->any_next = k + 1;
+			chan_id = k;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&loop->lock);
+	return (chan_id);
+}
+
+/**
+ *	Sends on any taken up channel that is our turn, like kupdev_send_any().
+ *	Returns the index of the channel, -2 once the stand-in has been unloaded
+ *	and -4 if no channel has been taken up.
+ */
+KUPLOOP_API
+int
+kuploop_send_any(struct kuploop* loop, void *data, size_t len)
+{
+	int chan_id, error, rounds = 0;
+
+	for (;;) {
+		if (loop->disabled)
+			return (-2);
+		chan_id = loop_find_idle(loop);
+		if (chan_id == -4)
+			return (-4);
+		if (chan_id >= 0) {
+			error = kuploop_send(loop, data, len, chan_id);
+			pthread_mutex_unlock(&loop->channels[chan_id].send_lock);
+			if (error == 0)
+				return (chan_id);
+			if (error == -2)
+				return (-2);
+			continue;
+		}
+		if (rounds < KUPLOOP_ANY_SPIN) {
+			rounds++;
+			cpu_spinwait();
+		} else
+			sched_yield();
+	}
+}
+
+/**
+ *	Blocks until we get the turn on channel 'chan_id' and returns a pointer
+ *	to the data written by the daemon, like kupdev_receive().
+ */
+KUPLOOP_API
+void*
+kuploop_receive(struct kuploop* loop, int chan_id)
+{
+	return kuploop_receive_msg(loop, chan_id, NULL);
+}
+
+/**
+ *	Same as kuploop_receive(), but also stores the length of the message in
+ *	'len' unless it is NULL, like kupdev_receive_msg().
+ */
+KUPLOOP_API
+void*
+kuploop_receive_msg(struct kuploop* loop, int chan_id, size_t* len)
+{
+	struct loop_channel* lc = &loop->channels[chan_id];
+	void* data;
+	size_t n;
+
+	if (lc->status != CHAN_READY)
+		return (NULL);
+	if (loop_wait_for_turn(loop, lc))
+		return (NULL);
+	data = chan_read(&lc->chan, CHAN_DATA_SEND(&lc->chan),
+			CHAN_SEND_MAX(&lc->chan), &n);
+	loop->stats[chan_id].ks_msgs_in++;
+	loop->stats[chan_id].ks_bytes_in += n;
+	if (len)
+		*len = n;
+	return data;
+}
+
+/**
+ *	Returns the statistics of the channels of the stand-in, in the same
+ *	form as kernproxy_stats() does for a device, and stores the number of
+ *	channels in 'count'.
+ */
+KUPLOOP_API
+const struct kup_chan_stats*
+kuploop_stats(struct kuploop* loop, size_t* count)
+{
+	*count = loop->channel_cnt;
+	return loop->stats;
+}
+
+/**
+ *	Passes the turn on channel 'chan_id' to the daemon with an empty message.
+ */
+KUPLOOP_API
+void
+kuploop_pass(struct kuploop* loop, int chan_id)
+{
+	kuploop_send(loop, "", 1, chan_id);
+}
+
+/**
+ *	Tells every attached daemon to shut down and wakes up anybody blocked
+ *	on the stand-in, like kupdev_unload() does for a device.
+ */
+KUPLOOP_API
+void
+kuploop_unload(struct kuploop* loop)
+{
+	pthread_mutex_lock(&loop->lock);
+	loop->disabled = 1;
+	for (size_t i = 0; i < loop->channel_cnt; i++) {
+		struct loop_channel* lc = &loop->channels[i];
+		lc->status = CHAN_PENDING;
+		if (lc->attached) {
+			*CHAN_CMD(&lc->chan) = CMD_CLOSE;
+			set_turn(&lc->chan, DAEMON);
+		}
+	}
+	pthread_cond_broadcast(&loop->condvar);
+	pthread_mutex_unlock(&loop->lock);
+}
+
+/**
+ *	Frees the stand-in. Handles and channels obtained from it must no longer
+ *	be used.
+ */
+KUPLOOP_API
+void
+kuploop_destroy(struct kuploop* loop)
+{
+	munmap(loop->mem, loop->channel_cnt * CHAN_SIZE(loop->size, loop->rsize));
+	for (size_t i = 0; i < loop->channel_cnt; i++)
+		pthread_mutex_destroy(&loop->channels[i].send_lock);
+	pthread_cond_destroy(&loop->condvar);
+	pthread_mutex_destroy(&loop->lock);
+	free(loop->stats);
+	free(loop);
+}
@@ -0,0 +1,95 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#pragma once
+
+/**
+ * A user space stand-in for the kernel side of a KUP device. It implements
+ * the kernel half of the shared memory protocol on top of an anonymous
+ * mapping, with the same calling conventions as the kupdev_* kernel API, so
+ * that programs written against libkup can be exercised and benchmarked
+ * without the kernel module, and on systems other than FreeBSD.
+ *
+ * The handle returned by kuploop_open() is used with the regular
+ * kernproxy_* functions. The kuploop_* functions play the role of the
+ * kernel module and are usually called from a separate thread.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct kuploop;
+
+extern struct kuploop* kuploop_create(size_t size, size_t chan_cnt);
+
+extern struct kuploop* kuploop_create_asym(size_t size, size_t rsize,
+		size_t chan_cnt);
+
+extern void* kuploop_open(struct kuploop* loop);
+
+extern int kuploop_wait_channel(struct kuploop* loop);
+
+extern int kuploop_send(struct kuploop* loop, void *data, size_t len,
+		int chan_id);
+
+extern int kuploop_bind_cpu(struct kuploop* loop, int chan_id, int cpu);
+
+extern int kuploop_send_local(struct kuploop* loop, void *data, size_t len);
+
+extern int kuploop_send_flow(struct kuploop* loop, uint64_t flow_key,
+		void *data, size_t len);
+
+extern int kuploop_send_any(struct kuploop* loop, void *data, size_t len);
+
+extern void* kuploop_receive(struct kuploop* loop, int chan_id);
+
+extern void* kuploop_receive_msg(struct kuploop* loop, int chan_id,
+		size_t* len);
+
+extern void kuploop_pass(struct kuploop* loop, int chan_id);
+
+struct kup_chan_stats;
+
+extern const struct kup_chan_stats* kuploop_stats(struct kuploop* loop,
+		size_t* count);
+
+extern void kuploop_unload(struct kuploop* loop);
+
+extern void kuploop_destroy(struct kuploop* loop);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,384 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * An iperf-like tool for KUP. Runs against the kupperf kernel module, or
+ * against a stand-in for the module that runs the same code on top of
+ * kuploop (-l), so the numbers from a FreeBSD host and from a Linux box can
+ * be compared. One thread per channel plays the daemon side. Reports the
+ * throughput and CPU usage of either side, and histograms of how long each
+ * side waits for the turn to come back.
+ *
+ * usage: kupperf [-l] [-d device] [-m echo|sink|generator] [-P channels]
+ *                [-s msg_size] [-b batch] [-t seconds]
+ *
+ *   -l            run against the user space stand-in for the module
+ *   -d device     KUP device of the module (default /dev/kupperf)
+ *   -m mode       what the module does with the messages (default echo)
+ *   -P channels   number of channels to run on in parallel (default 1)
+ *   -s msg_size   size of a message, k and m suffixes allowed (default 64)
+ *   -b batch      number of messages passed per turn (default 1)
+ *   -t seconds    duration of the run (default 10)
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "../kuplib/kup.h"
+#include "../kuplib/kuploop.h"
+#include "kupperf.h"
+
+struct session {
+	int						index;
+	void*					channel;
+	pthread_t				thread;
+	// What we have received, or sent as the source of a sink
+	uint64_t				msgs;
+	uint64_t				bytes;
+	uint64_t				elapsed_ns;
+	uint64_t				cpu_ns;
+	// Time from passing the turn to the module to getting it back
+	uint64_t				hist[KUPPERF_BUCKETS];
+	struct kupperf_report	report;
+};
+
+static const char* modes[] = { "echo", "sink", "generator" };
+static struct kupperf_config conf = {
+	.kc_msg = { KUPPERF_CONFIG, 0 },
+	.kc_mode = KUPPERF_ECHO,
+	.kc_size = 64,
+	.kc_batch = 1,
+	.kc_duration_ms = 10000
+};
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void*
+module_main(void* arg)
+{
+	kupperf_serve(arg);
+	return (NULL);
+}
+
+static void*
+session_main(void* arg)
+{
+	struct session* s = arg;
+	struct kupperf_msg ack = { KUPPERF_DATA, 0 }, bye = { KUPPERF_BYE, 0 };
+	struct kupperf_hello hello;
+	size_t len, room, total = (size_t)conf.kc_size * conf.kc_batch;
+	uint8_t* payload = NULL;
+	void* msg;
+
+	msg = kernproxy_receive_msg(s->channel, 0, &len);
+	if (msg == NULL || len < sizeof(hello)) {
+		fprintf(stderr, "channel %d: no hello from the module\n", s->index);
+		exit(1);
+	}
+	memcpy(&hello, msg, sizeof(hello));
+	if (hello.kh_msg.km_type != KUPPERF_HELLO ||
+		hello.kh_magic != KUPPERF_MAGIC ||
+		hello.kh_version != KUPPERF_VERSION) {
+		fprintf(stderr, "channel %d: not a kupperf module\n", s->index);
+		exit(1);
+	}
+	if (conf.kc_mode == KUPPERF_GENERATOR)
+		room = hello.kh_max_send;
+	else {
+		room = kernproxy_send_max(s->channel);
+		if (room > hello.kh_max_receive)
+			room = hello.kh_max_receive;
+	}
+	if (total > room) {
+		fprintf(stderr, "channel %d: a batch of %zu bytes does not fit in "
+				"the %zu bytes of the channel\n", s->index, total, room);
+		exit(1);
+	}
+	if (conf.kc_mode != KUPPERF_GENERATOR) {
+		payload = malloc(total);
+		memset(payload, 'u', total);
+		((struct kupperf_msg*)payload)->km_type = KUPPERF_DATA;
+		((struct kupperf_msg*)payload)->km_count = conf.kc_batch;
+	}
+
+	kernproxy_send(s->channel, &conf, sizeof(conf), 0);
+	uint64_t start = clock_ns(CLOCK_MONOTONIC), sent = start;
+	uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+	for (;;) {
+		msg = kernproxy_receive_msg(s->channel, 0, &len);
+		if (msg == NULL || len < sizeof(struct kupperf_msg)) {
+			fprintf(stderr, "channel %d: the module went away\n", s->index);
+			exit(1);
+		}
+		const struct kupperf_msg* m = msg;
+		if (m->km_type == KUPPERF_DONE) {
+			memcpy(&s->report, msg,
+					len < sizeof(s->report) ? len : sizeof(s->report));
+			break;
+		}
+		s->hist[kupperf_bucket(clock_ns(CLOCK_MONOTONIC) - sent)]++;
+		switch (conf.kc_mode) {
+		case KUPPERF_GENERATOR:
+			s->msgs += m->km_count;
+			s->bytes += len;
+			kernproxy_send(s->channel, &ack, sizeof(ack), 0);
+			break;
+		case KUPPERF_SINK:
+			s->msgs += conf.kc_batch;
+			s->bytes += total;
+			kernproxy_send(s->channel, payload, total, 0);
+			break;
+		case KUPPERF_ECHO:
+			// The first turn of the module carries no messages.
+			if (m->km_count) {
+				s->msgs += m->km_count;
+				s->bytes += len;
+			}
+			kernproxy_send(s->channel, payload, total, 0);
+			break;
+		}
+		sent = clock_ns(CLOCK_MONOTONIC);
+	}
+	s->elapsed_ns = clock_ns(CLOCK_MONOTONIC) - start;
+	s->cpu_ns = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	kernproxy_send(s->channel, &bye, sizeof(bye), 0);
+	free(payload);
+	return (NULL);
+}
+
+static const char*
+format_ns(char* buf, size_t size, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, size, "%juns", (uintmax_t)ns);
+	else if (ns < 1000000)
+		snprintf(buf, size, "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(buf, size, "%.1fms", ns / 1e6);
+	else
+		snprintf(buf, size, "%.1fs", ns / 1e9);
+	return (buf);
+}
+
+static void
+print_hist(const char* title, const uint64_t* hist)
+{
+	uint64_t cnt = 0, max = 0, sum = 0;
+	double marks[] = { 50, 99, 99.9 };
+	size_t mark = 0;
+	char lo[16], hi[16];
+
+	for (int b = 0; b < KUPPERF_BUCKETS; b++) {
+		cnt += hist[b];
+		if (hist[b] > max)
+			max = hist[b];
+	}
+	printf("\n%s, %ju turns\n", title, (uintmax_t)cnt);
+	if (cnt == 0)
+		return;
+	for (int b = 0; b < KUPPERF_BUCKETS; b++) {
+		if (hist[b] == 0)
+			continue;
+		sum += hist[b];
+		format_ns(lo, sizeof(lo), (uint64_t)1 << b);
+		format_ns(hi, sizeof(hi), (uint64_t)1 << (b + 1));
+		printf("  %7s - %-7s %12ju %7.3f%%  ", lo,
+				b == KUPPERF_BUCKETS - 1 ? "" : hi, (uintmax_t)hist[b],
+				100.0 * hist[b] / cnt);
+		for (uint64_t i = 0; i < (hist[b] * 30 + max - 1) / max; i++)
+			putchar('#');
+		// Percentiles are only known up to the bucket.
+		for (; mark < 3 && sum * 100.0 >= marks[mark] * cnt; mark++)
+			printf(" p%g", marks[mark]);
+		putchar('\n');
+	}
+}
+
+static size_t
+parse_size(const char* s)
+{
+	char* end;
+	size_t size = strtoul(s, &end, 10);
+
+	switch (*end) {
+	case 'k': case 'K': return (size << 10);
+	case 'm': case 'M': return (size << 20);
+	default: return (size);
+	}
+}
+
+int
+main(int argc, char* argv[])
+{
+	const char* device = "/dev/" KUPPERF_DEVICE;
+	struct kupperf_peer peer = { 0 };
+	struct kernproxy_geometry geo;
+	struct kuploop* loop = NULL;
+	pthread_t* module_threads = NULL;
+	size_t chans = 1, size;
+	int standin = 0, seconds = 10, opt;
+	void* handle;
+
+	while ((opt = getopt(argc, argv, "ld:m:P:s:b:t:")) != -1) {
+		switch (opt) {
+		case 'l': standin = 1; break;
+		case 'd': device = optarg; break;
+		case 'm':
+			for (conf.kc_mode = 0; conf.kc_mode < 3; conf.kc_mode++)
+				if (strcmp(optarg, modes[conf.kc_mode]) == 0)
+					break;
+			break;
+		case 'P': chans = strtoul(optarg, NULL, 10); break;
+		case 's': conf.kc_size = parse_size(optarg); break;
+		case 'b': conf.kc_batch = strtoul(optarg, NULL, 10); break;
+		case 't': seconds = atoi(optarg); break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc || conf.kc_mode > KUPPERF_GENERATOR || chans < 1 ||
+		conf.kc_size < sizeof(struct kupperf_msg) || conf.kc_batch < 1 ||
+		seconds < 1)
+		goto usage;
+	conf.kc_duration_ms = seconds * 1000;
+
+	if (standin) {
+		// Room for the batches, and for the report of the module.
+		long page_size = sysconf(_SC_PAGESIZE);
+		size = (size_t)conf.kc_size * conf.kc_batch;
+		if (size < sizeof(struct kupperf_report))
+			size = sizeof(struct kupperf_report);
+		size = (size + page_size - 1) / page_size;
+		loop = kuploop_create(size, chans);
+		if (loop == NULL) {
+			fprintf(stderr, "Failed to create the stand-in\n");
+			return 1;
+		}
+		peer.loop = loop;
+		peer.max_send = peer.max_receive = size * page_size;
+		module_threads = calloc(chans, sizeof(pthread_t));
+		for (size_t i = 0; i < chans; i++)
+			pthread_create(&module_threads[i], NULL, module_main, &peer);
+		handle = kuploop_open(loop);
+		device = "the stand-in";
+	} else
+		handle = kernproxy_open(device);
+	if (handle == NULL || kernproxy_geometry(handle, &geo)) {
+		fprintf(stderr, "Failed to open %s\n", device);
+		return 1;
+	}
+	void** channels = calloc(chans, sizeof(void*));
+	if (chans > geo.channels ||
+		kernproxy_channels(handle, 0, chans, geo.size, channels)) {
+		fprintf(stderr, "Failed to attach %zu channels of %s\n", chans,
+				device);
+		return 1;
+	}
+
+	printf("kupperf: %s on %zu channels of %s, %u byte messages in batches "
+			"of %u, %d s\n", modes[conf.kc_mode], chans, device, conf.kc_size,
+			conf.kc_batch, seconds);
+	struct session* sessions = calloc(chans, sizeof(*sessions));
+	for (size_t i = 0; i < chans; i++) {
+		sessions[i].index = i;
+		sessions[i].channel = channels[i];
+		pthread_create(&sessions[i].thread, NULL, session_main, &sessions[i]);
+	}
+	for (size_t i = 0; i < chans; i++)
+		pthread_join(sessions[i].thread, NULL);
+	kernproxy_close(handle);
+	if (loop) {
+		kuploop_unload(loop);
+		for (size_t i = 0; i < chans; i++)
+			pthread_join(module_threads[i], NULL);
+		kuploop_destroy(loop);
+	}
+
+	// Both sides measure over their own span, which differ by a turn.
+	struct session sum = { .index = -1 };
+	printf("%6s %14s %10s %9s %14s %9s\n", "chan", "msgs/s", "MB/s", "cpu",
+			"module msgs/s", "cpu");
+	for (size_t i = 0; i <= chans; i++) {
+		struct session* s = i < chans ? &sessions[i] : &sum;
+		if (s != &sum) {
+			sum.msgs += s->msgs;
+			sum.bytes += s->bytes;
+			sum.elapsed_ns += s->elapsed_ns;
+			sum.cpu_ns += s->cpu_ns;
+			sum.report.kr_msgs += s->report.kr_msgs;
+			sum.report.kr_elapsed_ns += s->report.kr_elapsed_ns;
+			sum.report.kr_cpu_ns += s->report.kr_cpu_ns;
+			for (int b = 0; b < KUPPERF_BUCKETS; b++) {
+				sum.hist[b] += s->hist[b];
+				sum.report.kr_hist[b] += s->report.kr_hist[b];
+			}
+		}
+		// The sum is over the average span, and its CPU usage is in percent
+		// of one CPU.
+		double elapsed = s->elapsed_ns / 1e9 / (s == &sum ? chans : 1);
+		double module_elapsed = s->report.kr_elapsed_ns / 1e9 /
+				(s == &sum ? chans : 1);
+		char name[16];
+		if (s == &sum)
+			snprintf(name, sizeof(name), "sum");
+		else
+			snprintf(name, sizeof(name), "%d", s->index);
+		printf("%6s %14.0f %10.1f %8.1f%% %14.0f %8.1f%%\n", name,
+				elapsed ? s->msgs / elapsed : 0,
+				elapsed ? s->bytes / elapsed / 1e6 : 0,
+				elapsed ? s->cpu_ns / 1e7 / elapsed : 0,
+				module_elapsed ? s->report.kr_msgs / module_elapsed : 0,
+				module_elapsed ? s->report.kr_cpu_ns / 1e7 / module_elapsed :
+				0);
+	}
+	print_hist("daemon side, from passing the turn to getting it back",
+			sum.hist);
+	print_hist("module side, from passing the turn to getting it back",
+			sum.report.kr_hist);
+	return 0;
+
+usage:
+	fprintf(stderr, "usage: %s [-l] [-d device] [-m echo|sink|generator] "
+			"[-P channels] [-s msg_size] [-b batch] [-t seconds]\n", argv[0]);
+	return 1;
+}
@@ -0,0 +1,140 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+#pragma once
+
+/**
+ * Protocol spoken by kupperf and the kupperf kernel module, or the stand-in
+ * for the module that kupperf runs on top of kuploop. The module speaks first
+ * on every channel with a hello, kupperf answers with the configuration of the
+ * run, and the module then drives the exchange until the duration of the run
+ * is over, when it sends its report in place of the next message. kupperf
+ * answers the report with a bye and detaches.
+ *
+ * Every message starts with a struct kupperf_msg.
+ */
+
+#ifdef _KERNEL
+#include <sys/types.h>
+#else
+#include <stdint.h>
+#endif
+
+#define KUPPERF_MAGIC		0x6670756b
+#define KUPPERF_VERSION		1
+#define KUPPERF_DEVICE		"kupperf"
+
+enum {
+	KUPPERF_HELLO = 1,
+	KUPPERF_CONFIG,
+	KUPPERF_DATA,
+	KUPPERF_DONE,
+	KUPPERF_BYE
+};
+
+// What the module does with the channel during a run
+enum {
+	// Echoes every message of kupperf back
+	KUPPERF_ECHO,
+	// Takes messages from kupperf and answers each with an empty one
+	KUPPERF_SINK,
+	// Sends messages to kupperf, which answers each with an empty one
+	KUPPERF_GENERATOR
+};
+
+// Latency histograms have a bucket per power of two nanoseconds.
+enum { KUPPERF_BUCKETS = 40 };
+
+struct kupperf_msg {
+	uint32_t	km_type;
+	// Number of messages of the run batched in this one
+	uint32_t	km_count;
+};
+
+struct kupperf_hello {
+	struct kupperf_msg	kh_msg;
+	uint32_t			kh_magic;
+	uint32_t			kh_version;
+	// Largest message the module sends, and takes, on the channel
+	uint32_t			kh_max_send;
+	uint32_t			kh_max_receive;
+};
+
+struct kupperf_config {
+	struct kupperf_msg	kc_msg;
+	uint32_t			kc_mode;
+	// Size of a message, and number of messages passed per turn
+	uint32_t			kc_size;
+	uint32_t			kc_batch;
+	uint32_t			kc_duration_ms;
+};
+
+struct kupperf_report {
+	struct kupperf_msg	kr_msg;
+	// Messages and bytes the module has received, or sent as a generator
+	uint64_t			kr_msgs;
+	uint64_t			kr_bytes;
+	uint64_t			kr_elapsed_ns;
+	// CPU time of the thread serving the channel
+	uint64_t			kr_cpu_ns;
+	// Time from passing the turn to kupperf to getting it back
+	uint64_t			kr_hist[KUPPERF_BUCKETS];
+};
+
+/**
+ * Returns the latency histogram bucket of 'ns' nanoseconds.
+ */
+static inline int
+kupperf_bucket(uint64_t ns)
+{
+	int b = ns ? 63 - __builtin_clzll(ns) : 0;
+	return (b < KUPPERF_BUCKETS ? b : KUPPERF_BUCKETS - 1);
+}
+
+/**
+ * The module side of kupperf, on a KUP device or on the stand-in.
+ */
+struct kupperf_peer {
+#ifdef _KERNEL
+	struct kupdev_softc*	sc;
+#else
+	struct kuploop*			loop;
+#endif
+	// Room for messages on each channel, either way
+	size_t					max_send;
+	size_t					max_receive;
+	// Set when the peer is going away. The threads serving it finish the
+	// current turn and return from kupperf_serve(). Accessed atomically.
+	unsigned int			stop;
+};
+
+void kupperf_serve(struct kupperf_peer* peer);
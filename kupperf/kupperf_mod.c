@@ -0,0 +1,165 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+#include <sys/param.h>
+#include <sys/module.h>
+#include <sys/kernel.h>
+#include <sys/systm.h>
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/proc.h>
+#include <sys/kthread.h>
+#include <machine/atomic.h>
+
+#include "../kupdev/kup_dev.h"
+#include "kupperf.h"
+
+/**
+ * Companion kernel module of kupperf. Creates the kupperf KUP device and
+ * serves kupperf runs on its channels, one kernel thread per channel. The
+ * channel count and the size of the channels in pages are read from the
+ * kupperf.channels and kupperf.size loader tunables.
+ */
+
+static int kupperf_channels = 4;
+TUNABLE_INT("kupperf.channels", &kupperf_channels);
+static int kupperf_size = 16;
+TUNABLE_INT("kupperf.size", &kupperf_size);
+
+static struct kupperf_peer kupperf_peer;
+static struct proc* kupperf_proc;
+// Number of threads still serving, protected by 'kupperf_lock'
+static int kupperf_running;
+static struct mtx kupperf_lock;
+
+static void
+kupperf_thread(void* arg)
+{
+	kupperf_serve(arg);
+	mtx_lock(&kupperf_lock);
+	if (--kupperf_running == 0)
+		wakeup(&kupperf_running);
+	mtx_unlock(&kupperf_lock);
+	kthread_exit();
+}
+
+static int
+kupperf_load(void)
+{
+	int error = 0, started = 0;
+
+	if (kupperf_channels < 1 || kupperf_channels > KUP_MAX_CHANNELS ||
+		kupperf_size < 1)
+		return (EINVAL);
+	kupperf_peer.sc = kupdev_create(KUPPERF_DEVICE, kupperf_size,
+			kupperf_channels);
+	if (kupperf_peer.sc == NULL)
+		return (ENOMEM);
+	kupperf_peer.max_send = kupperf_size * PAGE_SIZE;
+	kupperf_peer.max_receive = kupperf_size * PAGE_SIZE;
+	mtx_init(&kupperf_lock, "kupperf", NULL, MTX_DEF);
+	for (int i = 0; i < kupperf_channels; i++) {
+		// Counted before it starts, as the thread drops the count as soon
+		// as it is done serving.
+		mtx_lock(&kupperf_lock);
+		kupperf_running++;
+		mtx_unlock(&kupperf_lock);
+		error = kproc_kthread_add(kupperf_thread, &kupperf_peer,
+				&kupperf_proc, NULL, 0, 0, "kupperf", "chan%d", i);
+		if (error) {
+			mtx_lock(&kupperf_lock);
+			kupperf_running--;
+			mtx_unlock(&kupperf_lock);
+			break;
+		}
+		started++;
+	}
+	if (started == 0) {
+		kupdev_unload(kupperf_peer.sc);
+		mtx_destroy(&kupperf_lock);
+		return (error);
+	}
+	kupdev_notify(kupperf_peer.sc);
+	return (0);
+}
+
+static int
+kupperf_unload(void)
+{
+	// Fails while kupperf is attached. The threads keep serving then.
+	if (kupdev_disable(kupperf_peer.sc))
+		return (EBUSY);
+	// The threads may be anywhere in a session or between sessions, and
+	// still use the device until they are gone.
+	atomic_store_int(&kupperf_peer.stop, 1);
+	mtx_lock(&kupperf_lock);
+	while (kupperf_running > 0)
+		mtx_sleep(&kupperf_running, &kupperf_lock, 0, "kupperf", 0);
+	mtx_unlock(&kupperf_lock);
+	kupdev_destroy(kupperf_peer.sc);
+	mtx_destroy(&kupperf_lock);
+	return (0);
+}
+
+static int
+kupperf_event_handler(struct module *mod, int event_t, void *arg)
+{
+	int retval = 0;
+
+	switch (event_t) {
+	case MOD_LOAD:
+		retval = kupperf_load();
+		if (retval)
+			printf("kupperf: failed to load (%d)\n", retval);
+		break;
+	case MOD_UNLOAD:
+	case MOD_SHUTDOWN:
+		retval = kupperf_unload();
+		if (retval)
+			printf("kupperf: cannot unload while kupperf is running\n");
+		break;
+	default:
+		retval = EOPNOTSUPP;
+		break;
+	}
+
+	return (retval);
+}
+
+static moduledata_t kupperf_module_data = {
+	"kupperf",
+	kupperf_event_handler,
+	NULL
+};
+
+DECLARE_MODULE(kupperf, kupperf_module_data, SI_SUB_DRIVERS, SI_ORDER_MIDDLE);
+MODULE_VERSION(kupperf, 1);
+MODULE_DEPEND(kupperf, kup_dev, 1, 1, 1);
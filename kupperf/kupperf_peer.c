@@ -0,0 +1,201 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * The module side of kupperf. Compiled into the kupperf kernel module on top
+ * of the kupdev API, and into kupperf on top of the matching kuploop API, so
+ * that both run the very same exchange.
+ */
+
+#ifdef _KERNEL
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/kernel.h>
+#include <sys/malloc.h>
+#include <sys/proc.h>
+#include <sys/time.h>
+#include <sys/syscallsubr.h>
+#include <machine/atomic.h>
+
+#include "../kupdev/kup_dev.h"
+#else
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../kuplib/kuploop.h"
+#endif
+
+#include "kupperf.h"
+
+#ifdef _KERNEL
+static MALLOC_DEFINE(M_KUPPERF, "kupperf", "kupperf message buffers");
+
+#define peer_wait(p)			kupdev_wait_channel((p)->sc)
+#define peer_send(p, c, d, l)	kupdev_send((p)->sc, (d), (l), (c))
+#define peer_receive(p, c, l)	kupdev_receive_msg((p)->sc, (c), (l))
+#define peer_alloc(n)			malloc((n), M_KUPPERF, M_WAITOK | M_ZERO)
+#define peer_free(b)			free((b), M_KUPPERF)
+#define peer_stopped(p)			atomic_load_int(&(p)->stop)
+
+static uint64_t
+peer_now(void)
+{
+	return (sbttons(sbinuptime()));
+}
+
+static uint64_t
+peer_cpu(void)
+{
+	struct timespec ts;
+
+	kern_thread_cputime(NULL, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+#else
+#define peer_wait(p)			kuploop_wait_channel((p)->loop)
+#define peer_send(p, c, d, l)	kuploop_send((p)->loop, (d), (l), (c))
+#define peer_receive(p, c, l)	kuploop_receive_msg((p)->loop, (c), (l))
+#define peer_alloc(n)			calloc(1, (n))
+#define peer_free(b)			free(b)
+#define peer_stopped(p)			__atomic_load_n(&(p)->stop, __ATOMIC_RELAXED)
+
+static uint64_t
+clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+#define peer_now()				clock_ns(CLOCK_MONOTONIC)
+#define peer_cpu()				clock_ns(CLOCK_THREAD_CPUTIME_ID)
+#endif
+
+/**
+ * Runs one session of kupperf on channel 'chan_id', from the hello to the
+ * report. Returns once the run is over or the daemon has gone away.
+ */
+static void
+serve_session(struct kupperf_peer* peer, int chan_id)
+{
+	struct kupperf_hello hello = {
+		.kh_msg = { KUPPERF_HELLO, 0 },
+		.kh_magic = KUPPERF_MAGIC,
+		.kh_version = KUPPERF_VERSION,
+		.kh_max_send = peer->max_send,
+		.kh_max_receive = peer->max_receive
+	};
+	struct kupperf_msg go = { KUPPERF_DATA, 0 };
+	struct kupperf_config conf;
+	struct kupperf_report* report;
+	uint8_t* buf = NULL;
+	void* msg;
+	size_t len, total;
+
+	if (peer_send(peer, chan_id, &hello, sizeof(hello)))
+		return;
+	msg = peer_receive(peer, chan_id, &len);
+	if (msg == NULL || len < sizeof(conf))
+		return;
+	memcpy(&conf, msg, sizeof(conf));
+	total = (size_t)conf.kc_size * conf.kc_batch;
+
+	report = peer_alloc(sizeof(*report));
+	report->kr_msg.km_type = KUPPERF_DONE;
+	// kupperf checks the configuration against the hello, so anything
+	// wrong here ends the run right away.
+	if (conf.kc_msg.km_type != KUPPERF_CONFIG ||
+		conf.kc_mode > KUPPERF_GENERATOR || conf.kc_batch == 0 ||
+		conf.kc_size < sizeof(struct kupperf_msg) ||
+		total > (conf.kc_mode == KUPPERF_GENERATOR ? peer->max_send :
+			peer->max_receive))
+		conf.kc_duration_ms = 0;
+	if (conf.kc_mode == KUPPERF_GENERATOR && conf.kc_duration_ms > 0) {
+		buf = peer_alloc(total);
+		memset(buf, 'k', total);
+		((struct kupperf_msg*)buf)->km_type = KUPPERF_DATA;
+		((struct kupperf_msg*)buf)->km_count = conf.kc_batch;
+	}
+
+	uint64_t start = peer_now(), cpu = peer_cpu();
+	uint64_t end = start + (uint64_t)conf.kc_duration_ms * 1000000;
+	// The message of the module for the next turn.
+	void* data = conf.kc_mode == KUPPERF_GENERATOR ? (void*)buf : &go;
+	size_t data_len = conf.kc_mode == KUPPERF_GENERATOR ? total : sizeof(go);
+	for (;;) {
+		uint64_t sent = peer_now();
+		if (sent >= end || peer_stopped(peer))
+			break;
+		if (peer_send(peer, chan_id, data, data_len))
+			goto out;
+		msg = peer_receive(peer, chan_id, &len);
+		if (msg == NULL)
+			goto out;
+		report->kr_hist[kupperf_bucket(peer_now() - sent)]++;
+		if (conf.kc_mode == KUPPERF_GENERATOR) {
+			report->kr_msgs += conf.kc_batch;
+			report->kr_bytes += total;
+			continue;
+		}
+		if (len >= sizeof(struct kupperf_msg))
+			report->kr_msgs += ((struct kupperf_msg*)msg)->km_count;
+		report->kr_bytes += len;
+		if (conf.kc_mode == KUPPERF_ECHO) {
+			// Straight from the channel, kupdev_send() copies it over.
+			data = msg;
+			data_len = len;
+		}
+	}
+	report->kr_elapsed_ns = peer_now() - start;
+	report->kr_cpu_ns = peer_cpu() - cpu;
+	if (peer_send(peer, chan_id, report, sizeof(*report)) == 0)
+		peer_receive(peer, chan_id, &len);
+out:
+	if (buf)
+		peer_free(buf);
+	peer_free(report);
+}
+
+/**
+ * Serves kupperf on every channel a daemon attaches to, one at a time,
+ * until the device goes away or the peer is stopped.
+ */
+void
+kupperf_serve(struct kupperf_peer* peer)
+{
+	int chan_id;
+
+	while (!peer_stopped(peer) && (chan_id = peer_wait(peer)) >= 0)
+		serve_session(peer, chan_id);
+}
@@ -0,0 +1,368 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020-2021, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+
+/**
+ * A top-like view of KUP devices. Maps the statistics of each device named
+ * on the command line read-only, see kernproxy_stats(), and shows the rates
+ * of its channels over each interval, the busiest first. A channel whose
+ * kernel side has been waiting for the turn for longer than the stuck
+ * threshold is flagged and listed before the others, as the daemon attached
+ * to it is not passing the turn back. Looking costs the devices nothing.
+ *
+ * usage: kupstat [-a] [-b] [-i seconds] [-n count] [-N rows] [-w seconds]
+ *                device ...
+ *
+ *   -a            list all channels, not only those with a daemon or traffic
+ *   -b            print the updates one after another instead of redrawing
+ *                 the screen
+ *   -i seconds    time between updates (default 1)
+ *   -n count      number of updates, 0 for no limit (default 0)
+ *   -N rows       number of channels listed per device at most (default 20)
+ *   -w seconds    time the kernel side waits for the turn before the channel
+ *                 is flagged as stuck (default 1)
+ *
+ * A device is given by its path, or by its name under /dev.
+ *
+ * The columns are the messages and megabytes per second sent to the daemon
+ * (OUT) and received from it (IN), the share of the interval the kernel side
+ * spent spinning (SPIN%) and sleeping (SLP%) for the turn, sleeps per second,
+ * for how long the kernel side has been waiting for the turn now (WAIT), and
+ * the number of attaches and detaches so far. The total of a device sums
+ * its channels, except for WAIT which is the longest wait.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include "../kuplib/kup.h"
+#include "../kuplib/kup_stats.h"
+
+struct device {
+	char					path[256];
+	void*					stats;
+	// The previous sample of the statistics of each channel, with room for
+	// 'prev_max' channels
+	struct kup_chan_stats*	prev;
+	size_t					prev_max;
+};
+
+struct row {
+	size_t		index;
+	pid_t		pid;
+	double		msgs_out;
+	double		mb_out;
+	double		msgs_in;
+	double		mb_in;
+	double		spin;
+	double		sleep;
+	double		sleeps;
+	// Seconds the kernel side has been waiting for the turn, 0 if it is not
+	double		waiting;
+	int			stuck;
+	uint64_t	attaches;
+	uint64_t	detaches;
+};
+
+static int all, batch;
+static size_t rows_max = 20;
+static double stuck_secs = 1;
+
+static uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/**
+ * Stuck channels first, the longest waiting first, then the busiest ones.
+ */
+static int
+row_cmp(const void* a, const void* b)
+{
+	const struct row* x = a;
+	const struct row* y = b;
+	double tx = x->msgs_out + x->msgs_in, ty = y->msgs_out + y->msgs_in;
+
+	if (x->stuck != y->stuck)
+		return (y->stuck - x->stuck);
+	if (x->stuck && x->waiting != y->waiting)
+		return (x->waiting < y->waiting ? 1 : -1);
+	if (tx != ty)
+		return (tx < ty ? 1 : -1);
+	return (x->index < y->index ? -1 : 1);
+}
+
+/**
+ * Takes a sample of the statistics of 'dev' and keeps it for the next one.
+ * Returns the number of channels, or -1 with errno set.
+ */
+static ssize_t
+sample(struct device* dev, struct kup_chan_stats** out)
+{
+	const struct kup_chan_stats* cur;
+	struct kup_chan_stats* s;
+	size_t cnt;
+
+	cur = kernproxy_stats(dev->stats, &cnt);
+	if (cur == NULL)
+		return (-1);
+	s = malloc(cnt * sizeof(*s));
+	if (s == NULL)
+		return (-1);
+	// The counters keep moving, this is as close to a snapshot as we get.
+	memcpy(s, cur, cnt * sizeof(*s));
+	*out = s;
+	return (cnt);
+}
+
+/**
+ * Fills in 'r' with the rates of the channel whose statistics went from 'p'
+ * to 'c' over 'secs' seconds, up to 'now'.
+ */
+static void
+fill_row(struct row* r, const struct kup_chan_stats* c,
+		const struct kup_chan_stats* p, uint64_t now, double secs)
+{
+// A retired channel that came back starts from zero.
+#define DELTA(f)	(double)(c->f >= p->f ? c->f - p->f : c->f)
+	r->pid = c->ks_pid;
+	r->msgs_out = DELTA(ks_msgs_out) / secs;
+	r->mb_out = DELTA(ks_bytes_out) / secs / 1e6;
+	r->msgs_in = DELTA(ks_msgs_in) / secs;
+	r->mb_in = DELTA(ks_bytes_in) / secs / 1e6;
+	r->spin = DELTA(ks_spin_ns) / secs / 1e7;
+	r->sleep = DELTA(ks_sleep_ns) / secs / 1e7;
+	r->sleeps = DELTA(ks_sleeps) / secs;
+#undef DELTA
+	r->waiting = 0;
+	if (c->ks_wait_start != 0 && c->ks_wait_start < now)
+		r->waiting = (now - c->ks_wait_start) / 1e9;
+	r->stuck = c->ks_pid != 0 && r->waiting >= stuck_secs;
+	r->attaches = c->ks_attaches;
+	r->detaches = c->ks_detaches;
+}
+
+static void
+print_row(const char* name, const char* pid, const char* state,
+		const struct row* r)
+{
+	char wait[16] = "-";
+
+	if (r->waiting > 0)
+		snprintf(wait, sizeof(wait), "%.1f", r->waiting);
+	printf("%5s %5s %-5s %8.0f %7.1f %8.0f %7.1f %5.1f %5.1f %6.0f %6s "
+			"%4ju %4ju\n", name, pid, state, r->msgs_out, r->mb_out,
+			r->msgs_in, r->mb_in, r->spin, r->sleep, r->sleeps, wait,
+			(uintmax_t)r->attaches, (uintmax_t)r->detaches);
+}
+
+static void
+show_device(struct device* dev, uint64_t now, double secs)
+{
+	struct kup_chan_stats *cur, *prev;
+	struct row *rows, total;
+	size_t listed = 0, attached = 0, stuck = 0;
+	char name[16], pid[16];
+	const char* state;
+	ssize_t cnt;
+
+	cnt = sample(dev, &cur);
+	if (cnt < 0) {
+		printf("%s: %s\n\n", dev->path, strerror(errno));
+		return;
+	}
+	if ((size_t)cnt > dev->prev_max) {
+		prev = realloc(dev->prev, cnt * sizeof(*prev));
+		if (prev == NULL) {
+			printf("%s: %s\n\n", dev->path, strerror(errno));
+			free(cur);
+			return;
+		}
+		memset(prev + dev->prev_max, 0,
+				(cnt - dev->prev_max) * sizeof(*prev));
+		dev->prev = prev;
+		dev->prev_max = cnt;
+	}
+	rows = calloc(cnt ? cnt : 1, sizeof(*rows));
+	if (rows == NULL) {
+		printf("%s: %s\n\n", dev->path, strerror(errno));
+		free(cur);
+		return;
+	}
+	memset(&total, 0, sizeof(total));
+	for (size_t i = 0; i < (size_t)cnt; i++) {
+		struct row* r = &rows[listed];
+
+		r->index = i;
+		fill_row(r, &cur[i], &dev->prev[i], now, secs);
+		total.msgs_out += r->msgs_out;
+		total.mb_out += r->mb_out;
+		total.msgs_in += r->msgs_in;
+		total.mb_in += r->mb_in;
+		total.spin += r->spin;
+		total.sleep += r->sleep;
+		total.sleeps += r->sleeps;
+		total.waiting = r->waiting > total.waiting ? r->waiting :
+				total.waiting;
+		total.attaches += r->attaches;
+		total.detaches += r->detaches;
+		attached += r->pid != 0;
+		stuck += r->stuck;
+		if (all || r->pid != 0 || r->msgs_out > 0 || r->msgs_in > 0)
+			listed++;
+	}
+	// Channels that are retired and come back start from zero.
+	memcpy(dev->prev, cur, cnt * sizeof(*cur));
+	memset(dev->prev + cnt, 0, (dev->prev_max - cnt) * sizeof(*cur));
+	free(cur);
+
+	qsort(rows, listed, sizeof(*rows), row_cmp);
+	printf("%s: %zd channels, %zu attached, %zu stuck\n", dev->path, cnt,
+			attached, stuck);
+	printf("%5s %5s %-5s %8s %7s %8s %7s %5s %5s %6s %6s %4s %4s\n",
+			"CHAN", "PID", "STATE", "OUT/s", "OUTMB/s", "IN/s", "INMB/s",
+			"SPIN%", "SLP%", "SLP/s", "WAIT", "ATT", "DET");
+	print_row("total", "", "", &total);
+	for (size_t i = 0; i < listed && i < rows_max; i++) {
+		struct row* r = &rows[i];
+
+		if (r->stuck)
+			state = "STUCK";
+		else if (r->msgs_out > 0 || r->msgs_in > 0)
+			state = "run";
+		else if (r->waiting > 0)
+			state = "wait";
+		else if (r->pid != 0)
+			state = "idle";
+		else
+			state = "-";
+		snprintf(name, sizeof(name), "%zu", r->index);
+		if (r->pid != 0)
+			snprintf(pid, sizeof(pid), "%d", (int)r->pid);
+		else
+			strcpy(pid, "-");
+		print_row(name, pid, state, r);
+	}
+	if (listed > rows_max)
+		printf("  ... %zu more\n", listed - rows_max);
+	printf("\n");
+	free(rows);
+}
+
+int
+main(int argc, char* argv[])
+{
+	struct device* devs;
+	struct timespec ts;
+	uint64_t last, now;
+	double interval = 1;
+	long count = 0;
+	int ndevs, opt;
+
+	while ((opt = getopt(argc, argv, "abi:n:N:w:")) != -1) {
+		switch (opt) {
+		case 'a': all = 1; break;
+		case 'b': batch = 1; break;
+		case 'i': interval = atof(optarg); break;
+		case 'n': count = atol(optarg); break;
+		case 'N': rows_max = strtoul(optarg, NULL, 0); break;
+		case 'w': stuck_secs = atof(optarg); break;
+		default:
+			goto usage;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc == 0 || interval <= 0 || count < 0 || stuck_secs <= 0)
+		goto usage;
+
+	ndevs = argc;
+	devs = calloc(ndevs, sizeof(*devs));
+	for (int i = 0; i < ndevs; i++) {
+		struct device* dev = &devs[i];
+		struct kup_chan_stats* s;
+		ssize_t cnt;
+
+		snprintf(dev->path, sizeof(dev->path), "%s%s",
+				strchr(argv[i], '/') ? "" : "/dev/", argv[i]);
+		dev->stats = kernproxy_stats_open(dev->path);
+		if (dev->stats == NULL) {
+			fprintf(stderr, "%s: %s\n", dev->path, errno == EPROTONOSUPPORT ?
+					"not a KUP device this kupstat can read" :
+					strerror(errno));
+			return (1);
+		}
+		// The first update shows the rates over the first interval.
+		cnt = sample(dev, &s);
+		if (cnt < 0) {
+			fprintf(stderr, "%s: %s\n", dev->path, strerror(errno));
+			return (1);
+		}
+		dev->prev = s;
+		dev->prev_max = cnt;
+	}
+
+	last = clock_ns();
+	for (long n = 0; count == 0 || n < count; n++) {
+		ts.tv_sec = (time_t)interval;
+		ts.tv_nsec = (long)((interval - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+		now = clock_ns();
+		if (!batch)
+			printf("\033[H\033[2J");
+		printf("kupstat: interval %.1fs, stuck after %.1fs\n\n",
+				(now - last) / 1e9, stuck_secs);
+		for (int i = 0; i < ndevs; i++)
+			show_device(&devs[i], now, (now - last) / 1e9);
+		fflush(stdout);
+		last = now;
+	}
+
+	for (int i = 0; i < ndevs; i++) {
+		kernproxy_stats_close(devs[i].stats);
+		free(devs[i].prev);
+	}
+	free(devs);
+	return (0);
+
+usage:
+	fprintf(stderr, "usage: kupstat [-a] [-b] [-i seconds] [-n count] "
+			"[-N rows] [-w seconds]\n               device ...\n");
+	return (1);
+}
@@ -0,0 +1,143 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/event.h>
+#include <sys/user.h>
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <assert.h>
+
+#include "../kup.h"
+
+/*
+ * The process that attached the channel hands it off to a child process,
+ * with the turn still ours, and exits. The child takes over the channel
+ * and finishes the exchange with the kernel.
+ */
+static int
+successor(int sock)
+{
+	void* channel;
+
+	void* handle = kernproxy_adopt(sock);
+	if (!handle) {
+		perror("kernproxy_adopt");
+		return 1;
+	}
+	if (kernproxy_attached(handle, &channel, 1) != 1 ||
+			kernproxy_channel_index(channel) != 0) {
+		fprintf(stderr, "Channel 0 was not handed off\n");
+		return 1;
+	}
+	char token[] = "Nonce for SKMBHO01";
+	kernproxy_send(channel, token, sizeof(token), 0);
+	void* data = kernproxy_receive(channel, 0);
+	if (!data) {
+		fprintf(stderr, "Error: recv failed.\n");
+		return 1;
+	}
+	fprintf(stderr, "kernel:<%s>\n", (char*)data);
+	for (int i = 0; i < strlen(token); i++) {
+		if (((char*)data)[i] != token[i] + 1) {
+			fprintf(stderr, "Token mismatch\n");
+			return 1;
+		}
+	}
+	kernproxy_close(handle);
+	return 0;
+}
+
+int main(int argc, char* argv[])
+{
+	char const* dev_name = "/dev/kup_dev";
+	void* channel;
+	int socks[2], status;
+	pid_t pid;
+
+	void* handle = kernproxy_open(dev_name);
+	if (!handle) {
+			fprintf(stderr, "Opening device '%s' failed\n", dev_name);
+			goto finito_error;
+	}
+	channel = kernproxy_channel(handle, 0, 1);
+	if (!channel) {
+		fprintf(stderr, "Failed to attach channel 0\n");
+		goto finito_error;
+	}
+	void* data = kernproxy_receive(channel, 0);
+	if (!data || *(char*)data != 0) {
+		fprintf(stderr, "Error: expected null packet.\n");
+		goto finito_error;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) == -1) {
+		perror("socketpair");
+		goto finito_error;
+	}
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		goto finito_error;
+	}
+	if (pid == 0) {
+		close(socks[0]);
+		_exit(successor(socks[1]));
+	}
+	close(socks[1]);
+	if (kernproxy_handoff(handle, socks[0])) {
+		perror("kernproxy_handoff");
+		goto finito_error;
+	}
+	// The channel stays attached through the file passed to the child.
+	kernproxy_close(handle);
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) ||
+			WEXITSTATUS(status) != 0)
+		goto finito_error;
+
+	fprintf(stderr, "Test passed\n");
+	return 0;
+
+finito_error:
+	fprintf(stderr, "Test failed\n");
+	return 1;
+}
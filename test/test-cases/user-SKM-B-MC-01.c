@@ -60,7 +60,7 @@ int main(int argc, char* argv[])
 			goto finito_error;
 	}
 	for (int i = 0; i < kChannelCount; i++) {
-		channel = kernproxy_channel(handle, 0, 1);
+		channel = kernproxy_channel(handle, i, 1);
 		if (!channel) {
 			if (kernproxy_error(handle) == EKU_SHUTDOWN) {
 				fprintf(stderr, "EKU_SHUTDOWN\n");
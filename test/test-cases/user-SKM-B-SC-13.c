@@ -0,0 +1,117 @@
+/**
+ * BSD 3-Clause License
+ * 
+ * Copyright (c) 2020, Amin Saba
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ * 
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ * 
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+**/
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/event.h>
+#include <sys/user.h>
+#include <sys/param.h>
+#include <sys/sysctl.h>
+#include <sys/mount.h>
+#include <assert.h>
+
+#include "../kup.h"
+#include "../../kuplib/kup_stats.h"
+
+int main(int argc, char* argv[])
+{
+	char const* dev_name = "/dev/kup_dev";
+	const struct kup_chan_stats* st;
+	char reply[10] = "SKM-B-SC13";
+	void* channel;
+	void* stats;
+	uint64_t total;
+	size_t len, count;
+
+	void* handle = kernproxy_open(dev_name);
+	if (!handle) {
+			fprintf(stderr, "Opening device '%s' failed\n", dev_name);
+			goto finito_error;
+	}
+	channel = kernproxy_channel(handle, 0, 1);
+	if (!channel) {
+		fprintf(stderr, "Failed to attach channel 0\n");
+		goto finito_error;
+	}
+	if (!kernproxy_receive_msg(channel, 0, &len) || len != 100) {
+		fprintf(stderr, "Error: expected a message of 100 bytes\n");
+		goto finito_error;
+	}
+	kernproxy_send(channel, reply, sizeof(reply), 0);
+	// The kernel has counted its side of the exchange before passing the
+	// turn back.
+	kernproxy_receive(channel, 0);
+
+	stats = kernproxy_stats_open(dev_name);
+	if (!stats) {
+		fprintf(stderr, "Opening the statistics of '%s' failed\n", dev_name);
+		goto finito_error;
+	}
+	st = kernproxy_stats(stats, &count);
+	if (!st || count != 1) {
+		fprintf(stderr, "Error: expected the statistics of one channel\n");
+		goto finito_error;
+	}
+	if (st->ks_msgs_out != 2 || st->ks_bytes_out != 101 ||
+		st->ks_msgs_in != 1 || st->ks_bytes_in != sizeof(reply)) {
+		fprintf(stderr, "Error: wrong message counts\n");
+		goto finito_error;
+	}
+	if (st->ks_attaches != 1 || st->ks_detaches != 0 ||
+		st->ks_pid != getpid()) {
+		fprintf(stderr, "Error: wrong attach counts\n");
+		goto finito_error;
+	}
+	// The sysctl sums the same counters over the device.
+	len = sizeof(total);
+	if (sysctlbyname("dev.kup.kup_dev.msgs_out", &total, &len, NULL, 0) ||
+		total != 2) {
+		fprintf(stderr, "Error: wrong dev.kup.kup_dev.msgs_out\n");
+		goto finito_error;
+	}
+	kernproxy_stats_close(stats);
+	kernproxy_send(channel, reply, 1, 0);
+
+	fprintf(stderr, "Test passed\n");
+	kernproxy_close(handle);
+	return 0;
+
+finito_error:
+	fprintf(stderr, "Test failed\n");
+	return 1;
+}